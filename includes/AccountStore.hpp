@@ -0,0 +1,52 @@
+#ifndef ACCOUNTSTORE_HPP
+#define ACCOUNTSTORE_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "PasswordHash.hpp"
+
+#define ACCOUNT_MAGIC		"IRCACCT1"
+#define ACCOUNT_NAME_MAX	32		// bytes, account names are stored lowercased and NUL-padded
+
+// one fixed-size record of the account file (records are sorted by name)
+struct AccountRecord
+{
+	char				name[ACCOUNT_NAME_MAX];
+	uint32_t			iterations;
+	uint32_t			reserved;
+	unsigned char		salt[PASSWORD_SALT_BYTES];
+	unsigned char		hash[32];
+};
+
+// read-only account database: the file is mmap'ed as is, so loading costs one system call
+// whatever its size, and a lookup is a binary search over the records
+// the file is written by tools/ircaccount
+class AccountStore
+{
+	private:
+		void*					_map;
+		size_t					_mapSize;
+		const AccountRecord*	_records;
+		uint32_t				_count;
+
+		AccountStore(const AccountStore& other);
+		AccountStore& operator=(const AccountStore& other);
+
+	public:
+		AccountStore();
+		~AccountStore();
+
+		bool					open(const std::string& path);
+		bool					isOpen() const;
+		uint32_t				size() const;
+		const AccountRecord*	find(const std::string& name) const;
+		PasswordHash			decoyHash() const; // as costly to check as an account's, matches nothing
+
+		static std::string		normalizeName(const std::string& name);
+		static PasswordHash		hashOf(const AccountRecord& record);
+		// sort and write (name, hash) pairs as an account file, atomically
+		static bool				write(const std::string& path, std::vector<std::pair<std::string, PasswordHash> > accounts);
+};
+
+#endif
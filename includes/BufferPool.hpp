@@ -0,0 +1,46 @@
+#ifndef BUFFERPOOL_HPP
+#define BUFFERPOOL_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#define BUFFER_POOL_MIN				1024				// smaller needs are left to the allocator
+#define BUFFER_POOL_MAX				(64 * 1024)			// larger buffers (a burst's leftover) are freed instead
+#define BUFFER_POOL_DEFAULT_BYTES	(4 * 1024 * 1024)	// capacity the pool keeps at most ("buffer_pool")
+
+// spare string buffers shared by the clients: an idle client gives its buffers back instead of keeping
+// their peak capacity, a client that needs room takes one instead of growing its own from nothing
+// (std::string never shrinks on clear() or erase(): giving the buffer away is what frees it)
+class BufferPool
+{
+	private:
+		std::vector<std::string*>	_spare; // most recently given last (still warm in the cache)
+		size_t				_bytes; // capacity of the spare buffers
+		size_t				_limit;
+		unsigned long		_taken;
+		unsigned long		_given;
+		unsigned long		_freed; // given but over the limit or too large: back to the allocator
+
+		// avoid copying
+		BufferPool(const BufferPool& other);
+		BufferPool& operator=(const BufferPool& other);
+
+	public:
+		BufferPool();
+		~BufferPool();
+
+		void				setLimit(size_t bytes);
+		size_t				give(std::string& buffer); // buffer is left empty without capacity, returns the bytes it had
+		void				take(std::string& buffer, size_t size); // room for size bytes, keeping the content, if the pool has it
+		size_t				spareBuffers() const;
+		size_t				spareBytes() const;
+		unsigned long		taken() const;
+		unsigned long		given() const;
+		unsigned long		freed() const;
+};
+
+// heap bytes a string owns (libstdc++ keeps up to 15 characters inside the object)
+size_t				stringHeapBytes(const std::string& s);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <string>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC			"IRCCAPT1"
+#define CAPTURE_FLUSH_BYTES		(64 * 1024)	// buffered records are written out past this size (and every second)
+
+// inbound traffic capture ("capture_file" in the config), replayed by tools/ircreplay
+// file: [magic] then records [u8 type][varint microseconds since the previous record][varint connection]
+// [varint length][length bytes]; varints are LEB128, so a record header is usually 4 to 6 bytes
+// CAPTURE_CLOCK opens each process's part of the file (a binary upgrade appends to the same file)
+// and starts a new range of connection ids (they are the clients' serials)
+enum CaptureRecordType
+{
+	CAPTURE_CLOCK = 1,		// payload: u64 microseconds since epoch (native order), connection 0
+	CAPTURE_CONNECT = 2,	// a client connected, no payload
+	CAPTURE_DATA = 3,		// bytes received from the client (decrypted for TLS)
+	CAPTURE_CLOSE = 4		// the connection is gone, no payload
+};
+
+struct CaptureRecord
+{
+	uint8_t				type;
+	uint64_t			time;		// microseconds since the first record of the file (clock jumps are left out)
+	uint64_t			connection;	// unique over the whole file (ids are renumbered after each CAPTURE_CLOCK)
+	const char*			data;
+	size_t				length;
+};
+
+// appends records to a capture file through a memory buffer
+class CaptureWriter
+{
+	private:
+		int					_fd;
+		std::string			_buffer;
+		uint64_t			_last; // time of the previous record, microseconds since epoch
+
+		void				_put(uint8_t type, uint64_t delta, uint64_t connection, const char* data, size_t length);
+
+		CaptureWriter(const CaptureWriter& other);
+		CaptureWriter& operator=(const CaptureWriter& other);
+
+	public:
+		CaptureWriter();
+		~CaptureWriter();
+
+		bool				open(const std::string& path);
+		bool				isOpen() const;
+		void				record(CaptureRecordType type, uint64_t connection, const char* data = NULL, size_t length = 0);
+		void				flush();
+		void				close();
+};
+
+// walks a mmap'ed capture file
+class CaptureReader
+{
+	private:
+		void*				_map;
+		size_t				_mapSize;
+		const unsigned char*	_pos;
+		const unsigned char*	_end;
+		uint64_t			_time;
+		uint64_t			_epoch;		// number of CAPTURE_CLOCK records seen
+
+		bool				_getVarint(uint64_t& value);
+
+		CaptureReader(const CaptureReader& other);
+		CaptureReader& operator=(const CaptureReader& other);
+
+	public:
+		CaptureReader();
+		~CaptureReader();
+
+		bool				open(const std::string& path);
+		bool				next(CaptureRecord& record); // false at the end of the file or on a truncated record
+		bool				atEnd() const;
+};
+
+#endif
@@ -5,9 +5,22 @@
 #include <list>
 #include <map>
 #include <set>
+#include <deque>
+#include <vector>
+
+#define CHANNEL_HISTORY_LINES  512          // max messages kept per channel
+#define CHANNEL_HISTORY_BYTES  (64 * 1024)  // max bytes kept per channel
 
 class Client;
 
+// one stored channel message, replayed by CHATHISTORY
+struct HistoryEntry
+{
+    unsigned long   msgid;
+    long long       time;   // server-time in milliseconds since epoch
+    std::string     line;   // "nick!user@host PRIVMSG #channel :text" without CRLF
+};
+
 class Channel 
 {
     public:
@@ -21,6 +34,8 @@ class Channel
         bool addOperator(Client* client);
         bool removeOperator(Client* client);
         bool isOperator(Client* client) const;
+        void renameMember(Client* client, const std::string& newNick);
+        void restoreMember(Client* client, bool isOperator); // no key/limit/invite checks (upgrade handoff)
 
         // modes
         void setMode(char mode, bool enabled, Client* setter = NULL, const std::string& param = "");
@@ -41,22 +56,47 @@ class Channel
         // cmds
         bool invite(Client* operatorClient, Client* targetClient);
         bool kick(Client* operatorClient, Client* targetClient, const std::string& reason = "");
+        void addInvite(const std::string& nickname);
+        void addFormerOperator(const std::string& nickname); // an operator a snapshot recorded, re-opped on rejoin
+        void clearFormerOperators();
 
         // getters
         std::string getName() const;
-        std::set<Client*> getMembers() const;
-        std::set<Client*> getOperators() const;
-        std::set<std::string> getInvited() const;
+        const std::set<Client*>& getMembers() const;
+        const std::vector<unsigned>& getMemberSlots() const; // hot table slots of the members, contiguous for fan-out
+        const std::set<Client*>& getOperators() const;
+        const std::set<std::string>& getInvited() const;
+        const std::set<std::string>& getFormerOperators() const;
+        const std::string& getNamesList() const; // "@op nick nick2", kept in sync with members/operators
+
+        // history ring (bounded by CHANNEL_HISTORY_BYTES / CHANNEL_HISTORY_LINES)
+        size_t addHistory(const HistoryEntry& entry); // returns the bytes evicted to make room
+        size_t evictOldestHistory(); // returns the bytes freed
+        const std::deque<HistoryEntry>& getHistory() const;
+        size_t getHistoryBytes() const;
+        static size_t historyEntrySize(const HistoryEntry& entry);
 
     private:
         std::string _name;
         std::set<Client*> _members;
+        std::vector<unsigned> _memberSlots; // same clients as _members, in no particular order
         std::set<Client*> _operators;
-        std::set<std::string> _invited;
+        std::set<std::string> _invited; // casemapped nicks
+        std::set<std::string> _formerOperators; // casemapped nicks, until they rejoin or the restore grace ends
         std::string _topic;
-        std::map<char, bool> _modes; // i, t, k, l, o
+        std::map<char, bool> _modes; // i, t, k, l, o, u
         std::string _key;
         int _limit;
+        std::string _namesList;
+        std::deque<HistoryEntry>* _history; // allocated on the first stored message
+        size_t _historyBytes;
+
+        // avoid copying
+        Channel(const Channel& other);
+        Channel& operator=(const Channel& other);
+
+        size_t _findName(const std::string& nick) const;
+        void _eraseName(const std::string& nick);
 };
 
 #endif
\ No newline at end of file
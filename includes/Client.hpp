@@ -4,33 +4,108 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <ctime>
+#include <sys/socket.h>
+#include "ConnectionLimiter.hpp"
 
+struct ssl_st; // OpenSSL's SSL
+struct ConnectionClass;
+class BufferPool;
+class Client;
+class Channel;
+
+// OPEN until a disconnect is decided; CLOSING clients are out of the server's maps (no more input,
+// no channel) and keep their object and socket until the end of the loop iteration, when their last
+// output is flushed, the socket closed and the object deleted
+enum ClientState
+{
+	CLIENT_OPEN,
+	CLIENT_CLOSING
+};
+
+#define CLIENT_WIRE_CHUNK	16384	// bytes taken from the lanes at a time: the most a PONG can wait behind
+
+// output lanes, written in this order (each lane keeps its own order): CONTROL is what the client's own
+// commands produce plus protocol and membership lines (PONG, ERROR, numerics, JOIN...), DIRECT the messages
+// addressed to it, CHANNEL the channel messages fanned out to it; links and injectors only use CONTROL
+// past half its class's SendQ a client loses CHANNEL lines, past the SendQ DIRECT ones, and a CONTROL line
+// that does not fit gets it disconnected
+enum OutputLane
+{
+	LANE_CONTROL,
+	LANE_DIRECT,
+	LANE_CHANNEL,
+	OUTPUT_LANES
+};
+
+// names a client across loop iterations (thread pool results, the ready queue): the fd alone may
+// belong to another client by then, the serial tells them apart (Server::getClient(handle))
+struct ClientHandle
+{
+	int				fd;
+	unsigned long	serial;
+
+	ClientHandle();
+	explicit ClientHandle(const Client* client);
+};
+
+// a client's per-event state, in one contiguous table indexed by slot (Client::hot): a fan-out to thousands
+// of members reads these 24 bytes each, and only touches the Client object to queue the line
+#define CLIENT_HOT_CLOSING		0x01
+#define CLIENT_HOT_REGISTERED	0x02
+#define CLIENT_HOT_REMOTE		0x04
+#define CLIENT_HOT_LINK			0x08
+#define CLIENT_HOT_INJECTOR		0x10
+
+struct ClientHot
+{
+	int				fd;
+	unsigned		flags;	// CLIENT_HOT_*
+	unsigned long	serial;
+	Client*			client;	// NULL while the slot is free
+};
+
+struct ClientInfo; // the identity and negotiation state, out of line (Client.cpp)
 
 class Client
 {
 	private:
-		// connection infos
-		int					_clientFd;
-		std::string			_ipAddress;
-		int					_port;
-	
-		// IRC identification infos
-		std::string			_nickname;
-		std::string			_username;
-		std::string			_realname;
-		std::string			_hostname;
+		// the output path first: what a delivery touches sits in the object's first cache lines
+		unsigned			_slot;	// in the hot table: fd, serial, state and the flags live there
+		Client*				_uplink; // remote clients only: the link they are reachable through
+		ConnectionClass*	_connectionClass; // of the listener it came from (NULL for links and remote clients)
+		size_t				_sendQueued;	// wire and lanes
+		unsigned long		_droppedLines;	// since the queue last went over the SendQ pressure mark
+		bool				_sendqExceeded;	// a CONTROL line did not fit: the server disconnects the client
+		bool				_readyQueued;	// in the server's ready queue: commands are left for the next turn
+		time_t				_lastRead;	// when bytes last came in
+		time_t				_lastSend;	// when bytes last went out
+		size_t				_laneHeads[OUTPUT_LANES];	// bytes at the front of each lane already moved to the wire
+		std::string			_lanes[OUTPUT_LANES];	// output waiting for the wire, by OutputLane
+		std::string			_sendBuffer;	// the wire: whole lines taken from the lanes, a partial write resumes here
+		std::string			_receiveBuffer;	// Data received waiting to be processed
+
+		// TLS connections: the OpenSSL session, handshake state, and whether the kernel encrypts our sends (kTLS)
+		struct ssl_st*		_tls;
+		bool				_tlsHandshaking;
+		bool				_ktlsSend;
 	
-		// Authentication state
+		// Authentication state (registered is a hot flag)
 		bool				_authenticated;
 		bool				_passwordGiven;
-		bool				_registered; // true when NICK + USER are given
-	
-		// Communication buffers
-		std::string			_receiveBuffer;	// Data received waiting to be processed
-		std::string			_sendBuffer;	// Data to be sent
+		bool				_capNegotiating; // registration is held until CAP END
+		bool				_authPending; // PASS is being checked by the thread pool: input waits
+		int					_meshPeer; // worker index when the link is a shared-memory ring (-1 for sockets)
+		std::string			_nickname;
+
+		// identity, SASL, link name, capabilities: read by commands, never by a delivery
+		ClientInfo*			_info;
 	
 		// Channels the client belongs to
-		std::set<std::string>	_joinedChannels;
+		std::set<Channel*>	_joinedChannels;
+
+		ClientHot&			_hot() const;
+		void				_setFlag(unsigned flag, bool enabled);
 	
 		// Prevent copying
 		Client(const Client& other);
@@ -43,6 +118,10 @@ class Client
 	
 		// Getters
 		int					getClientFd() const;
+		unsigned long		getSerial() const;
+		unsigned			getSlot() const;
+		ClientHandle		getHandle() const;
+		ClientState			getState() const;
 		std::string			getIpAddress() const;
 		int					getPort() const;
 		std::string			getNickname() const;
@@ -52,35 +131,88 @@ class Client
 		bool				isAuthenticated() const;
 		bool				isPasswordGiven() const;
 		bool				isRegistered() const;
+		bool				isCapNegotiating() const;
+		bool				isAuthPending() const;
+		const std::string&	getAccount() const;
+		const std::string&	getSaslMechanism() const;
+		std::string&		getSaslBuffer();
+		bool				hasCapability(const std::string& capability) const;
+		const std::set<std::string>&	getCapabilities() const;
+		bool				isServerLink() const;
+		bool				isLinkOutbound() const;
+		const std::string&	getLinkName() const;
+		bool				isRemote() const;
+		Client*				getUplink() const;
+		bool				isMeshLink() const;
+		const HostKey&		getHostKey() const;
+		ConnectionClass*	getConnectionClass() const;
+		struct ssl_st*		getTls() const;
+		bool				isTlsHandshaking() const;
+		bool				isKtlsSend() const;
+		int					getMeshPeer() const;
+		bool				isInjector() const;
 		const std::string&	getReceiveBuffer() const;
-		const std::string&	getSendBuffer() const;
+		bool				hasCommand() const; // a complete command waits in the receive buffer
+		bool				isReadyQueued() const;
+		std::string			getSendBuffer() const; // all queued output, in the order it would be written
+		size_t				getMemoryUsage() const; // bytes the client owns (its TLS session aside: OpenSSL's)
 
-		const std::set<std::string>&	getJoinedChannels() const;
+		const std::set<Channel*>&	getJoinedChannels() const;
 	
 		// Setters
+		void				setState(ClientState state);
 		void				setNickname(const std::string& nickname);
 		void				setUsername(const std::string& username);
 		void				setRealname(const std::string& realname);
 		void				setHostname(const std::string& hostname);
+		void				setPeerAddress(const struct sockaddr* address, socklen_t length);
 		void				setAuthenticated(bool authenticated);
 		void				setPasswordGiven(bool given);
 		void				setRegistered(bool registered);
+		void				setCapNegotiating(bool negotiating);
+		void				setAuthPending(bool pending);
+		void				setAccount(const std::string& account);
+		void				setSaslMechanism(const std::string& mechanism);
+		void				setCapability(const std::string& capability, bool enabled);
+		void				setServerLink(const std::string& linkName);
+		void				setLinkOutbound(bool outbound);
+		void				setUplink(Client* uplink);
+		void				setMeshPeer(int worker);
+		void				setInjector(bool injector);
+		unsigned long		nextInjectFrame(); // number of the frame being processed
+		void				setHostKey(const HostKey& key);
+		void				setConnectionClass(ConnectionClass* connectionClass);
+		void				setTls(struct ssl_st* tls);
+		void				setTlsHandshaking(bool handshaking);
+		void				setKtlsSend(bool enabled);
+		void				setReadyQueued(bool queued);
 	
 		// Buffer management
 		void				appendToReceiveBuffer(const char* data, size_t size);
 		bool				extractCommand(std::string& command); // extracts a complete command (terminated by \r\n)
-		void				appendToSendBuffer(const std::string& data);
-		void				consumeFromSendBuffer(size_t bytes); // removes the first bytes from the send buffer
+		void				consumeFromReceiveBuffer(size_t bytes); // removes the first bytes (binary frames)
+		void				appendToSendBuffer(const std::string& data, OutputLane lane = LANE_CONTROL); // raw, no SendQ check
+		const std::string&	nextOutput(); // the bytes to write next, topped up from the lanes
+		void				consumeFromSendBuffer(size_t bytes); // removes the first bytes of nextOutput()
 		void				clearSendBuffer();
+		bool				hasOutput() const;
+		size_t				getSendQueued() const;
+		long				getSendqLimit() const; // 0: no limit
+		bool				isSendqExceeded() const;
+		size_t				reclaimBuffers(time_t now, time_t quiet); // no I/O for quiet seconds: buffers to the pool, returns their bytes
 	
 		// Channel management
-		void				joinChannel(const std::string& channelName);
-		void				leaveChannel(const std::string& channelName);
-		bool				isInChannel(const std::string& channelName) const;
+		void				joinChannel(Channel* channel);
+		void				leaveChannel(Channel* channel);
+		bool				isInChannel(Channel* channel) const;
 	
 		// Utilities
 		std::string			getPrefix() const; // returns the IRC prefix (:nickname!username@hostname)
-		void				sendMessage(const std::string& message); // adds to the send buffer
+		void				sendMessage(const std::string& message, OutputLane lane = LANE_CONTROL); // queues a line (on the uplink for remote clients)
+
+		// the hot table: a reference is good until the next Client is created (the table may grow)
+		static const ClientHot&	hot(unsigned slot);
+		static BufferPool&	bufferPool(); // shared by all clients
 };
 
 #endif
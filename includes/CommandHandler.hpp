@@ -10,6 +10,19 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+
+// IRCv3 capability: skip the implicit RPL_NAMREPLY burst after JOIN
+#define CAP_NO_IMPLICIT_NAMES  "draft/no-implicit-names"
+#define CAP_CHATHISTORY        "draft/chathistory"
+#define CAP_BATCH              "batch"
+#define CAP_SERVER_TIME        "server-time"
+#define CAP_MESSAGE_TAGS       "message-tags"
+#define CAP_SASL               "sasl"  // only offered when an account file is loaded
+
+#define CHATHISTORY_MAX_LIMIT  100  // max messages returned by one CHATHISTORY request
+#define SASL_CHUNK_SIZE        400  // AUTHENTICATE payloads are sent in chunks of this size
+#define SASL_PAYLOAD_MAX       1024 // decoded PLAIN message: authzid, authcid and password
 
 class CommandHandler
 {
@@ -18,23 +31,42 @@ class CommandHandler
         
         // typedef for pointer to member functions of CommandHandler
         typedef void (CommandHandler::*CommandHandlerFunction)(Client* client, const std::vector<std::string>&);
+        // server link handlers also get the resolved source (NULL for server-originated lines) and the raw line to relay
+        typedef void (CommandHandler::*LinkHandlerFunction)(Client* link, Client* source, const std::vector<std::string>&, const std::string& line);
         
         void processCommand(Client* client, const std::string &input);
+        void completePass(const ClientHandle& client, bool accepted);
+        void completeSasl(const ClientHandle& client, const std::string& account, bool accepted);
+        // PRIVMSG/NOTICE delivery without text parsing (also used by the injection socket)
+        std::string deliverMessage(Client* sender, const std::string& prefix, const std::string& command,
+                                   const std::string& target, const std::string* texts, size_t count);
         
     private:
         Server *_server;
         
         // map of commands to their handlers
         std::map<std::string, CommandHandlerFunction> _commandMap;
+        std::map<std::string, LinkHandlerFunction> _linkCommandMap;
+        
+        // capabilities offered in CAP LS
+        std::set<std::string> _capabilities;
+        
+        // reference counter for BATCH ids
+        unsigned long _batchCounter;
         
         void _initCommandMap();
+        void _initLinkCommandMap();
+        void _initCapabilities();
         
         void _parseInput(const std::string &input, std::string &command, std::vector<std::string> &params);
+        void _processLinkCommand(Client* link, const std::string &input);
         
         // AUTH COMMANDS
         void cmdPass(Client* client, const std::vector<std::string> &params);
         void cmdNick(Client* client, const std::vector<std::string> &params);
         void cmdUser(Client* client, const std::vector<std::string> &params);
+        void cmdCap(Client* client, const std::vector<std::string> &params);
+        void cmdAuthenticate(Client* client, const std::vector<std::string> &params);
         
         // CHANNEL COMMANDS 
         void cmdJoin(Client* client, const std::vector<std::string> &params);
@@ -44,6 +76,7 @@ class CommandHandler
         // MESSAGE COMMANDS
         void cmdPrivmsg(Client* client, const std::vector<std::string> &params);
         void cmdNotice(Client* client, const std::vector<std::string> &params);
+        void cmdChathistory(Client* client, const std::vector<std::string> &params);
         
         // OPERATOR COMMANDS
         void cmdKick(Client* client, const std::vector<std::string> &params);
@@ -55,9 +88,30 @@ class CommandHandler
         void cmdQuit(Client* client, const std::vector<std::string> &params);
         void cmdPing(Client* client, const std::vector<std::string> &params);
         
+        // SERVER LINK COMMANDS (LinkCommands.cpp)
+        void cmdServer(Client* client, const std::vector<std::string> &params);
+        void linkUid(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkSjoin(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkTopicBurst(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkEob(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkKill(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkError(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkQuit(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkNick(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkJoin(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkPart(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkKick(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkTopic(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkMode(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkMessage(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        void linkInvite(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line);
+        
         // HELPERS
         void sendWelcomeMsg(Client* client);
+        void tryCompleteRegistration(Client* client);
         void sendNumericReply(Client* client, const std::string& numeric, const std::string& message);
+        void sendNamesReply(Client* client, Channel* channel);
+        void sendFail(Client* client, const std::string& command, const std::string& code, const std::string& message);
         bool isValidNickname(const std::string& nickname);
         bool isValidChannelName(const std::string& name);
 };
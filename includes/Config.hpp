@@ -0,0 +1,27 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+
+// optional "key = value" configuration file (third argument of ircserv)
+// lines starting with '#' are comments, a key may be repeated (e.g. link_connect)
+class Config
+{
+	private:
+		std::string									_path;
+		std::map<std::string, std::vector<std::string> >	_values;
+
+	public:
+		Config();
+		Config(const std::string& path);
+
+		const std::string&			getPath() const;
+		bool						has(const std::string& key) const;
+		std::string					get(const std::string& key, const std::string& defaultValue = "") const;
+		long						getInt(const std::string& key, long defaultValue) const;
+		std::vector<std::string>	getAll(const std::string& key) const;
+};
+
+#endif
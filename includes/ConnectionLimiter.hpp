@@ -0,0 +1,75 @@
+#ifndef CONNECTIONLIMITER_HPP
+#define CONNECTIONLIMITER_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define LIMIT_DEFAULT_PER_HOST		64		// open connections per host
+#define LIMIT_DEFAULT_RATE			20		// new connections per host and per second (sustained)
+#define LIMIT_DEFAULT_BURST			64		// new connections per host in a burst
+#define LIMIT_DEFAULT_ACCEPT_BUDGET	256		// accept() calls per event loop iteration, all listeners together
+
+// what connections are counted against: an IPv4 address, or the /64 of an IPv6 address
+// (IPv4 is stored as ::ffff:a.b.c.d so mapped and plain IPv4 addresses share their entry)
+struct HostKey
+{
+	uint64_t	high;
+	uint64_t	low;
+
+	HostKey();
+	bool		isSet() const;
+	bool		operator==(const HostKey& other) const;
+};
+
+// per-host open connection counts and token buckets for the accept path
+// an open-addressing hash table of small fixed entries: checking a new socket costs one probe and no allocation
+class ConnectionLimiter
+{
+	public:
+		enum Verdict
+		{
+			ADMIT,
+			TOO_MANY,	// the host has max_connections_per_host sockets open
+			THROTTLED,	// the host connects faster than connect_rate / connect_burst
+			CLASS_FULL	// the listener's connection class has max_clients clients (checked by the server)
+		};
+
+	private:
+		struct Entry
+		{
+			HostKey		key;
+			uint32_t	connections;
+			bool		used;
+			double		tokens;
+			double		refilled; // time of the last refill, seconds
+		};
+
+		std::vector<Entry>	_table; // size is a power of two, at most half full
+		size_t				_used;
+		uint32_t			_maxPerHost;
+		double				_rate;
+		double				_burst;
+
+		Entry&				_slot(const HostKey& key);
+		Entry&				_entry(const HostKey& key, double now);
+		void				_refill(Entry& entry, double now) const;
+		void				_rehash(size_t capacity, double now);
+
+	public:
+		ConnectionLimiter();
+
+		void				configure(long maxPerHost, long rate, long burst);
+		Verdict				admit(const HostKey& key, double now);
+		void				track(const HostKey& key); // count a connection without checking it (inherited ones)
+		void				release(const HostKey& key);
+		void				sweep(double now); // forget hosts with no connection and a full bucket
+		size_t				size() const;
+
+		static HostKey		keyOf(const struct sockaddr* addr);
+		static HostKey		keyOf(const std::string& address);
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef INJECT_HPP
+#define INJECT_HPP
+
+// binary protocol of the injection socket ("listen = unix:<path> inject"), for relay bots and bridges:
+// messages skip the text parser but go through the same delivery and permission checks as PRIVMSG/NOTICE
+// a frame is [u32 length][u8 type][body], length counts the type byte and the body
+// integers are in native byte order (the socket is local), strings are [u32 length][bytes] as in snapshots
+#define INJECT_MAX_FRAME	(1024 * 1024)	// a bigger length closes the connection
+#define INJECT_FRAME_ERROR	"FRAME"			// error code of a malformed frame (the others are IRC numerics)
+
+enum InjectFrameType
+{
+	INJECT_MESSAGE = 1,		// -> [string command][string sender][string target][u32 count][count x string text]
+							//    command is PRIVMSG or NOTICE, all texts go to target in one delivery
+							//    sender is the nickname of a client (its prefix and channel membership are used)
+							//    or a full nick!user@host prefix, trusted as is
+	INJECT_SUBSCRIBE = 2,	// -> [string channel]: the lines broadcast to the channel come back as INJECT_EVENT
+	INJECT_UNSUBSCRIBE = 3,	// -> [string channel]
+	INJECT_SYNC = 4,		// <-> [u32 token]: echoed once every frame sent before it is processed
+	INJECT_EVENT = 5,		// <- [string channel][string line without CRLF]
+	INJECT_ERROR = 6		// <- [u32 frame number, from 1][string code][string target]
+};
+
+#endif
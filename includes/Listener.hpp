@@ -0,0 +1,33 @@
+#ifndef LISTENER_HPP
+#define LISTENER_HPP
+
+#include <string>
+#include "ConnectionLimiter.hpp"
+
+#define DEFAULT_CONNECTION_CLASS	"default"
+#define SENDQ_DEFAULT_BYTES			(4 * 1024 * 1024)	// output queued for one client before it is dropped
+
+// limits shared by the listeners of a class ("connection_class = <name> [max_clients=n] [max_per_host=n]
+// [connect_rate=n] [connect_burst=n] [sendq=bytes]" in the config, the default class takes the global keys)
+struct ConnectionClass
+{
+	std::string			name;
+	ConnectionLimiter	limiter;	// per-host counts and rates (not used for unix domain sockets)
+	long				maxClients;	// 0: no cap
+	long				clients;
+	long				sendq;		// bytes of output queued per client (0: no limit), see OutputLane
+};
+
+// one listening socket ("listen = <address> [tls|inject] [class=<name>]" in the config)
+// address is "<port>" (IPv6 dual-stack), "<ipv4>:<port>", "[<ipv6>]:<port>" or "unix:<path>"
+struct Listener
+{
+	int					fd;
+	std::string			address;
+	bool				tls;
+	bool				inject;		// binary injection protocol (Inject.hpp), unix domain sockets only
+	ConnectionClass*	connectionClass;
+	std::string			unixPath;	// removed at shutdown (unix domain sockets only)
+};
+
+#endif
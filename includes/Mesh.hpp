@@ -0,0 +1,35 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include <cstddef>
+#include <stdint.h>
+
+#define MESH_RING_SIZE		(1024 * 1024)	// bytes in flight from one worker to another
+#define MESH_MAX_WORKERS	16
+
+// lock-free single-producer single-consumer byte ring in shared memory, one per ordered pair of workers
+// head and tail only grow: each side writes its own index and reads the other's behind a full barrier
+struct MeshRing
+{
+	volatile uint64_t	head;				// written by the producer
+	char				_padHead[56];		// keep both indexes on their own cache line
+	volatile uint64_t	tail;				// written by the consumer
+	char				_padTail[56];
+	volatile uint32_t	producerWaiting;	// the producer found the ring full and waits for a wakeup
+	char				_padWaiting[60];
+	char				data[MESH_RING_SIZE];
+
+	size_t				push(const char* src, size_t len);	// returns the bytes written (0 when full)
+	size_t				pop(char* dst, size_t len);			// returns the bytes read (0 when empty)
+};
+
+// all the rings of an n-worker mesh in one anonymous MAP_SHARED mapping (created before fork)
+class Mesh
+{
+	public:
+		static MeshRing*	create(int workers);
+		static void			destroy(MeshRing* rings, int workers);
+		static MeshRing*	ring(MeshRing* rings, int workers, int from, int to);
+};
+
+#endif
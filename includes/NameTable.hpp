@@ -0,0 +1,50 @@
+#ifndef NAMETABLE_HPP
+#define NAMETABLE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class Channel;
+class Client;
+
+// rfc1459 casemapping: A-Z and []\^ fold to a-z and {}|~, so "#Foo[1]" and "#foo{1}" are one name
+std::string			foldName(const std::string& name);
+
+// one casemapped name: every spelling of it gets the same object, so two names are equal when their
+// pointers are, and whatever uses the name is found without a second lookup
+struct Name
+{
+	std::string		folded;
+	size_t			hash;
+	unsigned long	refs;		// intern() calls not released yet
+	Channel*		channel;	// the channel of this name, NULL if none
+	Client*			client;		// the local or remote client with this nick, NULL if none
+};
+
+// the names in use: channel names and nicks share it (a channel name starts with # or &, a nick never does)
+// an open-addressing hash table of pointers: a lookup folds and hashes the name in one pass, no allocation
+class NameTable
+{
+	private:
+		std::vector<Name*>	_table; // size is a power of two, at most half full
+		size_t				_used;
+
+		size_t				_slot(const std::string& name, size_t hash) const;
+		void				_rehash(size_t capacity);
+
+		// avoid copying
+		NameTable(const NameTable& other);
+		NameTable& operator=(const NameTable& other);
+
+	public:
+		NameTable();
+		~NameTable();
+
+		Name*				intern(const std::string& name); // adds a reference
+		Name*				find(const std::string& name) const; // NULL if nothing holds that name
+		void				release(Name* name); // the name goes with its last reference
+		size_t				size() const;
+};
+
+#endif
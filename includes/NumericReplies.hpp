@@ -19,7 +19,9 @@
 #define ERR_NOSUCHCHANNEL      "403"  // :server 403 nick #channel :No such channel
 #define ERR_CANNOTSENDTOCHAN   "404"  // :server 404 nick #channel :Cannot send to channel
 #define ERR_TOOMANYCHANNELS    "405"  // :server 405 nick #channel :You have joined too many channels
+#define ERR_INVALIDCAPCMD      "410"  // :server 410 nick subcommand :Invalid CAP subcommand
 #define ERR_NOTEXTTOSEND       "412"  // :server 412 nick :No text to send
+#define ERR_INPUTTOOLONG       "417"  // :server 417 nick :Input line was too long
 #define ERR_UNKNOWNCOMMAND     "421"  // :server 421 nick command :Unknown command
 #define ERR_NONICKNAMEGIVEN    "431"  // :server 431 nick :No nickname given
 #define ERR_ERRONEUSNICKNAME   "432"  // :server 432 nick nickname :Erroneous nickname
@@ -36,4 +38,13 @@
 #define ERR_BADCHANNELKEY      "475"  // :server 475 nick #channel :Cannot join channel (+k)
 #define ERR_CHANOPRIVSNEEDED   "482"  // :server 482 nick #channel :You're not channel operator
 
+// SASL replies (IRCv3 sasl)
+#define RPL_LOGGEDIN           "900"  // :server 900 nick nick!user@host account :You are now logged in as account
+#define RPL_SASLSUCCESS        "903"  // :server 903 nick :SASL authentication successful
+#define ERR_SASLFAIL           "904"  // :server 904 nick :SASL authentication failed
+#define ERR_SASLTOOLONG        "905"  // :server 905 nick :SASL message too long
+#define ERR_SASLABORTED        "906"  // :server 906 nick :SASL authentication aborted
+#define ERR_SASLALREADY        "907"  // :server 907 nick :You have already authenticated using SASL
+#define RPL_SASLMECHS          "908"  // :server 908 nick mechanisms :are available SASL mechanisms
+
 #endif
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef PASSWORDHASH_HPP
+#define PASSWORDHASH_HPP
+
+#include <string>
+
+#define PASSWORD_DEFAULT_ITERATIONS	20000	// PBKDF2 rounds when the config does not give a hash
+#define PASSWORD_SALT_BYTES			16
+
+// PBKDF2-HMAC-SHA256 password verifier (OpenSSL), encoded as "pbkdf2-sha256$<iterations>$<salt hex>$<hash hex>"
+// verify() is deliberately slow: call it from the thread pool, never from the event loop
+class PasswordHash
+{
+	private:
+		unsigned int		_iterations;
+		std::string			_salt;
+		std::string			_hash;
+
+	public:
+		PasswordHash();
+		PasswordHash(unsigned int iterations, const std::string& salt, const std::string& hash);
+
+		static PasswordHash	fromPassword(const std::string& password, unsigned int iterations); // throws without a random salt
+		static bool			parse(const std::string& encoded, PasswordHash& out);
+
+		bool				verify(const std::string& password) const;
+		std::string			encode() const;
+		unsigned int		getIterations() const;
+		const std::string&	getSalt() const;
+		const std::string&	getHash() const;
+
+		static std::string	pbkdf2(const std::string& password, const std::string& salt, unsigned int iterations);
+};
+
+#endif
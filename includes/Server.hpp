@@ -6,11 +6,42 @@
 #include <vector>
 #include <poll.h>
 #include <stdexcept>
+#include <deque>
+#include <ctime>
+#include <set>
+#include <sys/types.h>
+#include "Config.hpp"
+#include "AccountStore.hpp"
+#include "Capture.hpp"
+#include "ConnectionLimiter.hpp"
+#include "Listener.hpp"
+#include "NameTable.hpp"
+#include "PasswordHash.hpp"
+#include "Transport.hpp"
+#include "Client.hpp"
+
+#define LISTEN_DEFAULT_DEFER_ACCEPT	5	// seconds a connection may stay silent before accept() returns it anyway
+#define LISTEN_DEFAULT_NOTSENT_LOWAT	16384	// unsent bytes the kernel holds per socket: the rest waits in the output lanes
+#define SCHED_DEFAULT_READ_BUDGET		8192	// bytes read from one client per loop iteration
+#define SCHED_DEFAULT_COMMAND_BUDGET	10		// commands run for one client per loop iteration
+#define DRAIN_DEFAULT_TIMEOUT			10		// seconds a graceful shutdown waits for output before closing the rest
+#define DRAIN_DEFAULT_BATCH				100		// clients closed per drain step, at least
+#define DRAIN_DEFAULT_INTERVAL			100		// milliseconds between drain steps
+
+#define UPGRADE_ENV				"IRCSERV_UPGRADE_FD"	// set for the new process of a binary upgrade
+#define UPGRADE_MAGIC			"IRCUPGR5"
+#define UPGRADE_TIMEOUT_MS		10000				// how long the old process waits for the new one
+#define LINK_RETRY_INTERVAL		30					// seconds between reconnection attempts to configured links
+#define BUFFER_RECLAIM_INTERVAL	10					// seconds between two returns of the idle clients' buffers to the pool
+#define HISTORY_GLOBAL_BYTES	(16 * 1024 * 1024)	// history budget shared by all channels
 
 // forward declarations
-class Client;
 class Channel;
 class CommandHandler;
+class ThreadPool;
+class SnapshotReader;
+struct MeshRing;
+struct ssl_ctx_st; // OpenSSL's SSL_CTX
 
 class Server
 {
@@ -18,71 +49,271 @@ class Server
 		// server basic config
 		int					_port;
 		std::string			_password;
+		PasswordHash		_passwordHash; // what PASS is checked against (on the thread pool)
+		AccountStore		_accounts; // SASL accounts, mmap'ed from the account_db file
 		std::string			_serverName;
+		Config				_config;
 	
-		// listening socket (to accept new connections)
-		int					_serverSocket;
+		// listening sockets (to accept new connections) and the classes that limit them
+		std::vector<Listener>	_listeners;
+		std::map<std::string, ConnectionClass*>	_classes;
+		std::map<std::string, int>	_inheritedListeners; // binary upgrade: listener key -> fd, until _initSocket() claims it
+
+		// accept/recv/send/close of client sockets: the kernel's, or a benchmark's simulated network
+		SocketTransport		_socketTransport;
+		Transport*			_transport;
+
+		// TLS context for the listeners marked tls ("tls_cert" and "tls_key" in the config)
+		struct ssl_ctx_st*	_tlsContext;
+
+		// connection floods: accept() budget per loop iteration shared by the listeners, rejections to log
+		long				_acceptBudget;
+		long				_acceptsLeft;
+		unsigned long		_rejectedTooMany;
+		unsigned long		_rejectedThrottled;
+		unsigned long		_rejectedClassFull;
+		time_t				_lastLimiterSweep;
+
+		// idle clients' buffers go back to the pool every BUFFER_RECLAIM_INTERVAL seconds ("buffer_pool" bytes kept)
+		time_t				_lastBufferReclaim;
+		unsigned long long	_bytesReclaimed;
+
+		// event loop timing, logged every "loop_stats" seconds (0: off): iterations, time spent outside poll()
+		long				_loopStatsInterval;
+		time_t				_lastLoopStats;
+		unsigned long		_loopIterations;
+		double				_loopBusy;
+		double				_loopMax;
+
+		// fairness: per-client budgets for one loop iteration, clients with commands left wait their turn
+		long				_readBudget;
+		long				_commandBudget;
+		std::deque<ClientHandle>	_readyClients;
+
+		// graceful shutdown: the first shutdown() drains for up to "drain_timeout" seconds (0: stop at once),
+		// closing at least "drain_batch" flushed clients every "drain_interval" ms (ServerShutdown.cpp)
+		long				_drainTimeout;
+		long				_drainBatch;
+		long				_drainInterval;
+		volatile bool		_drainRequested;
+		bool				_draining;
+		double				_drainDeadline;
+		double				_nextDrainBatch;
+		unsigned long		_drainClosed;
+		unsigned long		_drainForced; // closed at the deadline with output still queued
+
+		// injection sockets subscribed to a channel's traffic (by casemapped channel name: the channel may not exist yet)
+		std::map<std::string, std::set<Client*> >	_subscribers;
+
+		// inbound traffic capture ("capture_file" in the config, one file per worker), opened by run()
+		CaptureWriter		_capture;
 	
-		// clients' list/map
+		// clients' list/map, and the ones disconnected during this loop iteration (CLIENT_CLOSING)
 		std::map<int, Client*>	_clients;
+		std::vector<Client*>	_closing;
 	
-		// channels' list/map
-		std::map<std::string, Channel*>	_channels;
+		// server links and the clients reachable through them (their nicks are in _names)
+		std::set<Client*>	_links;
+		std::set<Client*>	_remoteClients;
+		std::map<std::string, int>	_linkConnects; // configured "host:port" -> fd (-1 when not connected)
+		time_t				_lastLinkAttempt;
+	
+		// multi-process mode: worker index, rings shared by all workers, our wakeup pipe, children (worker 0)
+		int					_workerId;
+		int					_workerCount;
+		MeshRing*			_mesh;
+		int					_meshNotifyFd;
+		std::vector<pid_t>	_workerPids;
+	
+		// interned channel names and nicks: getChannel() and getClientByNick() are one hash lookup
+		NameTable			_names;
+
+		// channels' list: a channel lives as long as it has members (partChannel), or a restore grace period
+		std::set<Channel*>	_channels;
+		size_t				_emptyChannels; // at the last sweep
+		unsigned long		_channelsCreated;
+		unsigned long		_channelsRemoved;
 	
-		// sockets' list to check for events
+		// message history: global byte count and eviction order (channel name, msgid)
+		size_t				_historyBytes;
+		size_t				_historyEntries;
+		unsigned long		_nextMsgId;
+		std::deque<std::pair<std::string, unsigned long> >	_historyOrder;
+	
+		// channel snapshots: child writing the periodic snapshot, restored channels awaiting members
+		pid_t				_snapshotPid;
+		time_t				_lastSnapshot;
+		std::map<std::string, time_t>	_restoredChannels;
+	
+		// sockets' list to check for events, and each fd's entry in it (-1: none) so POLLOUT is set without a scan
 		std::vector<struct pollfd>	_pollFds;
+		std::vector<int>	_pollIndex;
 	
 		// Command handler
 		CommandHandler*		_commandHandler;
 	
+		// threads for slow work (password checks), results come back through a polled pipe
+		ThreadPool*			_threadPool;
+	
 		// server running state (true = is running)
 		bool				_isrunning;
 	
+		// binary upgrade: path to exec, pending request (set from a signal handler), handoff done
+		std::string			_executablePath;
+		volatile bool		_upgradeRequested;
+		volatile bool		_statsRequested; // SIGUSR1: displayStats() from the event loop
+		bool				_handedOff;
+		int					_upgradeSock; // new process: the old one waits here for the ack until construction succeeded
+	
 		// private methods (internal utilities)
 		void				_initSocket();
 		void				_setNonBlocking(int fd);
-		void				_acceptNewConnection();
+		void				_tuneListener(int fd);
+		void				_acceptNewConnection(Listener& listener);
+		void				_rejectConnection(int fd, ConnectionLimiter::Verdict verdict);
+		void				_releaseHost(Client* client);
 		void				_readClientData(int fd);
+		bool				_processBufferedCommands(Client* client);
+		void				_runReadyClients();
 		void				_sendPendingData(int fd);
 		void				_unsetPollOut(int fd);
-		void				_removePollFd(int fd);
+		void				_addPollFd(int fd, short events);
+		void				_removePollFds(const std::set<int>& fds);
+		struct pollfd*		_findPollFd(int fd);
 		void				_disconnectClient(int fd);
+		void				_closeDisconnected();
+		void				_dropSendqExceeded();
+		void				_reclaimIdleBuffers(time_t now);
 		void				_sendMsgToClient(int fd, const std::string& message);
+		bool				_evictOldestHistory();
+		void				_compactHistoryOrder();
+		void				_restoreSnapshot();
+		void				_startSnapshot();
+		void				_reapSnapshot(bool wait);
+		void				_sweepChannels(time_t now);
+		bool				_addChannel(Channel* channel);
+		void				_releaseNick(Client* client);
+		void				_runPeriodicTasks();
+		void				_recordLoopIteration(const struct timeval& start);
+	
+		// binary upgrade (ServerUpgrade.cpp)
+		void				_performUpgrade();
+		std::string			_serializeState(std::vector<int>& fds) const;
+		bool				_sendHandoff(int sock, const std::string& state, const std::vector<int>& fds);
+		void				_resumeFromUpgrade(int sock);
+		void				_acknowledgeUpgrade();
+		void				_restoreState(const std::string& state, const std::vector<int>& fds);
+	
+		// listeners and connection classes (ServerListeners.cpp)
+		void				_initClasses();
+		ConnectionClass*	_getClass(const std::string& name);
+		void				_openListener(Listener listener);
+		Listener*			_findListener(int fd);
+		void				_closeListeners(bool removePaths);
+		static std::string	_listenerKey(const Listener& listener);
+	
+		// injection socket for bots and bridges (ServerInject.cpp)
+		bool				_acceptInjector(Client* client);
+		bool				_processInjectFrames(Client* client);
+		void				_injectMessage(Client* client, unsigned long frame, SnapshotReader& in);
+		void				_injectError(Client* client, unsigned long frame, const std::string& code, const std::string& target);
+		void				_notifySubscribers(Channel* channel, const std::string& message);
+		void				_dropSubscriptions(Client* client);
+	
+		// TLS context and sessions (ServerTls.cpp)
+		void				_initTls();
+		bool				_startTls(Client* client);
+		void				_continueTlsHandshake(Client* client);
+		ssize_t				_recvTls(Client* client, char* buffer, size_t length);
+		ssize_t				_sendTls(Client* client, const std::string& data);
+	
+		// server links (ServerLinks.cpp)
+		void				_connectLinks();
+		void				_sendBurst(Client* link);
+		void				_dropLink(Client* link);
+		std::string			_uidLine(Client* client) const;
+	
+		// worker processes (ServerWorkers.cpp)
+		void				_startWorkers();
+		void				_addMeshLink(int worker, int wakeFd);
+		ssize_t				_writeMesh(Client* link, const std::string& data);
+		void				_drainMesh();
+		void				_reapWorkers(bool wait);
+		void				_stopWorkers();
+	
+		// graceful shutdown (ServerShutdown.cpp)
+		void				_beginDrain();
+		void				_continueDrain();
 		
 		// avoid copying
 		Server(const Server& other);
 		Server& operator=(const Server& other);
 
 	public:
-		Server(int port, const std::string& password);
+		Server(int port, const std::string& password, const Config& config = Config());
 		~Server();
 	
 		// main public methods
 		void				run();
 		void				shutdown();
 		void				displayStats() const;
+		void				setExecutablePath(const std::string& path);
+		void				requestUpgrade();
+		void				requestStats();
+		void				setTransport(Transport* transport); // before run(), the transport outlives the server
 	
 		// getters
 		int					getPort() const;
 		const std::string&	getPassword() const;
 		const std::string&	getServerName() const;
+		const Config&		getConfig() const;
+		const PasswordHash&	getPasswordHash() const;
+		ThreadPool*			getThreadPool();
+		const AccountStore&	getAccountStore() const;
 
 		void				_setPollOut(int fd);
 	
 		// clients management
 		Client*				getClient(int fd);
+		Client*				getClient(const ClientHandle& handle); // NULL once that client is gone, even if its fd is reused
 		Client*				getClientByNick(const std::string& nickname);
 		void				removeClient(int fd);
+		void				setNick(Client* client, const std::string& nickname);
+		void				resumeClient(Client* client);
+	
+		// server links
+		bool				establishLink(Client* link, const std::string& name);
+		void				refuseLink(Client* client);
+		Client*				getLinkByName(const std::string& name);
+		void				propagateToLinks(const std::string& message, int excludeFd = -1);
+		void				introduceClient(Client* client);
+		Client*				addRemoteClient(Client* link, const std::string& nickname, const std::string& username,
+											const std::string& hostname, const std::string& ipAddress, const std::string& realname);
+		void				removeRemoteClient(Client* client, const std::string& quitMsg);
+		void				renameRemoteClient(Client* client, const std::string& newNick);
+		void				killClient(Client* client, const std::string& reason);
 	
 		// channels management
 		Channel*			getChannel(const std::string& name);
 		Channel*			createChannel(const std::string& name);
 		void				removeChannel(const std::string& name);
+		void				partChannel(Channel* channel, Client* client);
+	
+		// channel history
+		void				recordHistory(const std::string& channelName, const std::string& message);
 	
 		// broadcasting
 		void				broadcastToChannel(const std::string& channelName, 
 										   	const std::string& message, 
-										   	int excludeFd = -1);
+										   	int excludeFd = -1,
+										   	bool operatorsOnly = false,
+										   	bool toLinks = true,
+										   	OutputLane lane = LANE_CONTROL);
+		void				broadcastMembership(const std::string& channelName,
+											const std::string& message,
+											Client* subject,
+											int excludeFd = -1,
+											bool toLinks = true);
 };
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+class Channel;
+
+#define SNAPSHOT_FILE			"ircserv.snapshot"
+#define SNAPSHOT_MAGIC			"IRCSNAP2"
+#define SNAPSHOT_MAGIC_V1		"IRCSNAP1"	// written before operators were recorded, still loaded
+#define SNAPSHOT_INTERVAL		60		// seconds between two periodic snapshots
+#define SNAPSHOT_RESTORE_GRACE	3600	// seconds a restored channel waits for its members to rejoin
+
+// append-only binary encoder (native byte order, length-prefixed strings)
+class SnapshotWriter
+{
+	private:
+		std::string			_data;
+
+	public:
+		void				putU8(uint8_t value);
+		void				putU32(uint32_t value);
+		void				putI32(int32_t value);
+		void				putU64(uint64_t value);
+		void				putString(const std::string& value);
+		void				putRaw(const char* data, size_t size);
+		const std::string&	data() const;
+};
+
+// bounds-checked decoder over a byte range (e.g. a mmap'ed snapshot file)
+class SnapshotReader
+{
+	private:
+		const char*			_pos;
+		const char*			_end;
+
+	public:
+		SnapshotReader(const char* data, size_t size);
+
+		bool				getU8(uint8_t& value);
+		bool				getU32(uint32_t& value);
+		bool				getI32(int32_t& value);
+		bool				getU64(uint64_t& value);
+		bool				getString(std::string& value);
+		bool				getRaw(char* data, size_t size);
+		bool				atEnd() const;
+};
+
+// persistent channel state: topic, modes, key, limit, invite list and operator nicks
+class Snapshot
+{
+	public:
+		static void			writeChannel(SnapshotWriter& out, const Channel& channel);
+		static Channel*		readChannel(SnapshotReader& in, bool withOperators = true);
+
+		// write all channels to path atomically (temporary file + rename)
+		static bool			save(const std::string& path, const std::set<Channel*>& channels);
+		// mmap path and append its channels, returns the number read or -1 on error
+		static long			load(const std::string& path, std::vector<Channel*>& channels);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <cstddef>
+#include <pthread.h>
+
+#define THREADPOOL_DEFAULT_THREADS	4
+
+// a unit of work: run() executes on a pool thread, complete() back on the event loop thread
+// run() must not touch server state; complete() gets the result and may (the object is deleted afterwards)
+class Task
+{
+	public:
+		virtual ~Task() {}
+		virtual void	run() = 0;
+		virtual void	complete() = 0;
+};
+
+// work-stealing thread pool: each thread owns a deque, submit() spreads tasks round-robin
+// and an idle thread steals from the back of the others; finished tasks go to a completion
+// queue whose pipe the event loop polls (getNotifyFd), then runCompletions() calls complete()
+class ThreadPool
+{
+	private:
+		struct Worker
+		{
+			ThreadPool*			pool;
+			size_t				index;
+			pthread_t			thread;
+			pthread_mutex_t		lock;
+			std::deque<Task*>	tasks;
+		};
+
+		std::vector<Worker*>	_workers;
+		size_t					_nextWorker;
+
+		// sleeping threads wait on _wakeCond; _queued counts tasks not taken yet, _outstanding tasks not finished
+		pthread_mutex_t			_stateLock;
+		pthread_cond_t			_wakeCond;
+		pthread_cond_t			_idleCond;
+		size_t					_queued;
+		size_t					_outstanding;
+		bool					_stopping;
+
+		pthread_mutex_t			_doneLock;
+		std::vector<Task*>		_done;
+		int						_notifyPipe[2];
+
+		static void*			_threadMain(void* arg);
+		Task*					_take(size_t self);
+		void					_finish(Task* task);
+
+		ThreadPool(const ThreadPool& other);
+		ThreadPool& operator=(const ThreadPool& other);
+
+	public:
+		ThreadPool(size_t threads);
+		~ThreadPool();
+
+		void					submit(Task* task);
+		int						getNotifyFd() const;
+		size_t					runCompletions();	// event loop only
+		void					wait();				// block until every submitted task completed
+		size_t					getThreadCount() const;
+		size_t					getOutstanding();
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <string>
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// the socket calls of the client path (accept, recv, send, close), so a benchmark can swap the network
+// poll() keeps real file descriptors: a transport hands out fds that poll() understands
+class Transport
+{
+	public:
+		virtual ~Transport();
+
+		virtual int			accept(int listenFd, struct sockaddr* address, socklen_t* length) = 0; // non-blocking, close-on-exec
+		virtual ssize_t		recv(int fd, char* buffer, size_t length) = 0;
+		virtual ssize_t		send(int fd, const char* data, size_t length) = 0;
+		virtual int			close(int fd) = 0;
+		virtual int			listenFd() const; // an extra listener the server polls and accepts from (-1: none)
+};
+
+// the kernel's calls, what ircserv uses
+class SocketTransport : public Transport
+{
+	public:
+		int					accept(int listenFd, struct sockaddr* address, socklen_t* length);
+		ssize_t				recv(int fd, char* buffer, size_t length);
+		ssize_t				send(int fd, const char* data, size_t length);
+		int					close(int fd);
+};
+
+// in-process network for benchmarks (tools/simbench): connect() makes a socketpair and queues its server
+// end on a simulated listener, then the server's recv/send go through deterministic faults
+// (a seeded generator: the same run fails the same calls) and, optionally, delayed delivery
+class SimTransport : public Transport
+{
+	private:
+		struct Delayed
+		{
+			uint64_t		due; // microseconds, CLOCK_MONOTONIC
+			std::string		data;
+		};
+
+		int					_wake[2];	// one byte per queued connection, the read end is the listener
+		pthread_mutex_t		_lock;		// connect() and pump() run on the benchmark's thread
+		std::deque<int>		_accepts;
+		std::map<int, std::deque<Delayed> >	_delayed;
+		uint32_t			_random;
+		int					_eagainPercent;
+		size_t				_maxWrite;
+		long				_latency;
+
+		bool				_fault();
+
+		SimTransport(const SimTransport& other);
+		SimTransport& operator=(const SimTransport& other);
+
+	public:
+		SimTransport(uint32_t seed);
+		~SimTransport();
+
+		void				setEagainPercent(int percent);	// recv and send fail with EAGAIN this often
+		void				setMaxWrite(size_t bytes);		// send writes at most this much (partial writes), 0: no cap
+		void				setLatency(long micros);		// server output reaches the client this late, see pump()
+
+		// benchmark side
+		int					connect();	// the client end of a new connection (non-blocking), -1 on error
+		void				pump();		// write the delayed output that is due, call it often when latency is set
+
+		// server side
+		int					accept(int listenFd, struct sockaddr* address, socklen_t* length);
+		ssize_t				recv(int fd, char* buffer, size_t length);
+		ssize_t				send(int fd, const char* data, size_t length);
+		int					close(int fd);
+		int					listenFd() const;
+};
+
+#endif
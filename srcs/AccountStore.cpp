@@ -0,0 +1,181 @@
+#include "AccountStore.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cctype>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ACCOUNT_HEADER_SIZE	12	// magic + record count
+
+AccountStore::AccountStore() : _map(NULL), _mapSize(0), _records(NULL), _count(0)
+{
+}
+
+AccountStore::~AccountStore()
+{
+	if (_map)
+		munmap(_map, _mapSize);
+}
+
+bool AccountStore::open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		std::cerr << "Accounts: open(" << path << ") failed: " << strerror(errno) << std::endl;
+		return (false);
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < ACCOUNT_HEADER_SIZE)
+	{
+		std::cerr << "Accounts: " << path << " is not an account file" << std::endl;
+		close(fd);
+		return (false);
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		std::cerr << "Accounts: mmap() failed: " << strerror(errno) << std::endl;
+		return (false);
+	}
+
+	uint32_t count;
+	std::memcpy(&count, (const char*)map + 8, sizeof(count));
+	if (std::memcmp(map, ACCOUNT_MAGIC, 8) != 0
+		|| (size_t)st.st_size != ACCOUNT_HEADER_SIZE + (size_t)count * sizeof(AccountRecord))
+	{
+		std::cerr << "Accounts: " << path << " is not an account file" << std::endl;
+		munmap(map, st.st_size);
+		return (false);
+	}
+	if (_map)
+		munmap(_map, _mapSize);
+	_map = map;
+	_mapSize = st.st_size;
+	_records = (const AccountRecord*)((const char*)map + ACCOUNT_HEADER_SIZE);
+	_count = count;
+	return (true);
+}
+
+bool AccountStore::isOpen() const
+{
+	return (_map != NULL);
+}
+
+uint32_t AccountStore::size() const
+{
+	return (_count);
+}
+
+// binary search on the NUL-padded lowercased name
+const AccountRecord* AccountStore::find(const std::string& name) const
+{
+	std::string key = normalizeName(name);
+	if (!_records || key.empty() || key.length() > ACCOUNT_NAME_MAX)
+		return (NULL);
+	char padded[ACCOUNT_NAME_MAX];
+	std::memset(padded, 0, sizeof(padded));
+	std::memcpy(padded, key.c_str(), key.length());
+
+	uint32_t low = 0;
+	uint32_t high = _count;
+	while (low < high)
+	{
+		uint32_t mid = low + (high - low) / 2;
+		int cmp = std::memcmp(_records[mid].name, padded, ACCOUNT_NAME_MAX);
+		if (cmp == 0)
+			return (&_records[mid]);
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return (NULL);
+}
+
+// checked in place of a missing account, so a login for a name that does not exist takes as long as a
+// wrong password: the iteration count is the store's (the first record's, every record has the same one
+// unless the file mixes generations)
+PasswordHash AccountStore::decoyHash() const
+{
+	unsigned int iterations = (_count > 0) ? _records[0].iterations : PASSWORD_DEFAULT_ITERATIONS;
+	return (PasswordHash(iterations, std::string(PASSWORD_SALT_BYTES, '\0'), std::string(32, '\0')));
+}
+
+std::string AccountStore::normalizeName(const std::string& name)
+{
+	std::string lower = name;
+	for (size_t i = 0; i < lower.length(); ++i)
+		lower[i] = std::tolower(lower[i]);
+	return (lower);
+}
+
+PasswordHash AccountStore::hashOf(const AccountRecord& record)
+{
+	return (PasswordHash(record.iterations, std::string((const char*)record.salt, PASSWORD_SALT_BYTES),
+		std::string((const char*)record.hash, sizeof(record.hash))));
+}
+
+static bool byName(const std::pair<std::string, PasswordHash>& a, const std::pair<std::string, PasswordHash>& b)
+{
+	return (a.first < b.first);
+}
+
+bool AccountStore::write(const std::string& path, std::vector<std::pair<std::string, PasswordHash> > accounts)
+{
+	for (size_t i = 0; i < accounts.size(); ++i)
+		accounts[i].first = normalizeName(accounts[i].first);
+	std::stable_sort(accounts.begin(), accounts.end(), byName);
+
+	std::string data(ACCOUNT_MAGIC, 8);
+	uint32_t count = 0;
+	data.append((const char*)&count, sizeof(count));
+	for (size_t i = 0; i < accounts.size(); ++i)
+	{
+		const std::string& name = accounts[i].first;
+		const PasswordHash& hash = accounts[i].second;
+		if (name.empty() || name.length() > ACCOUNT_NAME_MAX || (i > 0 && name == accounts[i - 1].first)
+			|| hash.getSalt().length() != PASSWORD_SALT_BYTES || hash.getHash().length() != 32)
+		{
+			std::cerr << "Accounts: skipping invalid or duplicate account '" << name << "'" << std::endl;
+			continue;
+		}
+		AccountRecord record;
+		std::memset(&record, 0, sizeof(record));
+		std::memcpy(record.name, name.c_str(), name.length());
+		record.iterations = hash.getIterations();
+		std::memcpy(record.salt, hash.getSalt().c_str(), PASSWORD_SALT_BYTES);
+		std::memcpy(record.hash, hash.getHash().c_str(), sizeof(record.hash));
+		data.append((const char*)&record, sizeof(record));
+		++count;
+	}
+	std::memcpy(&data[8], &count, sizeof(count));
+
+	std::string tmpPath = path + ".tmp";
+	int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		return (false);
+	size_t written = 0;
+	while (written < data.length())
+	{
+		ssize_t n = ::write(fd, data.c_str() + written, data.length() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			close(fd);
+			unlink(tmpPath.c_str());
+			return (false);
+		}
+		written += n;
+	}
+	fsync(fd);
+	close(fd);
+	return (rename(tmpPath.c_str(), path.c_str()) == 0);
+}
@@ -0,0 +1,81 @@
+#include "BufferPool.hpp"
+
+BufferPool::BufferPool() : _bytes(0), _limit(BUFFER_POOL_DEFAULT_BYTES), _taken(0), _given(0), _freed(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+	for (size_t i = 0; i < _spare.size(); ++i)
+		delete _spare[i];
+}
+
+// a smaller limit takes effect as the spare buffers are taken
+void BufferPool::setLimit(size_t bytes)
+{
+	_limit = bytes;
+}
+
+size_t BufferPool::give(std::string& buffer)
+{
+	size_t bytes = stringHeapBytes(buffer);
+	if (bytes == 0)
+		return (0);
+	buffer.clear();
+	if (buffer.capacity() < BUFFER_POOL_MIN || buffer.capacity() > BUFFER_POOL_MAX || _bytes + buffer.capacity() > _limit)
+	{
+		std::string().swap(buffer);
+		++_freed;
+		return (bytes);
+	}
+	std::string* spare = new std::string;
+	spare->swap(buffer);
+	_bytes += spare->capacity();
+	_spare.push_back(spare);
+	++_given;
+	return (bytes);
+}
+
+// only the last spare buffer is looked at: it is the warmest, and most are the same size anyway
+void BufferPool::take(std::string& buffer, size_t size)
+{
+	if (size <= BUFFER_POOL_MIN || buffer.capacity() >= size || _spare.empty() || _spare.back()->capacity() < size)
+		return;
+	std::string* spare = _spare.back();
+	_spare.pop_back();
+	_bytes -= spare->capacity();
+	spare->assign(buffer);
+	spare->swap(buffer);
+	delete spare; // with the buffer's old storage
+	++_taken;
+}
+
+size_t BufferPool::spareBuffers() const
+{
+	return (_spare.size());
+}
+
+size_t BufferPool::spareBytes() const
+{
+	return (_bytes);
+}
+
+unsigned long BufferPool::taken() const
+{
+	return (_taken);
+}
+
+unsigned long BufferPool::given() const
+{
+	return (_given);
+}
+
+unsigned long BufferPool::freed() const
+{
+	return (_freed);
+}
+
+size_t stringHeapBytes(const std::string& s)
+{
+	return (s.capacity() > 15 ? s.capacity() + 1 : 0);
+}
@@ -0,0 +1,197 @@
+#include "Capture.hpp"
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static uint64_t nowMicros()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static void putVarint(std::string& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+CaptureWriter::CaptureWriter() : _fd(-1), _last(0)
+{
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	close();
+}
+
+// records are appended: a binary upgrade's new process goes on with the same file
+bool CaptureWriter::open(const std::string& path)
+{
+	close();
+	_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600); // clients' passwords end up in there
+	if (_fd == -1)
+	{
+		std::cerr << "Capture: open(" << path << ") failed: " << strerror(errno) << std::endl;
+		return (false);
+	}
+	struct stat st;
+	if (fstat(_fd, &st) == 0 && st.st_size == 0)
+		_buffer.append(CAPTURE_MAGIC, 8);
+	_last = nowMicros();
+	_put(CAPTURE_CLOCK, 0, 0, (const char*)&_last, sizeof(_last));
+	flush();
+	return (true);
+}
+
+bool CaptureWriter::isOpen() const
+{
+	return (_fd != -1);
+}
+
+void CaptureWriter::_put(uint8_t type, uint64_t delta, uint64_t connection, const char* data, size_t length)
+{
+	_buffer += (char)type;
+	putVarint(_buffer, delta);
+	putVarint(_buffer, connection);
+	putVarint(_buffer, length);
+	_buffer.append(data, length);
+}
+
+void CaptureWriter::record(CaptureRecordType type, uint64_t connection, const char* data, size_t length)
+{
+	if (_fd == -1)
+		return;
+	uint64_t now = nowMicros();
+	_put(type, now > _last ? now - _last : 0, connection, data, length);
+	_last = now;
+	if (_buffer.length() >= CAPTURE_FLUSH_BYTES)
+		flush();
+}
+
+// a failed write stops the capture rather than leaving a file with a hole in it
+void CaptureWriter::flush()
+{
+	size_t written = 0;
+	while (_fd != -1 && written < _buffer.length())
+	{
+		ssize_t n = write(_fd, _buffer.data() + written, _buffer.length() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			std::cerr << "Capture: write() failed, capture stopped: " << strerror(errno) << std::endl;
+			::close(_fd);
+			_fd = -1;
+		}
+		else
+			written += n;
+	}
+	_buffer.clear();
+}
+
+void CaptureWriter::close()
+{
+	if (_fd == -1)
+		return;
+	flush();
+	if (_fd != -1)
+		::close(_fd);
+	_fd = -1;
+}
+
+CaptureReader::CaptureReader() : _map(NULL), _mapSize(0), _pos(NULL), _end(NULL), _time(0), _epoch(0)
+{
+}
+
+CaptureReader::~CaptureReader()
+{
+	if (_map)
+		munmap(_map, _mapSize);
+}
+
+bool CaptureReader::open(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		std::cerr << "Capture: open(" << path << ") failed: " << strerror(errno) << std::endl;
+		return (false);
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < 8)
+	{
+		std::cerr << "Capture: " << path << " is not a capture file" << std::endl;
+		::close(fd);
+		return (false);
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED || std::memcmp(map, CAPTURE_MAGIC, 8) != 0)
+	{
+		std::cerr << "Capture: " << path << " is not a capture file" << std::endl;
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return (false);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	_map = map;
+	_mapSize = st.st_size;
+	_pos = (const unsigned char*)map + 8;
+	_end = (const unsigned char*)map + st.st_size;
+	return (true);
+}
+
+bool CaptureReader::_getVarint(uint64_t& value)
+{
+	value = 0;
+	for (int shift = 0; _pos < _end && shift < 64; shift += 7)
+	{
+		unsigned char byte = *_pos++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return (true);
+	}
+	return (false);
+}
+
+bool CaptureReader::next(CaptureRecord& record)
+{
+	while (_pos < _end)
+	{
+		uint64_t delta, connection, length;
+		record.type = *_pos++;
+		if (!_getVarint(delta) || !_getVarint(connection) || !_getVarint(length) || (uint64_t)(_end - _pos) < length)
+		{
+			_pos = _end;
+			return (false);
+		}
+		record.data = (const char*)_pos;
+		record.length = length;
+		_pos += length;
+		if (record.type == CAPTURE_CLOCK) // a new process's part starts here
+		{
+			++_epoch;
+			continue;
+		}
+		_time += delta;
+		record.time = _time;
+		record.connection = (_epoch << 40) | connection;
+		return (true);
+	}
+	return (false);
+}
+
+bool CaptureReader::atEnd() const
+{
+	return (_pos >= _end);
+}
@@ -1,40 +1,64 @@
 #include "Channel.hpp"
 #include "Client.hpp"
+#include "NameTable.hpp"
 #include <algorithm>
 #include <iostream>
 #include <cstdlib>
 
 Channel::Channel(const std::string& name)
-    : _name(name), _topic(""), _key(""), _limit(0)
+    : _name(name), _topic(""), _key(""), _limit(0), _history(NULL), _historyBytes(0)
 {
     _modes['i'] = false;
     _modes['t'] = false;
     _modes['k'] = false;
     _modes['l'] = false;
     _modes['o'] = false;
+    _modes['u'] = false;
 }
 
-Channel::~Channel() {}
+Channel::~Channel()
+{
+    delete _history;
+}
 
 bool Channel::addUser(Client* client, const std::string& key) 
 {
+    // a former operator of a restored channel still needs the key, but not an invite or a free seat
+    bool formerOperator = _formerOperators.count(foldName(client->getNickname())) > 0;
     if (_modes['k'] && _key != "" && key != _key)
         return false;
-    if (_modes['l'] && _limit > 0 && (int)_members.size() >= _limit)
+    if (!formerOperator && _modes['l'] && _limit > 0 && (int)_members.size() >= _limit)
         return false;
-    if (_modes['i'] && _invited.find(client->getNickname()) == _invited.end())
+    if (!formerOperator && _modes['i'] && _invited.find(foldName(client->getNickname())) == _invited.end())
         return false;
-    _members.insert(client);
+    if (!_members.insert(client).second)
+        return true;
+    _memberSlots.push_back(client->getSlot());
+    // append to the cached names list instead of rebuilding it on every join
+    if (!_namesList.empty())
+        _namesList += " ";
+    _namesList += client->getNickname();
     // consume invitation once the invited nick successfully joins
-    _invited.erase(client->getNickname());
-    (void)client;
+    _invited.erase(foldName(client->getNickname()));
+    if (formerOperator)
+    {
+        _formerOperators.erase(foldName(client->getNickname()));
+        addOperator(client);
+    }
     return true;
 }
 
 bool Channel::removeUser(Client* client) 
 {
     bool removed = _members.erase(client) > 0;
-    (void)client;
+    if (removed)
+    {
+        // swap with the last slot: order does not matter to a fan-out
+        std::vector<unsigned>::iterator slot = std::find(_memberSlots.begin(), _memberSlots.end(), client->getSlot());
+        *slot = _memberSlots.back();
+        _memberSlots.pop_back();
+        _eraseName(client->getNickname());
+    }
     return removed;
 }
 
@@ -47,13 +71,23 @@ bool Channel::addOperator(Client* client)
 {
     if (!isMember(client))
         return false;
-    _operators.insert(client);
+    if (_operators.insert(client).second)
+    {
+        size_t pos = _findName(client->getNickname());
+        if (pos != std::string::npos)
+            _namesList.insert(pos, "@");
+    }
     return true;
 }
 
 bool Channel::removeOperator(Client* client) 
 {
-    return _operators.erase(client) > 0;
+    if (_operators.erase(client) == 0)
+        return false;
+    size_t pos = _findName(client->getNickname());
+    if (pos != std::string::npos && _namesList[pos] == '@')
+        _namesList.erase(pos, 1);
+    return true;
 }
 
 bool Channel::isOperator(Client* client) const 
@@ -61,6 +95,34 @@ bool Channel::isOperator(Client* client) const
     return _operators.find(client) != _operators.end();
 }
 
+void Channel::restoreMember(Client* client, bool isOperator)
+{
+    if (!_members.insert(client).second)
+        return;
+    _memberSlots.push_back(client->getSlot());
+    if (!_namesList.empty())
+        _namesList += " ";
+    if (isOperator)
+    {
+        _operators.insert(client);
+        _namesList += "@";
+    }
+    _namesList += client->getNickname();
+}
+
+// update the cached names list before the client's nickname changes
+void Channel::renameMember(Client* client, const std::string& newNick)
+{
+    if (!isMember(client))
+        return;
+    size_t pos = _findName(client->getNickname());
+    if (pos == std::string::npos)
+        return;
+    if (_namesList[pos] == '@')
+        ++pos;
+    _namesList.replace(pos, client->getNickname().length(), newNick);
+}
+
 void Channel::setMode(char mode, bool enabled, Client* setter, const std::string& param) 
 {
     if (_modes.find(mode) == _modes.end())
@@ -142,10 +204,25 @@ bool Channel::invite(Client* operatorClient, Client* targetClient)
     if (!isOperator(operatorClient))
         return false;
     if (targetClient)
-        _invited.insert(targetClient->getNickname());
+        _invited.insert(foldName(targetClient->getNickname()));
     return true;
 }
 
+void Channel::addInvite(const std::string& nickname)
+{
+    _invited.insert(foldName(nickname));
+}
+
+void Channel::addFormerOperator(const std::string& nickname)
+{
+    _formerOperators.insert(foldName(nickname));
+}
+
+void Channel::clearFormerOperators()
+{
+    _formerOperators.clear();
+}
+
 bool Channel::kick(Client* operatorClient, Client* targetClient, const std::string& reason) 
 {
     if (!isOperator(operatorClient) || !isMember(targetClient))
@@ -154,7 +231,7 @@ bool Channel::kick(Client* operatorClient, Client* targetClient, const std::stri
     removeUser(targetClient);
     removeOperator(targetClient);
     // Remove any outstanding invitation for the kicked nickname
-    _invited.erase(targetClient->getNickname());
+    _invited.erase(foldName(targetClient->getNickname()));
     return true;
 }
 
@@ -163,17 +240,110 @@ std::string Channel::getName() const
     return _name;
 }
 
-std::set<Client*> Channel::getMembers() const 
+const std::set<Client*>& Channel::getMembers() const 
 {
     return _members;
 }
 
-std::set<Client*> Channel::getOperators() const 
+const std::vector<unsigned>& Channel::getMemberSlots() const
+{
+    return _memberSlots;
+}
+
+const std::set<Client*>& Channel::getOperators() const 
 {
     return _operators;
 }
 
-std::set<std::string> Channel::getInvited() const 
+const std::set<std::string>& Channel::getInvited() const 
 {
     return _invited;
 }
+
+const std::set<std::string>& Channel::getFormerOperators() const
+{
+    return _formerOperators;
+}
+
+const std::string& Channel::getNamesList() const
+{
+    return _namesList;
+}
+
+size_t Channel::addHistory(const HistoryEntry& entry)
+{
+    // most channels never carry messages (e.g. restored from a snapshot), so the ring is created lazily
+    if (!_history)
+        _history = new std::deque<HistoryEntry>();
+    _history->push_back(entry);
+    _historyBytes += historyEntrySize(entry);
+    size_t evicted = 0;
+    while (_history->size() > 1
+        && (_history->size() > CHANNEL_HISTORY_LINES || _historyBytes > CHANNEL_HISTORY_BYTES))
+        evicted += evictOldestHistory();
+    return evicted;
+}
+
+size_t Channel::evictOldestHistory()
+{
+    if (!_history || _history->empty())
+        return 0;
+    size_t bytes = historyEntrySize(_history->front());
+    _historyBytes -= bytes;
+    _history->pop_front();
+    return bytes;
+}
+
+const std::deque<HistoryEntry>& Channel::getHistory() const
+{
+    static const std::deque<HistoryEntry> empty;
+    return _history ? *_history : empty;
+}
+
+size_t Channel::getHistoryBytes() const
+{
+    return _historyBytes;
+}
+
+size_t Channel::historyEntrySize(const HistoryEntry& entry)
+{
+    return sizeof(HistoryEntry) + entry.line.length();
+}
+
+// position of the token ("nick" or "@nick") for a nickname in the names list
+size_t Channel::_findName(const std::string& nick) const
+{
+    if (nick.empty())
+        return std::string::npos;
+    size_t pos = _namesList.find(nick);
+    while (pos != std::string::npos)
+    {
+        size_t end = pos + nick.length();
+        bool endOk = (end == _namesList.length() || _namesList[end] == ' ');
+        if (endOk && pos == 0)
+            return pos;
+        if (endOk && _namesList[pos - 1] == ' ')
+            return pos;
+        if (endOk && _namesList[pos - 1] == '@' && (pos == 1 || _namesList[pos - 2] == ' '))
+            return pos - 1;
+        pos = _namesList.find(nick, pos + 1);
+    }
+    return std::string::npos;
+}
+
+// remove a token and its separating space from the names list
+void Channel::_eraseName(const std::string& nick)
+{
+    size_t pos = _findName(nick);
+    if (pos == std::string::npos)
+        return;
+    size_t end = _namesList.find(' ', pos);
+    if (end == std::string::npos)
+    {
+        if (pos > 0)
+            --pos; // last token: drop the space before it
+        _namesList.erase(pos);
+    }
+    else
+        _namesList.erase(pos, end - pos + 1);
+}
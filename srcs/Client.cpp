@@ -1,47 +1,207 @@
 #include "Client.hpp"
 #include "Server.hpp"
+#include "Channel.hpp"
+#include "BufferPool.hpp"
 #include "Colors.hpp"
 #include <iostream>
 #include <sstream>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+static unsigned long g_nextSerial = 1;
+
+// the hot table and its free slots (reused last freed first, while still in cache)
+static std::vector<ClientHot> g_hot;
+static std::vector<unsigned> g_freeSlots;
+
+static BufferPool g_bufferPool;
+
+#define SET_NODE_HEADER	32	// a std::set node besides its value: color, parent, left, right
+
+struct ClientInfo
+{
+	std::string				ipAddress; // formatted from peerAddress on first use
+	struct sockaddr_storage	peerAddress; // as returned by accept() (AF_UNSPEC when built from a string)
+	int						port;
+	HostKey					hostKey; // what the connection is counted against (unset for links and remote clients)
+
+	// IRC identification infos
+	std::string				username;
+	std::string				realname;
+	std::string				hostname; // empty: the IP address
+
+	std::string				account; // account logged in with SASL (empty if none)
+	std::string				saslMechanism; // SASL exchange in progress (empty if none)
+	std::string				saslBuffer; // base64 payload received so far
+
+	// server links: this connection is a link to another server
+	bool					linkOutbound; // we initiated the connection (we sent SERVER first)
+	std::string				linkName;
+
+	// injection socket: the connection speaks binary frames (Inject.hpp), numbered for error replies
+	unsigned long			injectFrames;
+
+	// IRCv3 capabilities enabled with CAP REQ
+	std::set<std::string>	capabilities;
+};
+
+ClientHandle::ClientHandle()
+	: fd(-1), serial(0)
+{
+}
+
+ClientHandle::ClientHandle(const Client* client)
+	: fd(client->getClientFd()), serial(client->getSerial())
+{
+}
 
 Client::Client(int fd, const std::string& ipAddress, int port)
-	: _clientFd(fd),
-	  _ipAddress(ipAddress),
-	  _port(port),
-	  _nickname(""),
-	  _username(""),
-	  _realname(""),
-	  _hostname(ipAddress),
+	: _uplink(NULL),
+	  _connectionClass(NULL),
+	  _sendQueued(0),
+	  _droppedLines(0),
+	  _sendqExceeded(false),
+	  _readyQueued(false),
+	  _lastRead(time(NULL)),
+	  _lastSend(time(NULL)),
+	  _sendBuffer(""),
+	  _receiveBuffer(""),
+	  _tls(NULL),
+	  _tlsHandshaking(false),
+	  _ktlsSend(false),
 	  _authenticated(false),
 	  _passwordGiven(false),
-	  _registered(false),
-	  _receiveBuffer(""),
-	  _sendBuffer("")
+	  _capNegotiating(false),
+	  _authPending(false),
+	  _meshPeer(-1),
+	  _nickname(""),
+	  _info(new ClientInfo)
 {
-	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client object created (fd: " << _clientFd << ", " << _ipAddress << ":" << _port << ")" << std::endl;
+	if (g_freeSlots.empty())
+	{
+		_slot = g_hot.size();
+		g_hot.push_back(ClientHot());
+	}
+	else
+	{
+		_slot = g_freeSlots.back();
+		g_freeSlots.pop_back();
+	}
+	ClientHot& hot = g_hot[_slot];
+	hot.fd = fd;
+	hot.flags = 0;
+	hot.serial = g_nextSerial++;
+	hot.client = this;
+
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+		_laneHeads[lane] = 0;
+	_info->ipAddress = ipAddress;
+	_info->peerAddress.ss_family = AF_UNSPEC;
+	_info->port = port;
+	_info->hostname = ipAddress;
+	_info->linkOutbound = false;
+	_info->injectFrames = 0;
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client object created (fd: " << fd << ")" << std::endl;
 }
 
 Client::~Client()
 {
-	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client object destroyed (fd: " << _clientFd;
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client object destroyed (fd: " << getClientFd();
 	if (!_nickname.empty())
 		std::cout << ", nickname: " << _nickname;
 	std::cout << ")" << std::endl;
+	if (_tls)
+		SSL_free(_tls);
+	g_bufferPool.give(_receiveBuffer);
+	g_bufferPool.give(_sendBuffer);
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+		g_bufferPool.give(_lanes[lane]);
+	delete _info;
+	g_hot[_slot].client = NULL;
+	g_hot[_slot].flags = 0;
+	g_freeSlots.push_back(_slot);
+}
+
+const ClientHot& Client::hot(unsigned slot)
+{
+	return (g_hot[slot]);
+}
+
+BufferPool& Client::bufferPool()
+{
+	return (g_bufferPool);
+}
+
+ClientHot& Client::_hot() const
+{
+	return (g_hot[_slot]);
+}
+
+void Client::_setFlag(unsigned flag, bool enabled)
+{
+	if (enabled)
+		g_hot[_slot].flags |= flag;
+	else
+		g_hot[_slot].flags &= ~flag;
 }
 
 int Client::getClientFd() const
 {
-	return (_clientFd);
+	return (_hot().fd);
+}
+
+unsigned long Client::getSerial() const
+{
+	return (_hot().serial);
 }
 
+unsigned Client::getSlot() const
+{
+	return (_slot);
+}
+
+ClientHandle Client::getHandle() const
+{
+	return (ClientHandle(this));
+}
+
+ClientState Client::getState() const
+{
+	return ((_hot().flags & CLIENT_HOT_CLOSING) ? CLIENT_CLOSING : CLIENT_OPEN);
+}
+
+// accepted sockets keep the raw address: inet_ntop only runs when something shows it
 std::string Client::getIpAddress() const
 {
-	return (_ipAddress);
+	const struct sockaddr_storage& peer = _info->peerAddress;
+	if (_info->ipAddress.empty() && peer.ss_family == AF_UNIX)
+		_info->ipAddress = "localhost";
+	else if (_info->ipAddress.empty() && peer.ss_family != AF_UNSPEC)
+	{
+		char buffer[INET6_ADDRSTRLEN];
+		int family = peer.ss_family;
+		const void* address = &((const struct sockaddr_in*)&peer)->sin_addr;
+		if (family == AF_INET6)
+		{
+			const struct in6_addr* address6 = &((const struct sockaddr_in6*)&peer)->sin6_addr;
+			address = address6;
+			if (IN6_IS_ADDR_V4MAPPED(address6)) // IPv4 through the dual-stack listener: shown as plain IPv4
+			{
+				family = AF_INET;
+				address = address6->s6_addr + 12;
+			}
+		}
+		if (inet_ntop(family, address, buffer, sizeof(buffer)))
+			_info->ipAddress = buffer;
+	}
+	return (_info->ipAddress);
 }
 
 int Client::getPort() const
 {
-	return (_port);
+	return (_info->port);
 }
 
 std::string Client::getNickname() const
@@ -51,17 +211,19 @@ std::string Client::getNickname() const
 
 std::string Client::getUsername() const
 {
-	return (_username);
+	return (_info->username);
 }
 
 std::string Client::getRealname() const
 {
-	return (_realname);
+	return (_info->realname);
 }
 
 std::string Client::getHostname() const
 {
-	return (_hostname);
+	if (_info->hostname.empty())
+		return (getIpAddress());
+	return (_info->hostname);
 }
 
 bool Client::isAuthenticated() const
@@ -76,7 +238,107 @@ bool Client::isPasswordGiven() const
 
 bool Client::isRegistered() const
 {
-	return (_registered);
+	return (_hot().flags & CLIENT_HOT_REGISTERED);
+}
+
+bool Client::isCapNegotiating() const
+{
+	return (_capNegotiating);
+}
+
+bool Client::isAuthPending() const
+{
+	return (_authPending);
+}
+
+const std::string& Client::getAccount() const
+{
+	return (_info->account);
+}
+
+const std::string& Client::getSaslMechanism() const
+{
+	return (_info->saslMechanism);
+}
+
+std::string& Client::getSaslBuffer()
+{
+	return (_info->saslBuffer);
+}
+
+bool Client::hasCapability(const std::string& capability) const
+{
+	return (_info->capabilities.find(capability) != _info->capabilities.end());
+}
+
+const std::set<std::string>& Client::getCapabilities() const
+{
+	return (_info->capabilities);
+}
+
+bool Client::isServerLink() const
+{
+	return (_hot().flags & CLIENT_HOT_LINK);
+}
+
+bool Client::isLinkOutbound() const
+{
+	return (_info->linkOutbound);
+}
+
+const std::string& Client::getLinkName() const
+{
+	return (_info->linkName);
+}
+
+bool Client::isRemote() const
+{
+	return (_uplink != NULL);
+}
+
+Client* Client::getUplink() const
+{
+	return (_uplink);
+}
+
+bool Client::isMeshLink() const
+{
+	return (_meshPeer != -1);
+}
+
+const HostKey& Client::getHostKey() const
+{
+	return (_info->hostKey);
+}
+
+ConnectionClass* Client::getConnectionClass() const
+{
+	return (_connectionClass);
+}
+
+struct ssl_st* Client::getTls() const
+{
+	return (_tls);
+}
+
+bool Client::isTlsHandshaking() const
+{
+	return (_tlsHandshaking);
+}
+
+bool Client::isKtlsSend() const
+{
+	return (_ktlsSend);
+}
+
+int Client::getMeshPeer() const
+{
+	return (_meshPeer);
+}
+
+bool Client::isInjector() const
+{
+	return (_hot().flags & CLIENT_HOT_INJECTOR);
 }
 
 const std::string& Client::getReceiveBuffer() const
@@ -84,43 +346,111 @@ const std::string& Client::getReceiveBuffer() const
 	return (_receiveBuffer);
 }
 
-const std::string& Client::getSendBuffer() const
+bool Client::hasCommand() const
 {
-	return (_sendBuffer);
+	return (_receiveBuffer.find('\n') != std::string::npos);
+}
+
+bool Client::isReadyQueued() const
+{
+	return (_readyQueued);
+}
+
+std::string Client::getSendBuffer() const
+{
+	std::string output = _sendBuffer;
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+		output.append(_lanes[lane], _laneHeads[lane], std::string::npos);
+	return (output);
+}
+
+size_t Client::getMemoryUsage() const
+{
+	size_t bytes = sizeof(Client) + sizeof(ClientHot) + sizeof(ClientInfo);
+	bytes += stringHeapBytes(_receiveBuffer) + stringHeapBytes(_sendBuffer) + stringHeapBytes(_nickname);
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+		bytes += stringHeapBytes(_lanes[lane]);
+	bytes += stringHeapBytes(_info->ipAddress) + stringHeapBytes(_info->username) + stringHeapBytes(_info->realname)
+		+ stringHeapBytes(_info->hostname) + stringHeapBytes(_info->account) + stringHeapBytes(_info->saslMechanism)
+		+ stringHeapBytes(_info->saslBuffer) + stringHeapBytes(_info->linkName);
+	for (std::set<std::string>::const_iterator it = _info->capabilities.begin(); it != _info->capabilities.end(); ++it)
+		bytes += SET_NODE_HEADER + sizeof(std::string) + stringHeapBytes(*it);
+	bytes += _joinedChannels.size() * (SET_NODE_HEADER + sizeof(Channel*));
+	return (bytes);
 }
 
-const std::set<std::string>& Client::getJoinedChannels() const
+bool Client::hasOutput() const
+{
+	return (_sendQueued > 0);
+}
+
+size_t Client::getSendQueued() const
+{
+	return (_sendQueued);
+}
+
+long Client::getSendqLimit() const
+{
+	if (!_connectionClass || (_hot().flags & (CLIENT_HOT_LINK | CLIENT_HOT_INJECTOR)))
+		return (0);
+	return (_connectionClass->sendq);
+}
+
+bool Client::isSendqExceeded() const
+{
+	return (_sendqExceeded);
+}
+
+const std::set<Channel*>& Client::getJoinedChannels() const
 {
 	return (_joinedChannels);
 }
 
+void Client::setState(ClientState state)
+{
+	_setFlag(CLIENT_HOT_CLOSING, state == CLIENT_CLOSING);
+}
+
 void Client::setNickname(const std::string& nickname)
 {
-	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << _clientFd << " nickname set to: " << nickname << std::endl;
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << getClientFd() << " nickname set to: " << nickname << std::endl;
 	_nickname = nickname;
 }
 
 void Client::setUsername(const std::string& username)
 {
-	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << _clientFd << " username set to: " << username << std::endl;
-	_username = username;
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << getClientFd() << " username set to: " << username << std::endl;
+	_info->username = username;
 }
 
 void Client::setRealname(const std::string& realname)
 {
-	_realname = realname;
+	_info->realname = realname;
 }
 
 void Client::setHostname(const std::string& hostname)
 {
-	_hostname = hostname;
+	_info->hostname = hostname;
+}
+
+void Client::setPeerAddress(const struct sockaddr* address, socklen_t length)
+{
+	if (length > sizeof(_info->peerAddress))
+		length = sizeof(_info->peerAddress);
+	std::memcpy(&_info->peerAddress, address, length);
+	_info->ipAddress.clear();
+	_info->hostname.clear();
+	if (address->sa_family == AF_INET)
+		_info->port = ntohs(((const struct sockaddr_in*)address)->sin_port);
+	else if (address->sa_family == AF_INET6)
+		_info->port = ntohs(((const struct sockaddr_in6*)address)->sin6_port);
 }
 
 void Client::setAuthenticated(bool authenticated)
 {
 	_authenticated = authenticated;
 	if (authenticated)
-		std::cout << "Client " << _clientFd << " authenticated" << std::endl;
+		std::cout << "Client " << getClientFd() << " authenticated" << std::endl;
 }
 
 void Client::setPasswordGiven(bool given)
@@ -130,14 +460,110 @@ void Client::setPasswordGiven(bool given)
 
 void Client::setRegistered(bool registered)
 {
-	_registered = registered;
+	_setFlag(CLIENT_HOT_REGISTERED, registered);
 	if (registered)
-		std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << _clientFd << " (" << _nickname << ") registered" << std::endl;
+		std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << getClientFd() << " (" << _nickname << ") registered" << std::endl;
+}
+
+void Client::setCapNegotiating(bool negotiating)
+{
+	_capNegotiating = negotiating;
+}
+
+void Client::setAuthPending(bool pending)
+{
+	_authPending = pending;
+}
+
+void Client::setAccount(const std::string& account)
+{
+	_info->account = account;
+}
+
+// starting or ending an exchange drops any partial payload
+void Client::setSaslMechanism(const std::string& mechanism)
+{
+	_info->saslMechanism = mechanism;
+	_info->saslBuffer.clear();
+}
+
+void Client::setCapability(const std::string& capability, bool enabled)
+{
+	if (enabled)
+		_info->capabilities.insert(capability);
+	else
+		_info->capabilities.erase(capability);
+}
+
+void Client::setServerLink(const std::string& linkName)
+{
+	_setFlag(CLIENT_HOT_LINK, true);
+	_info->linkName = linkName;
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << getClientFd() << " is now a link to server " << linkName << std::endl;
+}
+
+void Client::setLinkOutbound(bool outbound)
+{
+	_info->linkOutbound = outbound;
+}
+
+void Client::setUplink(Client* uplink)
+{
+	_uplink = uplink;
+	_setFlag(CLIENT_HOT_REMOTE, uplink != NULL);
+}
+
+void Client::setMeshPeer(int worker)
+{
+	_meshPeer = worker;
+}
+
+void Client::setInjector(bool injector)
+{
+	_setFlag(CLIENT_HOT_INJECTOR, injector);
+}
+
+unsigned long Client::nextInjectFrame()
+{
+	return (++_info->injectFrames);
+}
+
+void Client::setHostKey(const HostKey& key)
+{
+	_info->hostKey = key;
+}
+
+void Client::setConnectionClass(ConnectionClass* connectionClass)
+{
+	_connectionClass = connectionClass;
+}
+
+// the client owns the session from now on (freed by the destructor)
+void Client::setTls(struct ssl_st* tls)
+{
+	_tls = tls;
+}
+
+void Client::setTlsHandshaking(bool handshaking)
+{
+	_tlsHandshaking = handshaking;
+}
+
+void Client::setKtlsSend(bool enabled)
+{
+	_ktlsSend = enabled;
+}
+
+void Client::setReadyQueued(bool queued)
+{
+	_readyQueued = queued;
 }
 
 void Client::appendToReceiveBuffer(const char* data, size_t size)
 {
+	g_bufferPool.take(_receiveBuffer, _receiveBuffer.length() + size);
 	_receiveBuffer.append(data, size);
+	_lastRead = time(NULL);
 }
 
 bool Client::extractCommand(std::string& command)
@@ -158,64 +584,172 @@ bool Client::extractCommand(std::string& command)
 	else
 		_receiveBuffer.erase(0, pos + 1);
 	
-	std::cout << "   Command extracted from client " << _clientFd << ": [" << command << "]" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
+	std::cout << "   Command extracted from client " << getClientFd() << ": [" << command << "]" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
 	return (true);
 }
 
-void Client::appendToSendBuffer(const std::string& data)
+void Client::appendToSendBuffer(const std::string& data, OutputLane lane)
 {
-	_sendBuffer.append(data);
-	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Added " << data.length() << " bytes to send buffer for client " << _clientFd 
-	          << " (total: " << _sendBuffer.length() << " bytes)" << std::endl;
+	g_bufferPool.take(_lanes[lane], _lanes[lane].length() + data.length());
+	_lanes[lane].append(data);
+	_sendQueued += data.length();
+	std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Added " << data.length() << " bytes to send buffer for client " << getClientFd() 
+	          << " (total: " << _sendQueued << " bytes)" << std::endl;
 }
 
-void Client::consumeFromSendBuffer(size_t bytes)
+// top the wire up with whole lines, highest lane first: a line never goes out half-written before
+// another lane's line, and a new control line waits behind at most CLIENT_WIRE_CHUNK bytes
+const std::string& Client::nextOutput()
+{
+	for (int lane = 0; lane < OUTPUT_LANES && _sendBuffer.length() < CLIENT_WIRE_CHUNK; ++lane)
+	{
+		std::string& queue = _lanes[lane];
+		size_t head = _laneHeads[lane];
+		size_t available = queue.length() - head;
+		if (available == 0)
+			continue;
+		size_t room = CLIENT_WIRE_CHUNK - _sendBuffer.length();
+		size_t take = available;
+		if (take > room)
+		{
+			size_t end = queue.rfind('\n', head + room - 1);
+			if (end != std::string::npos && end >= head)
+				take = end + 1 - head;
+			else if (_sendBuffer.empty()) // no line break in reach (binary frames): raw bytes
+				take = room;
+			else
+				break;
+		}
+		g_bufferPool.take(_sendBuffer, _sendBuffer.length() + take);
+		_sendBuffer.append(queue, head, take);
+		_laneHeads[lane] += take;
+		if (_laneHeads[lane] == queue.length())
+		{
+			if (queue.capacity() > CLIENT_WIRE_CHUNK * 4) // a burst is over: give its memory back
+				std::string().swap(queue);
+			else
+				queue.clear();
+			_laneHeads[lane] = 0;
+		}
+		else if (_laneHeads[lane] > queue.length() / 2)
+		{
+			queue.erase(0, _laneHeads[lane]);
+			_laneHeads[lane] = 0;
+		}
+		if (take < available)
+			break;
+	}
+	return (_sendBuffer);
+}
+
+void Client::consumeFromReceiveBuffer(size_t bytes)
 {
-	if (bytes >= _sendBuffer.length())
-		_sendBuffer.clear();
+	if (bytes >= _receiveBuffer.length())
+		_receiveBuffer.clear();
 	else
-		_sendBuffer.erase(0, bytes);
+		_receiveBuffer.erase(0, bytes);
+}
+
+void Client::consumeFromSendBuffer(size_t bytes)
+{
+	if (bytes > _sendBuffer.length())
+		bytes = _sendBuffer.length();
+	_sendBuffer.erase(0, bytes);
+	_sendQueued -= bytes;
+	_lastSend = time(NULL);
+	if (_droppedLines > 0 && _sendQueued < (size_t)getSendqLimit() / 4) // well under the mark, not flapping around it
+	{
+		std::cout << PASTEL_YELLOW << "[SENDQ] " << DEFAULT << "Client [" << getClientFd() << "] is reading again, "
+		          << _droppedLines << " lines were dropped" << std::endl;
+		_droppedLines = 0;
+	}
 }
 
 void Client::clearSendBuffer()
 {
 	_sendBuffer.clear();
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+	{
+		_lanes[lane].clear();
+		_laneHeads[lane] = 0;
+	}
+	_sendQueued = 0;
+	_droppedLines = 0;
 }
 
-void Client::joinChannel(const std::string& channelName)
+// the buffers keep their peak capacity otherwise: thousands of idle clients would pin their last burst
+// a busy client that is only between two lines keeps them (taking them away would just churn memory)
+size_t Client::reclaimBuffers(time_t now, time_t quiet)
 {
-	_joinedChannels.insert(channelName);
-	std::cout << "Client " << _nickname << " joined channel " << channelName 
+	if (_sendQueued > 0 || !_receiveBuffer.empty() || now - _lastRead < quiet || now - _lastSend < quiet)
+		return (0);
+	size_t bytes = g_bufferPool.give(_receiveBuffer) + g_bufferPool.give(_sendBuffer);
+	for (int lane = 0; lane < OUTPUT_LANES; ++lane)
+	{
+		bytes += g_bufferPool.give(_lanes[lane]);
+		_laneHeads[lane] = 0;
+	}
+	return (bytes);
+}
+
+void Client::joinChannel(Channel* channel)
+{
+	_joinedChannels.insert(channel);
+	std::cout << "Client " << _nickname << " joined channel " << channel->getName() 
 	          << " (total: " << _joinedChannels.size() << " channels)" << std::endl;
 }
 
-void Client::leaveChannel(const std::string& channelName)
+void Client::leaveChannel(Channel* channel)
 {
-	_joinedChannels.erase(channelName);
-	std::cout << "Client " << _nickname << " left channel " << channelName 
+	_joinedChannels.erase(channel);
+	std::cout << "Client " << _nickname << " left channel " << channel->getName() 
 	          << " (remaining: " << _joinedChannels.size() << " channels)" << std::endl;
 }
 
-bool Client::isInChannel(const std::string& channelName) const
+bool Client::isInChannel(Channel* channel) const
 {
-	return (_joinedChannels.find(channelName) != _joinedChannels.end());
+	return (_joinedChannels.find(channel) != _joinedChannels.end());
 }
 
 std::string Client::getPrefix() const
 {
 	std::stringstream ss;
 	ss << ":" << _nickname;
-	if (!_username.empty())
-		ss << "!" << _username;
-	if (!_hostname.empty())
-		ss << "@" << _hostname;
+	if (!_info->username.empty())
+		ss << "!" << _info->username;
+	std::string hostname = getHostname();
+	if (!hostname.empty())
+		ss << "@" << hostname;
 	return (ss.str());
 }
 
-void Client::sendMessage(const std::string& message)
+void Client::sendMessage(const std::string& message, OutputLane lane)
 {
-	if (message.length() >= 2 && message.substr(message.length() - 2) == "\r\n")
-		appendToSendBuffer(message);
+	if (_uplink) // remote client: the line travels through its link
+	{
+		_uplink->sendMessage(message);
+		return;
+	}
+	if (_hot().flags & (CLIENT_HOT_LINK | CLIENT_HOT_INJECTOR))
+		lane = LANE_CONTROL;
+	bool terminated = (message.length() >= 2 && message.compare(message.length() - 2, 2, "\r\n") == 0);
+	size_t length = message.length() + (terminated ? 0 : 2);
+	long limit = getSendqLimit();
+	if (limit > 0 && _sendQueued + length > (size_t)(lane == LANE_CHANNEL ? limit / 2 : limit))
+	{
+		if (lane == LANE_CONTROL)
+		{
+			if (!_sendqExceeded)
+				std::cerr << "[SENDQ] Client [" << getClientFd() << "] exceeded its SendQ of " << limit << " bytes" << std::endl;
+			_sendqExceeded = true;
+		}
+		else if (_droppedLines++ == 0)
+			std::cout << PASTEL_YELLOW << "[SENDQ] " << DEFAULT << "Client [" << getClientFd() << "] is not reading ("
+			          << _sendQueued << " bytes queued): dropping its channel messages" << (lane == LANE_DIRECT ? " and private ones" : "") << std::endl;
+		return;
+	}
+	if (terminated)
+		appendToSendBuffer(message, lane);
 	else
-		appendToSendBuffer(message + "\r\n");
+		appendToSendBuffer(message + "\r\n", lane);
 }
@@ -2,9 +2,11 @@
 #include "Colors.hpp"
 #include <cctype>
 
-CommandHandler::CommandHandler(Server *server) : _server(server)
+CommandHandler::CommandHandler(Server *server) : _server(server), _batchCounter(0)
 {
     _initCommandMap();
+    _initLinkCommandMap();
+    _initCapabilities();
 }
 
 // dispatch IRC commands to the right methods
@@ -13,6 +15,8 @@ void CommandHandler::_initCommandMap()
     _commandMap["PASS"] = &CommandHandler::cmdPass;
     _commandMap["NICK"] = &CommandHandler::cmdNick;
     _commandMap["USER"] = &CommandHandler::cmdUser;
+    _commandMap["CAP"] = &CommandHandler::cmdCap;
+    _commandMap["AUTHENTICATE"] = &CommandHandler::cmdAuthenticate;
     
     _commandMap["JOIN"] = &CommandHandler::cmdJoin;
     _commandMap["PART"] = &CommandHandler::cmdPart;
@@ -20,6 +24,7 @@ void CommandHandler::_initCommandMap()
     
     _commandMap["PRIVMSG"] = &CommandHandler::cmdPrivmsg;
     _commandMap["NOTICE"] = &CommandHandler::cmdNotice;
+    _commandMap["CHATHISTORY"] = &CommandHandler::cmdChathistory;
     
     _commandMap["KICK"] = &CommandHandler::cmdKick;
     _commandMap["INVITE"] = &CommandHandler::cmdInvite;
@@ -28,6 +33,42 @@ void CommandHandler::_initCommandMap()
     
     _commandMap["QUIT"] = &CommandHandler::cmdQuit;
     _commandMap["PING"] = &CommandHandler::cmdPing;
+    
+    _commandMap["SERVER"] = &CommandHandler::cmdServer;
+}
+
+// commands accepted from a linked server
+void CommandHandler::_initLinkCommandMap()
+{
+    _linkCommandMap["UID"] = &CommandHandler::linkUid;
+    _linkCommandMap["SJOIN"] = &CommandHandler::linkSjoin;
+    _linkCommandMap["TB"] = &CommandHandler::linkTopicBurst;
+    _linkCommandMap["EOB"] = &CommandHandler::linkEob;
+    _linkCommandMap["KILL"] = &CommandHandler::linkKill;
+    _linkCommandMap["ERROR"] = &CommandHandler::linkError;
+    
+    _linkCommandMap["QUIT"] = &CommandHandler::linkQuit;
+    _linkCommandMap["NICK"] = &CommandHandler::linkNick;
+    _linkCommandMap["JOIN"] = &CommandHandler::linkJoin;
+    _linkCommandMap["PART"] = &CommandHandler::linkPart;
+    _linkCommandMap["KICK"] = &CommandHandler::linkKick;
+    _linkCommandMap["TOPIC"] = &CommandHandler::linkTopic;
+    _linkCommandMap["MODE"] = &CommandHandler::linkMode;
+    _linkCommandMap["PRIVMSG"] = &CommandHandler::linkMessage;
+    _linkCommandMap["NOTICE"] = &CommandHandler::linkMessage;
+    _linkCommandMap["INVITE"] = &CommandHandler::linkInvite;
+}
+
+// IRCv3 capabilities the server can enable for a client
+void CommandHandler::_initCapabilities()
+{
+    _capabilities.insert(CAP_NO_IMPLICIT_NAMES);
+    _capabilities.insert(CAP_CHATHISTORY);
+    _capabilities.insert(CAP_BATCH);
+    _capabilities.insert(CAP_SERVER_TIME);
+    _capabilities.insert(CAP_MESSAGE_TAGS);
+    if (_server->getAccountStore().isOpen())
+        _capabilities.insert(CAP_SASL);
 }
 
 // parse an input from a client (for ex: "PRIVMSG #channel :Hello everyone!")
@@ -78,6 +119,12 @@ void CommandHandler::processCommand(Client* client, const std::string &input)
     if (!client || input.empty())
         return;
 
+    if (client->isServerLink())
+    {
+        _processLinkCommand(client, input);
+        return;
+    }
+
     std::string command;
     std::vector<std::string> params;
     _parseInput(input, command, params);
@@ -122,12 +169,47 @@ void CommandHandler::sendNumericReply(Client* client, const std::string& numeric
     _server->_setPollOut(client->getClientFd());
 }
 
+// send the channel's cached names list as RPL_NAMREPLY lines that fit in 512 bytes, then RPL_ENDOFNAMES
+void CommandHandler::sendNamesReply(Client* client, Channel* channel)
+{
+    const std::string& names = channel->getNamesList();
+    const std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+    const std::string head = "= " + channel->getName() + " :";
+
+    // ":server 353 nick = #channel :" + names + "\r\n" must not exceed 512 bytes
+    size_t overhead = 1 + _server->getServerName().length() + 1 + 3 + 1 + nick.length() + 1 + head.length() + 2;
+    size_t maxChunk = (overhead < 512) ? 512 - overhead : 1;
+
+    size_t start = 0;
+    while (start < names.length())
+    {
+        size_t len = names.length() - start;
+        if (len > maxChunk)
+        {
+            size_t space = names.rfind(' ', start + maxChunk);
+            len = (space != std::string::npos && space > start) ? space - start : maxChunk;
+        }
+        sendNumericReply(client, RPL_NAMREPLY, head + names.substr(start, len));
+        start += len;
+        while (start < names.length() && names[start] == ' ')
+            ++start;
+    }
+    sendNumericReply(client, RPL_ENDOFNAMES, channel->getName() + " :End of /NAMES list");
+}
+
+// send an IRCv3 standard reply: FAIL <command> <code> [context] :<description>
+void CommandHandler::sendFail(Client* client, const std::string& command, const std::string& code, const std::string& message)
+{
+    client->sendMessage(":" + _server->getServerName() + " FAIL " + command + " " + code + " " + message + "\r\n");
+    _server->_setPollOut(client->getClientFd());
+}
+
 // send all the mandatory IRC welcome msgs to a client after a successful connection & registration
 void CommandHandler::sendWelcomeMsg(Client* client)
 {
     const std::string serverVersion = "1.0";
     const std::string serverCreation = "This server was created today";
-    const std::string serverModes = "o itkol";
+    const std::string serverModes = "o itkolu";
 
     std::string welcomeMsg = ": Welcome to the Internet Relay Network " + client->getPrefix();
     sendNumericReply(client, RPL_WELCOME, welcomeMsg);
@@ -141,6 +223,18 @@ void CommandHandler::sendWelcomeMsg(Client* client)
     sendNumericReply(client, RPL_MYINFO, myInfoMsg);
 }
 
+// finish registration once PASS, NICK and USER are given and CAP negotiation is over
+void CommandHandler::tryCompleteRegistration(Client* client)
+{
+    if (client->isRegistered() || client->isCapNegotiating())
+        return;
+    if (!client->isPasswordGiven() || client->getNickname().empty() || client->getUsername().empty())
+        return;
+    client->setRegistered(true);
+    sendWelcomeMsg(client);
+    _server->introduceClient(client);
+}
+
 // check if the nickname is valid according to IRC rules
 bool CommandHandler::isValidNickname(const std::string& nickname)
 {
@@ -0,0 +1,83 @@
+#include "Config.hpp"
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <stdexcept>
+
+static std::string trim(const std::string& str)
+{
+	size_t start = str.find_first_not_of(" \t\r");
+	if (start == std::string::npos)
+		return ("");
+	size_t end = str.find_last_not_of(" \t\r");
+	return (str.substr(start, end - start + 1));
+}
+
+Config::Config()
+{
+}
+
+Config::Config(const std::string& path)
+	: _path(path)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+		throw std::runtime_error("Error: cannot open config file " + path);
+
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		++lineNumber;
+		line = trim(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+		size_t eq = line.find('=');
+		if (eq == std::string::npos)
+		{
+			std::stringstream ss;
+			ss << "Error: " << path << ":" << lineNumber << ": expected 'key = value'";
+			throw std::runtime_error(ss.str());
+		}
+		_values[trim(line.substr(0, eq))].push_back(trim(line.substr(eq + 1)));
+	}
+}
+
+const std::string& Config::getPath() const
+{
+	return (_path);
+}
+
+bool Config::has(const std::string& key) const
+{
+	return (_values.find(key) != _values.end());
+}
+
+// last value wins for single-valued keys
+std::string Config::get(const std::string& key, const std::string& defaultValue) const
+{
+	std::map<std::string, std::vector<std::string> >::const_iterator it = _values.find(key);
+	if (it == _values.end() || it->second.empty())
+		return (defaultValue);
+	return (it->second.back());
+}
+
+long Config::getInt(const std::string& key, long defaultValue) const
+{
+	std::string value = get(key);
+	if (value.empty())
+		return (defaultValue);
+	char* end;
+	long result = std::strtol(value.c_str(), &end, 10);
+	if (*end != '\0')
+		throw std::runtime_error("Error: config key " + key + " expects a number, got '" + value + "'");
+	return (result);
+}
+
+std::vector<std::string> Config::getAll(const std::string& key) const
+{
+	std::map<std::string, std::vector<std::string> >::const_iterator it = _values.find(key);
+	if (it == _values.end())
+		return (std::vector<std::string>());
+	return (it->second);
+}
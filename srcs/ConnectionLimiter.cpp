@@ -0,0 +1,201 @@
+#include "ConnectionLimiter.hpp"
+#include <cstring>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define LIMIT_INITIAL_SLOTS	1024
+
+HostKey::HostKey() : high(0), low(0)
+{
+}
+
+bool HostKey::isSet() const
+{
+	return (high != 0 || low != 0);
+}
+
+bool HostKey::operator==(const HostKey& other) const
+{
+	return (high == other.high && low == other.low);
+}
+
+static uint64_t readBigEndian(const unsigned char* bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i)
+		value = (value << 8) | bytes[i];
+	return (value);
+}
+
+// 64-bit finalizer (murmur3): neighbouring addresses land far apart
+static size_t hashOf(const HostKey& key)
+{
+	uint64_t h = key.high * 0x9e3779b97f4a7c15ULL ^ key.low;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return ((size_t)h);
+}
+
+ConnectionLimiter::ConnectionLimiter()
+	: _table(LIMIT_INITIAL_SLOTS), _used(0),
+	  _maxPerHost(LIMIT_DEFAULT_PER_HOST), _rate(LIMIT_DEFAULT_RATE), _burst(LIMIT_DEFAULT_BURST)
+{
+	for (size_t i = 0; i < _table.size(); ++i)
+		_table[i].used = false;
+}
+
+// 0 disables a limit
+void ConnectionLimiter::configure(long maxPerHost, long rate, long burst)
+{
+	_maxPerHost = (maxPerHost > 0) ? maxPerHost : 0;
+	_rate = (rate > 0) ? rate : 0;
+	_burst = (burst > 0) ? burst : 1;
+}
+
+// linear probing: the entry of key, or the empty slot where it goes
+ConnectionLimiter::Entry& ConnectionLimiter::_slot(const HostKey& key)
+{
+	size_t mask = _table.size() - 1;
+	size_t i = hashOf(key) & mask;
+	while (_table[i].used && !(_table[i].key == key))
+		i = (i + 1) & mask;
+	return (_table[i]);
+}
+
+void ConnectionLimiter::_refill(Entry& entry, double now) const
+{
+	if (now > entry.refilled)
+	{
+		entry.tokens += (now - entry.refilled) * _rate;
+		if (entry.tokens > _burst)
+			entry.tokens = _burst;
+	}
+	entry.refilled = now;
+}
+
+// rebuild the table, dropping the entries that carry no state any more (now < 0 keeps them all)
+void ConnectionLimiter::_rehash(size_t capacity, double now)
+{
+	std::vector<Entry> old(capacity);
+	old.swap(_table);
+	for (size_t i = 0; i < _table.size(); ++i)
+		_table[i].used = false;
+	_used = 0;
+	for (size_t i = 0; i < old.size(); ++i)
+	{
+		if (!old[i].used)
+			continue;
+		if (now >= 0)
+		{
+			_refill(old[i], now);
+			if (old[i].connections == 0 && old[i].tokens >= _burst)
+				continue;
+		}
+		_slot(old[i].key) = old[i];
+		++_used;
+	}
+}
+
+// the entry of key, created with a full bucket for a new host
+ConnectionLimiter::Entry& ConnectionLimiter::_entry(const HostKey& key, double now)
+{
+	Entry* entry = &_slot(key);
+	if (!entry->used)
+	{
+		if ((_used + 1) * 2 > _table.size())
+		{
+			_rehash(_table.size() * 2, -1);
+			entry = &_slot(key);
+		}
+		entry->used = true;
+		entry->key = key;
+		entry->connections = 0;
+		entry->tokens = _burst;
+		entry->refilled = now;
+		++_used;
+	}
+	return (*entry);
+}
+
+ConnectionLimiter::Verdict ConnectionLimiter::admit(const HostKey& key, double now)
+{
+	Entry& entry = _entry(key, now);
+	if (_maxPerHost && entry.connections >= _maxPerHost)
+		return (TOO_MANY);
+	if (_rate > 0)
+	{
+		_refill(entry, now);
+		if (entry.tokens < 1)
+			return (THROTTLED);
+		entry.tokens -= 1;
+	}
+	++entry.connections;
+	return (ADMIT);
+}
+
+void ConnectionLimiter::track(const HostKey& key)
+{
+	++_entry(key, 0).connections;
+}
+
+void ConnectionLimiter::release(const HostKey& key)
+{
+	Entry& entry = _slot(key);
+	if (entry.used && entry.connections > 0)
+		--entry.connections;
+}
+
+// also shrinks the table back after a flood from many addresses
+void ConnectionLimiter::sweep(double now)
+{
+	size_t capacity = _table.size();
+	while (capacity > LIMIT_INITIAL_SLOTS && _used * 8 < capacity)
+		capacity /= 2;
+	_rehash(capacity, now);
+}
+
+size_t ConnectionLimiter::size() const
+{
+	return (_used);
+}
+
+HostKey ConnectionLimiter::keyOf(const struct sockaddr* addr)
+{
+	HostKey key;
+	if (addr->sa_family == AF_INET)
+	{
+		key.low = 0xffff00000000ULL | ntohl(((const struct sockaddr_in*)addr)->sin_addr.s_addr);
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		const unsigned char* bytes = ((const struct sockaddr_in6*)addr)->sin6_addr.s6_addr;
+		key.high = readBigEndian(bytes);
+		if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6*)addr)->sin6_addr))
+			key.low = readBigEndian(bytes + 8); // a whole IPv4 address
+		else
+			key.low = 1; // the /64 only (and never the unset key, even for ::1)
+	}
+	return (key);
+}
+
+HostKey ConnectionLimiter::keyOf(const std::string& address)
+{
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 addr6;
+	std::memset(&addr4, 0, sizeof(addr4));
+	std::memset(&addr6, 0, sizeof(addr6));
+	if (inet_pton(AF_INET, address.c_str(), &addr4.sin_addr) == 1)
+	{
+		addr4.sin_family = AF_INET;
+		return (keyOf((const struct sockaddr*)&addr4));
+	}
+	if (inet_pton(AF_INET6, address.c_str(), &addr6.sin6_addr) == 1)
+	{
+		addr6.sin6_family = AF_INET6;
+		return (keyOf((const struct sockaddr*)&addr6));
+	}
+	return (HostKey());
+}
@@ -0,0 +1,62 @@
+#include "Mesh.hpp"
+#include <cstring>
+#include <sys/mman.h>
+
+size_t MeshRing::push(const char* src, size_t len)
+{
+	uint64_t writePos = head;
+	uint64_t readPos = tail;
+	__sync_synchronize(); // see the consumer's tail before reusing the space it freed
+
+	size_t space = MESH_RING_SIZE - (size_t)(writePos - readPos);
+	if (len > space)
+		len = space;
+	size_t offset = writePos % MESH_RING_SIZE;
+	size_t first = (len < MESH_RING_SIZE - offset) ? len : MESH_RING_SIZE - offset;
+	std::memcpy(data + offset, src, first);
+	std::memcpy(data, src + first, len - first);
+
+	__sync_synchronize(); // publish the bytes before the new head
+	head = writePos + len;
+	return (len);
+}
+
+size_t MeshRing::pop(char* dst, size_t len)
+{
+	uint64_t readPos = tail;
+	uint64_t writePos = head;
+	__sync_synchronize(); // see the bytes behind the producer's head
+
+	size_t available = (size_t)(writePos - readPos);
+	if (len > available)
+		len = available;
+	size_t offset = readPos % MESH_RING_SIZE;
+	size_t first = (len < MESH_RING_SIZE - offset) ? len : MESH_RING_SIZE - offset;
+	std::memcpy(dst, data + offset, first);
+	std::memcpy(dst + first, data, len - first);
+
+	__sync_synchronize(); // finish reading before handing the space back
+	tail = readPos + len;
+	return (len);
+}
+
+// zero-filled by mmap, which is the empty state of every ring
+MeshRing* Mesh::create(int workers)
+{
+	void* memory = mmap(NULL, sizeof(MeshRing) * workers * workers, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return (NULL);
+	return ((MeshRing*)memory);
+}
+
+void Mesh::destroy(MeshRing* rings, int workers)
+{
+	if (rings)
+		munmap(rings, sizeof(MeshRing) * workers * workers);
+}
+
+MeshRing* Mesh::ring(MeshRing* rings, int workers, int from, int to)
+{
+	return (&rings[from * workers + to]);
+}
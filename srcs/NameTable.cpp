@@ -0,0 +1,142 @@
+#include "NameTable.hpp"
+#include <stdint.h>
+
+#define NAMES_INITIAL_SLOTS	1024
+
+static char foldChar(char c)
+{
+	return ((c >= 'A' && c <= '^') ? c + ('a' - 'A') : c);
+}
+
+std::string foldName(const std::string& name)
+{
+	std::string folded(name);
+	for (size_t i = 0; i < folded.length(); ++i)
+		folded[i] = foldChar(folded[i]);
+	return (folded);
+}
+
+// FNV-1a over the folded bytes, then the murmur3 finalizer so the low bits used as the slot are mixed too
+static size_t hashOf(const std::string& name)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < name.length(); ++i)
+	{
+		h ^= (unsigned char)foldChar(name[i]);
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return ((size_t)h);
+}
+
+static bool sameName(const std::string& folded, const std::string& name)
+{
+	if (folded.length() != name.length())
+		return (false);
+	for (size_t i = 0; i < name.length(); ++i)
+	{
+		if (folded[i] != foldChar(name[i]))
+			return (false);
+	}
+	return (true);
+}
+
+NameTable::NameTable() : _table(NAMES_INITIAL_SLOTS, (Name*)NULL), _used(0)
+{
+}
+
+NameTable::~NameTable()
+{
+	for (size_t i = 0; i < _table.size(); ++i)
+		delete _table[i];
+}
+
+// linear probing: the slot of name, or the empty slot where it goes
+size_t NameTable::_slot(const std::string& name, size_t hash) const
+{
+	size_t mask = _table.size() - 1;
+	size_t i = hash & mask;
+	while (_table[i] && (_table[i]->hash != hash || !sameName(_table[i]->folded, name)))
+		i = (i + 1) & mask;
+	return (i);
+}
+
+void NameTable::_rehash(size_t capacity)
+{
+	std::vector<Name*> old(capacity, (Name*)NULL);
+	old.swap(_table);
+	size_t mask = _table.size() - 1;
+	for (size_t i = 0; i < old.size(); ++i)
+	{
+		if (!old[i])
+			continue;
+		size_t slot = old[i]->hash & mask;
+		while (_table[slot])
+			slot = (slot + 1) & mask;
+		_table[slot] = old[i];
+	}
+}
+
+Name* NameTable::intern(const std::string& name)
+{
+	size_t hash = hashOf(name);
+	size_t slot = _slot(name, hash);
+	if (!_table[slot])
+	{
+		if ((_used + 1) * 2 > _table.size())
+		{
+			_rehash(_table.size() * 2);
+			slot = _slot(name, hash);
+		}
+		Name* entry = new Name;
+		entry->folded = foldName(name);
+		entry->hash = hash;
+		entry->refs = 0;
+		entry->channel = NULL;
+		entry->client = NULL;
+		_table[slot] = entry;
+		++_used;
+	}
+	++_table[slot]->refs;
+	return (_table[slot]);
+}
+
+Name* NameTable::find(const std::string& name) const
+{
+	return (_table[_slot(name, hashOf(name))]);
+}
+
+// backward shift deletion: the entries after the hole move up if that is closer to their home slot,
+// so no probe run is cut (and no tombstones pile up); the table shrinks back after a flood of names
+void NameTable::release(Name* name)
+{
+	if (!name || --name->refs > 0)
+		return;
+	size_t mask = _table.size() - 1;
+	size_t hole = name->hash & mask;
+	while (_table[hole] != name)
+		hole = (hole + 1) & mask;
+	for (size_t next = (hole + 1) & mask; _table[next]; next = (next + 1) & mask)
+	{
+		size_t home = _table[next]->hash & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			_table[hole] = _table[next];
+			hole = next;
+		}
+	}
+	_table[hole] = NULL;
+	--_used;
+	delete name;
+	if (_table.size() > NAMES_INITIAL_SLOTS && _used * 8 < _table.size())
+		_rehash(_table.size() / 2);
+}
+
+size_t NameTable::size() const
+{
+	return (_used);
+}
@@ -0,0 +1,119 @@
+#include "PasswordHash.hpp"
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+static std::string toHex(const std::string& data)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+	for (size_t i = 0; i < data.length(); ++i)
+	{
+		hex += digits[(unsigned char)data[i] >> 4];
+		hex += digits[(unsigned char)data[i] & 0x0f];
+	}
+	return (hex);
+}
+
+static bool fromHex(const std::string& hex, std::string& out)
+{
+	if (hex.length() % 2)
+		return (false);
+	out.clear();
+	for (size_t i = 0; i < hex.length(); i += 2)
+	{
+		char pair[3] = { hex[i], hex[i + 1], '\0' };
+		char* end;
+		long value = std::strtol(pair, &end, 16);
+		if (*end != '\0')
+			return (false);
+		out += (char)value;
+	}
+	return (true);
+}
+
+PasswordHash::PasswordHash() : _iterations(0)
+{
+}
+
+PasswordHash::PasswordHash(unsigned int iterations, const std::string& salt, const std::string& hash)
+	: _iterations(iterations), _salt(salt), _hash(hash)
+{
+}
+
+// single-block PBKDF2-HMAC-SHA256 (a 32-byte derived key)
+std::string PasswordHash::pbkdf2(const std::string& password, const std::string& salt, unsigned int iterations)
+{
+	unsigned char key[32];
+	if (PKCS5_PBKDF2_HMAC(password.c_str(), password.length(), (const unsigned char*)salt.c_str(), salt.length(),
+			iterations, EVP_sha256(), sizeof(key), key) != 1)
+		throw std::runtime_error("PasswordHash: PBKDF2 failed");
+	return (std::string((const char*)key, sizeof(key)));
+}
+
+PasswordHash PasswordHash::fromPassword(const std::string& password, unsigned int iterations)
+{
+	PasswordHash hash;
+	hash._iterations = iterations ? iterations : 1;
+	hash._salt.resize(PASSWORD_SALT_BYTES);
+	// no weak fallback: a predictable salt is worse than no hash at all
+	if (RAND_bytes((unsigned char*)&hash._salt[0], PASSWORD_SALT_BYTES) != 1)
+		throw std::runtime_error("PasswordHash: no random bytes for the salt");
+	hash._hash = pbkdf2(password, hash._salt, hash._iterations);
+	return (hash);
+}
+
+bool PasswordHash::parse(const std::string& encoded, PasswordHash& out)
+{
+	std::istringstream in(encoded);
+	std::string scheme, iterations, salt, hash;
+	if (!std::getline(in, scheme, '$') || scheme != "pbkdf2-sha256"
+		|| !std::getline(in, iterations, '$') || !std::getline(in, salt, '$') || !std::getline(in, hash))
+		return (false);
+	long rounds = std::atol(iterations.c_str());
+	if (rounds <= 0 || !fromHex(salt, out._salt) || !fromHex(hash, out._hash) || out._hash.length() != 32)
+		return (false);
+	out._iterations = rounds;
+	return (true);
+}
+
+bool PasswordHash::verify(const std::string& password) const
+{
+	std::string candidate;
+	try
+	{
+		candidate = pbkdf2(password, _salt, _iterations);
+	}
+	catch (const std::exception&) // runs on a pool thread: a failed derivation is a rejected password
+	{
+		return (false);
+	}
+	if (candidate.length() != _hash.length())
+		return (false);
+	return (CRYPTO_memcmp(candidate.c_str(), _hash.c_str(), candidate.length()) == 0); // constant time
+}
+
+std::string PasswordHash::encode() const
+{
+	std::stringstream ss;
+	ss << "pbkdf2-sha256$" << _iterations << "$" << toHex(_salt) << "$" << toHex(_hash);
+	return (ss.str());
+}
+
+unsigned int PasswordHash::getIterations() const
+{
+	return (_iterations);
+}
+
+const std::string& PasswordHash::getSalt() const
+{
+	return (_salt);
+}
+
+const std::string& PasswordHash::getHash() const
+{
+	return (_hash);
+}
@@ -3,31 +3,127 @@
 #include "Channel.hpp"
 #include "CommandHandler.hpp"
 #include "Colors.hpp"
+#include "Snapshot.hpp"
+#include "Mesh.hpp"
+#include "ThreadPool.hpp"
+#include "BufferPool.hpp"
 #include <iostream>
+#include <sstream>
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
 
 // server constructor
-Server::Server(int port, const std::string& password)
+Server::Server(int port, const std::string& password, const Config& config)
 	: _port(port),
 	  _password(password),
-	  _serverName("ft_irc.42.fr"),
-	  _serverSocket(-1),
+	  _serverName(config.get("server_name", "ft_irc.42.fr")),
+	  _config(config),
+	  _transport(&_socketTransport),
+	  _tlsContext(NULL),
+	  _acceptBudget(config.getInt("accept_budget", LIMIT_DEFAULT_ACCEPT_BUDGET)),
+	  _acceptsLeft(0),
+	  _rejectedTooMany(0),
+	  _rejectedThrottled(0),
+	  _rejectedClassFull(0),
+	  _lastLimiterSweep(time(NULL)),
+	  _lastBufferReclaim(time(NULL)),
+	  _bytesReclaimed(0),
+	  _loopStatsInterval(config.getInt("loop_stats", 0)),
+	  _lastLoopStats(time(NULL)),
+	  _loopIterations(0),
+	  _loopBusy(0),
+	  _loopMax(0),
+	  _readBudget(config.getInt("read_budget", SCHED_DEFAULT_READ_BUDGET)),
+	  _commandBudget(config.getInt("command_budget", SCHED_DEFAULT_COMMAND_BUDGET)),
+	  _drainTimeout(config.getInt("drain_timeout", DRAIN_DEFAULT_TIMEOUT)),
+	  _drainBatch(config.getInt("drain_batch", DRAIN_DEFAULT_BATCH)),
+	  _drainInterval(config.getInt("drain_interval", DRAIN_DEFAULT_INTERVAL)),
+	  _drainRequested(false),
+	  _draining(false),
+	  _drainDeadline(0),
+	  _nextDrainBatch(0),
+	  _drainClosed(0),
+	  _drainForced(0),
+	  _lastLinkAttempt(0),
+	  _workerId(0),
+	  _workerCount(1),
+	  _mesh(NULL),
+	  _meshNotifyFd(-1),
+	  _emptyChannels(0),
+	  _channelsCreated(0),
+	  _channelsRemoved(0),
+	  _historyBytes(0),
+	  _historyEntries(0),
+	  _nextMsgId(1),
+	  _snapshotPid(-1),
+	  _lastSnapshot(time(NULL)),
 	  _commandHandler(NULL),
-	  _isrunning(false)
+	  _threadPool(NULL),
+	  _isrunning(false),
+	  _upgradeRequested(false),
+	  _statsRequested(false),
+	  _handedOff(false),
+	  _upgradeSock(-1)
 {
 	std::cout << "Server constructor called..." << std::endl;
 	if (port <= 0 || port > 65535)
 		throw std::runtime_error("Error: Invalid port number");
 	if (password.empty())
 		throw std::runtime_error("Error: Password cannot be empty");
-	_initSocket();
+	_initClasses();
+	if (_acceptBudget <= 0)
+		_acceptBudget = LIMIT_DEFAULT_ACCEPT_BUDGET;
+	if (_readBudget <= 0)
+		_readBudget = SCHED_DEFAULT_READ_BUDGET;
+	if (_commandBudget <= 0)
+		_commandBudget = SCHED_DEFAULT_COMMAND_BUDGET;
+	if (_drainBatch <= 0)
+		_drainBatch = DRAIN_DEFAULT_BATCH;
+	if (_drainInterval <= 0)
+		_drainInterval = DRAIN_DEFAULT_INTERVAL;
+	long poolBytes = config.getInt("buffer_pool", BUFFER_POOL_DEFAULT_BYTES);
+	Client::bufferPool().setLimit(poolBytes < 0 ? 0 : poolBytes); // 0: idle buffers are just freed
+	const char* upgradeFd = getenv(UPGRADE_ENV);
+	if (upgradeFd) // started by a running server: take over its sockets and state
+	{
+		unsetenv(UPGRADE_ENV);
+		_resumeFromUpgrade(atoi(upgradeFd));
+		_initSocket(); // takes the inherited listeners the configuration still has
+	}
+	else
+	{
+		_initSocket();
+		_restoreSnapshot();
+	}
+	if (_config.has("password_hash"))
+	{
+		if (!PasswordHash::parse(_config.get("password_hash"), _passwordHash))
+			throw std::runtime_error("Error: Invalid password_hash in " + _config.getPath());
+	}
+	else
+		_passwordHash = PasswordHash::fromPassword(_password, _config.getInt("password_iterations", PASSWORD_DEFAULT_ITERATIONS));
+	if (_config.has("account_db"))
+	{
+		if (!_accounts.open(_config.get("account_db")))
+			throw std::runtime_error("Error: Cannot load account_db " + _config.get("account_db"));
+		std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << _accounts.size() << " accounts loaded" << std::endl;
+	}
 	_commandHandler = new CommandHandler(this);
+	std::vector<std::string> links = _config.getAll("link_connect");
+	for (size_t i = 0; i < links.size(); ++i)
+		_linkConnects[links[i]] = -1;
+	if (_upgradeSock != -1) // last: until now the old process may still keep its clients
+		_acknowledgeUpgrade();
 	std::cout << "Server object constructed successfully" << std::endl;
 }
 
@@ -37,80 +133,104 @@ Server::~Server()
 	std::cout << "Server destructor called..." << std::endl;
 	shutdown();
 	
+	delete _threadPool; // joins the threads, unfinished tasks are dropped
+	_threadPool = NULL;
+	
 	delete _commandHandler;
 	_commandHandler = NULL;
 	
+	_closeDisconnected();
 	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
 	{
-		close(it->first); // close the client socket (fd)
+		_transport->close(it->first); // close the client socket (fd)
 		delete it->second;
 	}
 	_clients.clear();
+	_links.clear();
 	
-	for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
-		delete it->second;
+	for (std::set<Client*>::iterator it = _remoteClients.begin(); it != _remoteClients.end(); ++it)
+		delete *it;
+	_remoteClients.clear();
+	
+	for (std::set<Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+		delete *it;
 	_channels.clear();
 	
-	if (_serverSocket != -1)
-	{
-		close(_serverSocket);
-		std::cout << "Server socket closed" << std::endl;
-	}
+	_closeListeners(!_handedOff && _workerId == 0);
+	std::cout << "Listening sockets closed" << std::endl;
+	for (std::map<std::string, ConnectionClass*>::iterator it = _classes.begin(); it != _classes.end(); ++it)
+		delete it->second;
+	_classes.clear();
+	if (_tlsContext)
+		SSL_CTX_free(_tlsContext);
+	if (_meshNotifyFd != -1)
+		close(_meshNotifyFd);
+	Mesh::destroy(_mesh, _workerCount);
 		std::cout << "Server object destroyed" << std::endl;
 }
 
-// server socket init
+// listening sockets: the port given on the command line, "tls_port" and every "listen" line
+// ("listen = <address> [tls] [class=<name>]", see Listener.hpp)
 void Server::_initSocket()
 {
-	std::cout << "Initializing server socket..." << std::endl;
-	
-	_serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-	if (_serverSocket == -1)
-		throw std::runtime_error(std::string("socket() failed: ") + strerror(errno));
-	std::cout << "   Socket created (fd: " << _serverSocket << ") " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
+	std::cout << "Initializing listening sockets..." << std::endl;
 
-	int opt = 1; // option we want to activate
-	// config an option on the socket: here we set SO_REUSEADDR to reuse the port immediately after program exit
-	if (setsockopt(_serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+	std::vector<std::string> lines;
+	std::stringstream port;
+	port << _port;
+	lines.push_back(port.str());
+	if (_config.has("tls_port"))
 	{
-		close(_serverSocket);
-		throw std::runtime_error(std::string("setsockopt() failed: ") + strerror(errno));
+		int tlsPort = _config.getInt("tls_port", 0);
+		if (tlsPort <= 0 || tlsPort > 65535 || tlsPort == _port)
+			throw std::runtime_error("Error: Invalid tls_port in " + _config.getPath());
+		lines.push_back(_config.get("tls_port") + " tls");
 	}
-	std::cout << "   Socket option set (SO_REUSEADDR) " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
-	struct sockaddr_in serverAddr; // server adress struct
-	std::memset(&serverAddr, 0, sizeof(serverAddr));
-	serverAddr.sin_family = AF_INET; // IPv4
-	serverAddr.sin_addr.s_addr = INADDR_ANY; // bind to all interfaces
-	serverAddr.sin_port = htons(_port); // set port (network byte order)
+	std::vector<std::string> listens = _config.getAll("listen");
+	lines.insert(lines.end(), listens.begin(), listens.end());
 
-	if (bind(_serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1)
+	std::vector<Listener> listeners;
+	bool needTls = false;
+	for (size_t i = 0; i < lines.size(); ++i)
 	{
-		close(_serverSocket);
-		throw std::runtime_error(std::string("bind() failed: ") + strerror(errno));
+		std::istringstream words(lines[i]);
+		std::string word;
+		Listener listener;
+		words >> listener.address;
+		if (listener.address.empty())
+			throw std::runtime_error("Error: empty listen line in " + _config.getPath());
+		listener.tls = false;
+		listener.inject = false;
+		listener.connectionClass = _getClass(DEFAULT_CONNECTION_CLASS);
+		while (words >> word)
+		{
+			if (word == "tls")
+				listener.tls = true;
+			else if (word == "inject")
+				listener.inject = true;
+			else if (word.compare(0, 6, "class=") == 0)
+				listener.connectionClass = _getClass(word.substr(6));
+			else
+				throw std::runtime_error("Error: unknown listen option '" + word + "' in " + _config.getPath());
+		}
+		needTls = needTls || listener.tls;
+		listeners.push_back(listener);
 	}
-	std::cout << "   Socket bound to 0.0.0.0:" << _port << " " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
-	if (listen(_serverSocket, SOMAXCONN) < 0)
+	if (needTls)
+		_initTls();
+	for (size_t i = 0; i < listeners.size(); ++i)
+		_openListener(listeners[i]);
+
+	// listeners inherited from a binary upgrade that the new configuration dropped
+	for (std::map<std::string, int>::iterator it = _inheritedListeners.begin(); it != _inheritedListeners.end(); ++it)
 	{
-		close(_serverSocket);
-		throw std::runtime_error(std::string("listen() failed: ") + strerror(errno));
+		std::cout << "   Closing inherited listener " << it->first << std::endl;
+		close(it->second);
 	}
-	std::cout << "   Socket listening (backlog: SOMAXCONN) " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
-	_setNonBlocking(_serverSocket);
-	std::cout << "   Socket set to non-blocking mode " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
-	struct pollfd serverPollFd; // checking server socket (fd) for events
-	serverPollFd.fd = _serverSocket; // server socket fd
-	serverPollFd.events = POLLIN; // we want to read incoming connections
-	serverPollFd.revents = 0; // no events yet
-	_pollFds.push_back(serverPollFd); // add to poll fds list
-	std::cout << "   Server socket added to poll set " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+	_inheritedListeners.clear();
 	std::cout << std::endl;
 
-	std::cout << "Server socket initialization complete" << std::endl;
+	std::cout << "Listening socket initialization complete" << std::endl;
 }
 
 // set a socket to non-blocking mode => imporant to handle multiple clients
@@ -123,6 +243,58 @@ void Server::_setNonBlocking(int fd)
 		throw std::runtime_error(std::string("fcntl(F_SETFL) failed: ") + strerror(errno));
 }
 
+// socket options set once on a listener: accepted sockets inherit them, so accept() needs no setsockopt()
+// defer_accept (s), socket_sndbuf / socket_rcvbuf (bytes, 0 keeps the kernel's autotuning),
+// socket_notsent_lowat (bytes, 0: no cap; a small one lets a PONG overtake the bulk still in the lanes),
+// keepalive_idle / keepalive_interval (s) / keepalive_count, busy_poll (us, needs CAP_NET_ADMIN above the sysctl)
+void Server::_tuneListener(int fd)
+{
+	struct Option
+	{
+		int			level;
+		int			name;
+		const char*	key;
+		long		value;
+	};
+	long keepaliveIdle = _config.getInt("keepalive_idle", 0);
+	Option options[] = {
+		{ IPPROTO_TCP, TCP_DEFER_ACCEPT, "defer_accept", _config.getInt("defer_accept", LISTEN_DEFAULT_DEFER_ACCEPT) },
+		{ SOL_SOCKET, SO_SNDBUF, "socket_sndbuf", _config.getInt("socket_sndbuf", 0) },
+		{ SOL_SOCKET, SO_RCVBUF, "socket_rcvbuf", _config.getInt("socket_rcvbuf", 0) },
+		{ IPPROTO_TCP, TCP_NOTSENT_LOWAT, "socket_notsent_lowat", _config.getInt("socket_notsent_lowat", LISTEN_DEFAULT_NOTSENT_LOWAT) },
+		{ SOL_SOCKET, SO_KEEPALIVE, "keepalive_idle", keepaliveIdle > 0 ? 1 : 0 },
+		{ IPPROTO_TCP, TCP_KEEPIDLE, "keepalive_idle", keepaliveIdle },
+		{ IPPROTO_TCP, TCP_KEEPINTVL, "keepalive_interval", keepaliveIdle > 0 ? _config.getInt("keepalive_interval", 30) : 0 },
+		{ IPPROTO_TCP, TCP_KEEPCNT, "keepalive_count", keepaliveIdle > 0 ? _config.getInt("keepalive_count", 4) : 0 },
+		{ SOL_SOCKET, SO_BUSY_POLL, "busy_poll", _config.getInt("busy_poll", 0) }
+	};
+	for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+	{
+		if (options[i].value <= 0) // not configured
+			continue;
+		int value = options[i].value;
+		if (setsockopt(fd, options[i].level, options[i].name, &value, sizeof(value)) == -1)
+			std::cerr << "Warning: cannot apply " << options[i].key << " = " << value << ": " << strerror(errno) << std::endl;
+	}
+}
+
+void Server::setExecutablePath(const std::string& path)
+{
+	_executablePath = path;
+}
+
+// called from the SIGUSR2 handler: the upgrade itself runs from the event loop
+void Server::requestUpgrade()
+{
+	_upgradeRequested = true;
+}
+
+// called from the SIGUSR1 handler: the stats are printed from the event loop
+void Server::requestStats()
+{
+	_statsRequested = true;
+}
+
 int Server::getPort() const
 {
 	return (_port);
@@ -138,14 +310,63 @@ const std::string& Server::getServerName() const
 	return (_serverName);
 }
 
+const PasswordHash& Server::getPasswordHash() const
+{
+	return (_passwordHash);
+}
+
+const AccountStore& Server::getAccountStore() const
+{
+	return (_accounts);
+}
+
+ThreadPool* Server::getThreadPool()
+{
+	return (_threadPool);
+}
+
+const Config& Server::getConfig() const
+{
+	return (_config);
+}
+
 void Server::run()
 {
 	std::cout << PASTEL_VIOLET << "Starting server event loop..." << DEFAULT << std::endl;
 	std::cout << std::endl;
 	_isrunning = true;
+	_startWorkers();
+	_threadPool = new ThreadPool(_config.getInt("threads", THREADPOOL_DEFAULT_THREADS)); // after fork(): threads are not inherited
+	_addPollFd(_threadPool->getNotifyFd(), POLLIN);
+	if (_config.has("capture_file"))
+	{
+		std::stringstream path;
+		path << _config.get("capture_file");
+		if (_workerCount > 1)
+			path << "." << _workerId;
+		if (_capture.open(path.str()))
+			std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Capturing inbound traffic to " << path.str() << std::endl;
+	}
 	while (_isrunning)
 	{
-		int pollCount = poll(&_pollFds[0], _pollFds.size(), -1);
+		if (_upgradeRequested) // checked before poll() so the EINTR from SIGUSR2 is not lost
+		{
+			_upgradeRequested = false;
+			if (_workerCount > 1)
+				std::cerr << "[UPGRADE] Binary upgrade is not supported with several workers" << std::endl;
+			else if (_draining)
+				std::cerr << "[UPGRADE] Ignored: the server is shutting down" << std::endl;
+			else
+				_performUpgrade();
+			if (_handedOff)
+				break;
+		}
+		if (_drainRequested && !_draining)
+			_beginDrain();
+		// wake up every second for periodic tasks (every drain step while draining),
+		// or right away when clients wait with commands left
+		int timeout = !_readyClients.empty() ? 0 : _draining ? (int)_drainInterval : 1000;
+		int pollCount = poll(&_pollFds[0], _pollFds.size(), timeout);
 		if (pollCount == -1)
 		{
 			if (errno == EINTR)
@@ -153,57 +374,274 @@ void Server::run()
 			std::cerr << "poll() error: " << strerror(errno) << std::endl;
 			break;
 		}
+		struct timeval iterationStart = { 0, 0 };
+		if (_loopStatsInterval > 0)
+			gettimeofday(&iterationStart, NULL);
+		_runPeriodicTasks();
+		_acceptsLeft = _acceptBudget; // the listeners share it: the rest of a flood waits in the backlog
 		// for each fd, check for events
 		for (size_t i = 0; i < _pollFds.size(); ++i)
 		{
 			if (_pollFds[i].revents == 0)
 				continue;
-			if (_pollFds[i].fd == _serverSocket) // if it is the server socket
+			Listener* listener = _findListener(_pollFds[i].fd);
+			if (listener) // if it is a listening socket
 			{
 				if (_pollFds[i].revents & POLLIN) // if a client is trying to connect
-					_acceptNewConnection();
+					_acceptNewConnection(*listener);
+			}
+			else if (_pollFds[i].fd == _meshNotifyFd) // another worker pushed lines into our rings
+			{
+				if (_pollFds[i].revents & POLLIN)
+					_drainMesh();
+			}
+			else if (_pollFds[i].fd == _threadPool->getNotifyFd()) // tasks finished on the thread pool
+			{
+				if (_pollFds[i].revents & POLLIN)
+					_threadPool->runCompletions();
 			}
 			else // if it is a client socket
 			{
 				int clientFd = _pollFds[i].fd;
+				Client* client = getClient(clientFd);
+				if (!client) // disconnected earlier in this iteration: its entry goes in _closeDisconnected()
+					continue;
 				
 				if (_pollFds[i].revents & POLLHUP) // if a client disconnect
 				{
 					std::cout << "Client " << clientFd << " hung up (POLLHUP)" << std::endl;
 					_disconnectClient(clientFd);
-					break;
+					continue;
 				}
 				if (_pollFds[i].revents & POLLERR) // if a client socket error occurred
 				{
 					std::cerr << "Socket error on client " << clientFd << " (POLLERR)" << std::endl;
 					_disconnectClient(clientFd);
-					break;
+					continue;
 				}
 				if (_pollFds[i].revents & POLLNVAL) // if an invalid fd
 				{
 					std::cerr << "Invalid fd " << clientFd << " (POLLNVAL)" << std::endl;
 					_disconnectClient(clientFd);
-					break;
+					continue;
+				}
+				
+				if (client->isTlsHandshaking()) // OpenSSL decides whether the handshake waits to read or to write
+				{
+					_continueTlsHandshake(client);
+					continue;
 				}
 				
 				if (_pollFds[i].revents & POLLIN) // if there is data to read from client
 					_readClientData(clientFd);
 				
-				if (_pollFds[i].revents & POLLOUT) // if ready to send data to client
+				if ((_pollFds[i].revents & POLLOUT) && client->getState() == CLIENT_OPEN) // if ready to send data to client
 					_sendPendingData(clientFd);
 			}
 		}
+		_runReadyClients();
+		_closeDisconnected();
+		if (_loopStatsInterval > 0)
+			_recordLoopIteration(iterationStart);
 	}
 	std::cout << "Server event loop stopped" << std::endl;
+
+	// final snapshot: the loop is stopped, so write it in-process
+	_reapSnapshot(true);
+	_stopWorkers();
+	if (_handedOff || _workerId != 0) // the new process owns the state now, or worker 0 does
+		return;
+	if (Snapshot::save(SNAPSHOT_FILE, _channels))
+		std::cout << "Snapshot of " << _channels.size() << " channels written to " << SNAPSHOT_FILE << std::endl;
 }
 
+// load channel state (topics, modes, keys, limits, invites) saved by a previous run
+void Server::_restoreSnapshot()
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	std::vector<Channel*> channels;
+	long restored = Snapshot::load(SNAPSHOT_FILE, channels);
+	if (restored < 0)
+	{
+		std::cerr << "   Snapshot " << SNAPSHOT_FILE << " is unreadable, starting without channels" << std::endl;
+		return;
+	}
+	time_t now = time(NULL);
+	restored = 0;
+	for (size_t i = 0; i < channels.size(); ++i)
+	{
+		if (!_addChannel(channels[i])) // a casemapped duplicate, written by a build that did not fold names
+		{
+			delete channels[i];
+			continue;
+		}
+		_restoredChannels[channels[i]->getName()] = now;
+		++restored;
+	}
+	gettimeofday(&end, NULL);
+	if (restored == 0)
+		return;
+	long elapsedUs = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+	std::cout << "   Restored " << restored << " channels from " << SNAPSHOT_FILE << " in "
+	          << elapsedUs / 1000 << "." << (elapsedUs % 1000) / 100 << " ms " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// write a snapshot from a forked child: the copy-on-write image keeps the event loop running
+void Server::_startSnapshot()
+{
+	if (_snapshotPid > 0)
+		return;
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		std::cerr << "Snapshot: fork() failed: " << strerror(errno) << std::endl;
+		return;
+	}
+	if (pid == 0)
+		_exit(Snapshot::save(SNAPSHOT_FILE, _channels) ? 0 : 1);
+	_snapshotPid = pid;
+}
+
+// collect the snapshot child, optionally waiting for it
+void Server::_reapSnapshot(bool wait)
+{
+	if (_snapshotPid <= 0)
+		return;
+	int status;
+	pid_t pid = waitpid(_snapshotPid, &status, wait ? 0 : WNOHANG);
+	if (pid == 0)
+		return;
+	if (pid == _snapshotPid && WIFEXITED(status) && WEXITSTATUS(status) != 0)
+		std::cerr << "Snapshot: child failed to write " << SNAPSHOT_FILE << std::endl;
+	_snapshotPid = -1;
+}
+
+// once per snapshot interval: an empty channel is only kept while it is a restored one awaiting its members,
+// any other (a leave path that missed partChannel) goes now
+void Server::_sweepChannels(time_t now)
+{
+	std::vector<std::string> expired;
+	_emptyChannels = 0;
+	for (std::set<Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+	{
+		if (!(*it)->getMembers().empty())
+			continue;
+		std::map<std::string, time_t>::iterator restored = _restoredChannels.find((*it)->getName());
+		if (restored != _restoredChannels.end() && now - restored->second < SNAPSHOT_RESTORE_GRACE)
+			++_emptyChannels;
+		else
+			expired.push_back((*it)->getName());
+	}
+	for (size_t i = 0; i < expired.size(); ++i)
+		removeChannel(expired[i]);
+
+	// a restored channel that got its members back (or is gone) is an ordinary one from now on, once the
+	// operators it recorded have rejoined or the grace is over
+	std::map<std::string, time_t>::iterator it = _restoredChannels.begin();
+	while (it != _restoredChannels.end())
+	{
+		Channel* channel = getChannel(it->first);
+		if (channel && now - it->second < SNAPSHOT_RESTORE_GRACE
+			&& (channel->getMembers().empty() || !channel->getFormerOperators().empty()))
+			++it;
+		else
+		{
+			if (channel)
+				channel->clearFormerOperators();
+			_restoredChannels.erase(it++);
+		}
+	}
+	if (!_channels.empty() || !expired.empty())
+		std::cout << PASTEL_YELLOW << "[CHANNELS] " << DEFAULT << _channels.size() - _emptyChannels << " live, "
+		          << _emptyChannels << " empty awaiting a rejoin, " << expired.size() << " empty removed" << std::endl;
+}
+
+// timers driven by the poll() timeout
+void Server::_runPeriodicTasks()
+{
+	time_t now = time(NULL);
+	_reapSnapshot(false);
+	_reapWorkers(false);
+	if (_draining)
+		_continueDrain();
+	else if (!_linkConnects.empty() && now - _lastLinkAttempt >= LINK_RETRY_INTERVAL)
+	{
+		_lastLinkAttempt = now;
+		_connectLinks();
+	}
+	if (now != _lastLimiterSweep)
+	{
+		_lastLimiterSweep = now;
+		for (std::map<std::string, ConnectionClass*>::iterator it = _classes.begin(); it != _classes.end(); ++it)
+			it->second->limiter.sweep(now);
+		if (_rejectedTooMany || _rejectedThrottled || _rejectedClassFull) // one line per second instead of one per rejected socket
+			std::cout << PASTEL_YELLOW << "[LIMIT] " << DEFAULT << "Rejected " << _rejectedTooMany
+			          << " connections over the per-host limit, " << _rejectedThrottled
+			          << " over the per-host rate and " << _rejectedClassFull << " over a class limit" << std::endl;
+		_rejectedTooMany = 0;
+		_rejectedThrottled = 0;
+		_rejectedClassFull = 0;
+		_capture.flush();
+		_dropSendqExceeded();
+	}
+	if (now - _lastBufferReclaim >= BUFFER_RECLAIM_INTERVAL)
+	{
+		_lastBufferReclaim = now;
+		_reclaimIdleBuffers(now);
+	}
+	if (_statsRequested)
+	{
+		_statsRequested = false;
+		displayStats();
+	}
+	if (_loopStatsInterval > 0 && now - _lastLoopStats >= _loopStatsInterval)
+	{
+		_lastLoopStats = now;
+		std::cout << PASTEL_YELLOW << "[LOOP] " << DEFAULT << _loopIterations << " iterations, "
+		          << (_loopIterations ? _loopBusy / _loopIterations * 1e6 : 0) << " us average, "
+		          << _loopMax * 1e6 << " us max, " << _clients.size() << " clients, " << _pollFds.size() << " poll fds" << std::endl;
+		_loopIterations = 0;
+		_loopBusy = 0;
+		_loopMax = 0;
+	}
+	if (now - _lastSnapshot >= SNAPSHOT_INTERVAL)
+	{
+		_lastSnapshot = now;
+		if (!_draining) // the channels of the drained clients stay for the final snapshot
+			_sweepChannels(now);
+		if (_workerId == 0)
+			_startSnapshot();
+	}
+}
+
+// time from poll() returning to the next poll() call
+void Server::_recordLoopIteration(const struct timeval& start)
+{
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	++_loopIterations;
+	_loopBusy += elapsed;
+	if (elapsed > _loopMax)
+		_loopMax = elapsed;
+}
+
+// called from the SIGINT/SIGTERM handler: the first call starts a drain (run from the event loop),
+// a second one stops at once; a worker only drains, the master signals it once
 void Server::shutdown()
 {
-	if (_isrunning)
+	if (!_isrunning)
+		return;
+	if (_drainTimeout > 0 && (!_drainRequested || _workerId != 0))
 	{
-		std::cout << "Stopping server..." << std::endl;
-		_isrunning = false;
+		if (!_drainRequested)
+			std::cout << "Draining clients before stopping (again to stop now)..." << std::endl;
+		_drainRequested = true;
+		return;
 	}
+	std::cout << "Stopping server..." << std::endl;
+	_isrunning = false;
 }
 
 void Server::displayStats() const
@@ -211,9 +649,37 @@ void Server::displayStats() const
     std::cout << "\n=== Server Statistics ===" << std::endl;
     std::cout << "  Server running   : " << (_isrunning ? "Yes" : "No") << std::endl;
     std::cout << "  Clients connected: " << _clients.size() << std::endl;
-    std::cout << "  Channels active  : " << _channels.size() << std::endl;
+    std::cout << "  Server links     : " << _links.size() << " (" << _remoteClients.size() << " remote clients)" << std::endl;
+    std::cout << "  Worker           : " << _workerId << "/" << _workerCount << std::endl;
+    std::cout << "  Listeners        : " << _listeners.size() << std::endl;
+    for (std::map<std::string, ConnectionClass*>::const_iterator it = _classes.begin(); it != _classes.end(); ++it)
+        std::cout << "  Class " << it->first << " : " << it->second->clients << " clients, "
+                  << it->second->limiter.size() << " hosts tracked" << std::endl;
+    std::cout << "  Ready queue      : " << _readyClients.size() << " clients with commands left" << std::endl;
+    std::cout << "  Channels active  : " << _channels.size() << " (" << _emptyChannels << " empty at the last sweep), "
+              << _channelsCreated << " created, " << _channelsRemoved << " removed" << std::endl;
+    std::cout << "  History stored   : " << _historyEntries << " messages, " << _historyBytes << " bytes" << std::endl;
     std::cout << "  Poll fds         : " << _pollFds.size()
-              << " (1 server + " << (_pollFds.size() > 0 ? _pollFds.size() - 1 : 0) << " clients)" << std::endl;
+              << " (" << _listeners.size() << " listeners + " << _pollFds.size() - _listeners.size() << " others)" << std::endl;
+    size_t clientBytes = 0;
+    size_t largestBytes = 0;
+    int largestFd = -1;
+    for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        size_t bytes = it->second->getMemoryUsage();
+        clientBytes += bytes;
+        if (bytes > largestBytes)
+        {
+            largestBytes = bytes;
+            largestFd = it->first;
+        }
+    }
+    std::cout << "  Client memory    : " << clientBytes << " bytes (" << (_clients.empty() ? 0 : clientBytes / _clients.size())
+              << " per client, largest " << largestBytes << " on fd " << largestFd << ")" << std::endl;
+    const BufferPool& pool = Client::bufferPool();
+    std::cout << "  Buffer pool      : " << pool.spareBuffers() << " spare buffers, " << pool.spareBytes() << " bytes, "
+              << pool.given() << " given back, " << pool.taken() << " reused, " << pool.freed() << " freed; "
+              << _bytesReclaimed << " bytes reclaimed from idle clients" << std::endl;
 }
 
 Client* Server::getClient(int fd)
@@ -224,34 +690,74 @@ Client* Server::getClient(int fd)
 	return (NULL);
 }
 
+Client* Server::getClient(const ClientHandle& handle)
+{
+	Client* client = getClient(handle.fd);
+	if (!client || client->getSerial() != handle.serial)
+		return (NULL);
+	return (client);
+}
+
 
+// local or remote, in any case ("Bob" finds bob)
 Client* Server::getClientByNick(const std::string& nickname)
 {
-	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
-	{
-		if (it->second && it->second->getNickname() == nickname)
-			return (it->second);
-	}
-	return (NULL);
+	Name* name = _names.find(nickname);
+	return (name ? name->client : NULL);
+}
+
+// the nick a client is known by from now on: the old one is released, the new one leads to the client
+void Server::setNick(Client* client, const std::string& nickname)
+{
+	_releaseNick(client);
+	client->setNickname(nickname);
+	if (!nickname.empty())
+		_names.intern(nickname)->client = client;
+}
+
+void Server::_releaseNick(Client* client)
+{
+	if (client->getNickname().empty())
+		return;
+	Name* name = _names.find(client->getNickname());
+	if (!name || name->client != client)
+		return;
+	name->client = NULL;
+	_names.release(name);
 }
 
+// the client leaves the server's maps now (the caller already took it out of its channels), its object
+// and socket stay until _closeDisconnected(): pointers held by the code running now remain valid
 void Server::removeClient(int fd)
 {
 	std::map<int, Client*>::iterator it = _clients.find(fd);
-	if (it != _clients.end())
-	{
-		close(it->first);
-		delete it->second;
-		_clients.erase(it);
-	} 
+	if (it == _clients.end())
+		return;
+	_releaseNick(it->second);
+	it->second->setState(CLIENT_CLOSING);
+	_closing.push_back(it->second);
+	_clients.erase(it);
 }
 
+// in any case: "#Foo" finds #foo
 Channel* Server::getChannel(const std::string& name)
 {
-	std::map<std::string, Channel*>::iterator it = _channels.find(name);
-	if (it != _channels.end())
-		return (it->second);
-	return (NULL);
+	Name* interned = _names.find(name);
+	return (interned ? interned->channel : NULL);
+}
+
+// a channel object enters the server under its name, false if another channel has that name already
+bool Server::_addChannel(Channel* channel)
+{
+	Name* name = _names.intern(channel->getName());
+	if (name->channel)
+	{
+		_names.release(name);
+		return (false);
+	}
+	name->channel = channel;
+	_channels.insert(channel);
+	return (true);
 }
 
 Channel* Server::createChannel(const std::string& name)
@@ -264,7 +770,8 @@ Channel* Server::createChannel(const std::string& name)
 	}
 
 	Channel* newChannel = new Channel(name);
-	_channels[name] = newChannel;
+	_addChannel(newChannel);
+	++_channelsCreated;
 	std::cout << "Channel [" << name << "] created (" 
 	          << _channels.size() << " channels active)" << std::endl;
 	return (newChannel);
@@ -273,11 +780,17 @@ Channel* Server::createChannel(const std::string& name)
 
 void Server::removeChannel(const std::string& name)
 {
-	std::map<std::string, Channel*>::iterator it = _channels.find(name);
-	if (it != _channels.end())
+	Name* interned = _names.find(name);
+	if (interned && interned->channel)
 	{
-		delete it->second;
-		_channels.erase(it);
+		Channel* channel = interned->channel;
+		_historyBytes -= channel->getHistoryBytes();
+		_historyEntries -= channel->getHistory().size();
+		_channels.erase(channel);
+		interned->channel = NULL;
+		_names.release(interned);
+		delete channel;
+		++_channelsRemoved;
 		std::cout << "Channel [" << name << "] removed (" 
 		          << _channels.size() << " channels remaining)" << std::endl;
 	}
@@ -285,8 +798,82 @@ void Server::removeChannel(const std::string& name)
 		std::cout << "Channel [" << name << "] not found" << std::endl;
 }
 
-// send a message to all clients in a channel, excluding a specific fd if provided
-void Server::broadcastToChannel(const std::string& channelName, const std::string& message, int excludeFd)
+// every way out of a channel (PART, KICK, QUIT, disconnect, remote quit) ends here: the channel goes with its
+// last member, except while draining (the final snapshot keeps it for the restart)
+void Server::partChannel(Channel* channel, Client* client)
+{
+	std::string name = channel->getName();
+	channel->removeUser(client);
+	channel->removeOperator(client);
+	client->leaveChannel(channel);
+	if (channel->getMembers().empty() && !_draining)
+		removeChannel(name);
+}
+
+// store a channel message in the channel's history ring, evicting globally oldest messages over budget
+void Server::recordHistory(const std::string& channelName, const std::string& message)
+{
+	Channel* channel = getChannel(channelName);
+	if (!channel)
+		return;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	HistoryEntry entry;
+	entry.msgid = _nextMsgId++;
+	entry.time = (long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+	size_t start = (!message.empty() && message[0] == ':') ? 1 : 0;
+	size_t end = message.find_last_not_of("\r\n");
+	entry.line = (end == std::string::npos) ? "" : message.substr(start, end + 1 - start);
+
+	size_t before = channel->getHistory().size();
+	size_t evicted = channel->addHistory(entry);
+	_historyBytes += Channel::historyEntrySize(entry);
+	_historyBytes -= evicted;
+	_historyEntries += 1 + before - channel->getHistory().size();
+	_historyOrder.push_back(std::make_pair(channelName, entry.msgid));
+
+	while (_historyBytes > HISTORY_GLOBAL_BYTES && _evictOldestHistory())
+		;
+	if (_historyOrder.size() > 2 * _historyEntries + 1024)
+		_compactHistoryOrder();
+}
+
+// drop the oldest stored message across all channels; false when nothing is left
+bool Server::_evictOldestHistory()
+{
+	while (!_historyOrder.empty())
+	{
+		std::pair<std::string, unsigned long> oldest = _historyOrder.front();
+		_historyOrder.pop_front();
+		Channel* channel = getChannel(oldest.first);
+		// skip entries already evicted by the channel's own limits or by channel removal
+		if (!channel || channel->getHistory().empty() || channel->getHistory().front().msgid != oldest.second)
+			continue;
+		_historyBytes -= channel->evictOldestHistory();
+		--_historyEntries;
+		return (true);
+	}
+	return (false);
+}
+
+// drop stale eviction-order entries so the order queue stays proportional to stored history
+void Server::_compactHistoryOrder()
+{
+	std::deque<std::pair<std::string, unsigned long> > live;
+	for (std::deque<std::pair<std::string, unsigned long> >::iterator it = _historyOrder.begin(); it != _historyOrder.end(); ++it)
+	{
+		Channel* channel = getChannel(it->first);
+		if (channel && !channel->getHistory().empty() && channel->getHistory().front().msgid <= it->second)
+			live.push_back(*it);
+	}
+	_historyOrder.swap(live);
+}
+
+// send a message to all local clients in a channel (or only its operators), excluding a specific fd if provided,
+// and once to every server link (except the one excludeFd designates) instead of once per remote member
+void Server::broadcastToChannel(const std::string& channelName, const std::string& message, int excludeFd, bool operatorsOnly, bool toLinks,
+	OutputLane lane)
 {
 	Channel* channel = getChannel(channelName); // get the channel object
 	if (!channel)
@@ -295,18 +882,40 @@ void Server::broadcastToChannel(const std::string& channelName, const std::strin
 		return;
 	}
 	
-	std::set<Client*> members = channel->getMembers();
-	std::cout << "   Broadcasting to channel [" << channelName << "] with " 
-			<< members.size() << " members" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
-	
-	for (std::set<Client*>::iterator it = members.begin(); it != members.end(); ++it)
+	if (operatorsOnly)
 	{
-		if (*it && (*it)->getClientFd() != excludeFd) // if client fd is different from excluded
+		const std::set<Client*>& operators = channel->getOperators();
+		std::cout << "   Broadcasting to the operators of channel [" << channelName << "] ("
+				<< operators.size() << ")" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
+		for (std::set<Client*>::iterator it = operators.begin(); it != operators.end(); ++it)
 		{
-			(*it)->sendMessage(message); // add the message to the client's send buffer
-			_setPollOut((*it)->getClientFd()); // check socket is ready to send data
+			if (*it && !(*it)->isRemote() && (*it)->getClientFd() != excludeFd) // if client fd is different from excluded
+			{
+				(*it)->sendMessage(message, lane); // add the message to the client's send buffer
+				_setPollOut((*it)->getClientFd()); // check socket is ready to send data
+			}
 		}
 	}
+	else
+	{
+		// the member slots are contiguous and the hot records hold what the filter needs: the Client
+		// object is only touched to queue the line
+		const std::vector<unsigned>& slots = channel->getMemberSlots();
+		std::cout << "   Broadcasting to channel [" << channelName << "] with " 
+				<< slots.size() << " members" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			const ClientHot& member = Client::hot(slots[i]);
+			if (!member.client || (member.flags & CLIENT_HOT_REMOTE) || member.fd == excludeFd)
+				continue;
+			member.client->sendMessage(message, lane);
+			_setPollOut(member.fd);
+		}
+	}
+	if (toLinks)
+		propagateToLinks(message, excludeFd);
+	if (!_subscribers.empty())
+		_notifySubscribers(channel, message);
 	// prepare a preview without trailing CR/LF to avoid extra blank lines in logs
 	std::string preview = message;
 	while (!preview.empty())
@@ -321,68 +930,190 @@ void Server::broadcastToChannel(const std::string& channelName, const std::strin
 			  << preview.substr(0, 50) << (preview.length() > 50 ? "..." : "") << std::endl; // truncate the message if too long
 }
 
+// broadcast a JOIN/PART/QUIT/NICK: in auditorium channels (+u) only operators and the subject see it
+void Server::broadcastMembership(const std::string& channelName, const std::string& message, Client* subject, int excludeFd, bool toLinks)
+{
+	Channel* channel = getChannel(channelName);
+	if (!channel || !channel->getMode('u'))
+	{
+		broadcastToChannel(channelName, message, excludeFd, false, toLinks);
+		return;
+	}
+	broadcastToChannel(channelName, message, excludeFd, true, toLinks);
+	if (subject && !subject->isRemote() && !channel->isOperator(subject) && subject->getClientFd() != excludeFd)
+	{
+		subject->sendMessage(message);
+		_setPollOut(subject->getClientFd());
+	}
+}
+
 // handle new incoming connectionsvalgrind ./ircserv 6667 <motdepasse>
-void Server::_acceptNewConnection()
+void Server::_acceptNewConnection(Listener& listener)
 {
-	struct sockaddr_in clientAddr; // IP + port of the connecting client
-	socklen_t clientAddrLen = sizeof(clientAddr); // size of the struct
-	while (true)
+	ConnectionClass* connectionClass = listener.connectionClass;
+	struct sockaddr_storage clientAddr; // IP + port of the connecting client (IPv4 or IPv6)
+	double now = 0;
+	while (_acceptsLeft > 0)
 	{
-		int clientFd = accept(_serverSocket, (struct sockaddr*)&clientAddr, &clientAddrLen); // to get a new fd for the socket client
+		socklen_t clientAddrLen = sizeof(clientAddr); // size of the struct
+		int clientFd = _transport->accept(listener.fd, (struct sockaddr*)&clientAddr, &clientAddrLen);
 		if (clientFd == -1)
 		{
 			if (errno == EWOULDBLOCK || errno == EAGAIN) // no more connections to accept
 				break;
-			if (errno == EINTR) // interrupted, try again
+			if (errno == EINTR || errno == ECONNABORTED) // interrupted, or gone before we got to it: try the next one
 				continue;
 			std::cerr << "accept() error: " << strerror(errno) << std::endl;
 			break;
 		}
+		--_acceptsLeft;
 
-		// extract client IP and port + convert to string
-		char clientIP[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
-		int clientPort = ntohs(clientAddr.sin_port);
-		
-		std::cout << PASTEL_YELLOW << "[CONNECTION] " << DEFAULT << "New connection from [" << clientIP << "]:" << clientPort 
-		          << " (fd: " << clientFd << ")" << std::endl;
-		// set the client socket to non-blocking mode
-		try
+		// per-host checks come first, so a flood costs no Client, no string and no log line
+		if (now == 0)
 		{
-			_setNonBlocking(clientFd);
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			now = tv.tv_sec + tv.tv_usec / 1e6;
 		}
-		catch (const std::exception& e)
+		HostKey hostKey = ConnectionLimiter::keyOf((struct sockaddr*)&clientAddr); // unset for unix domain sockets
+		ConnectionLimiter::Verdict verdict = ConnectionLimiter::ADMIT;
+		if (connectionClass->maxClients && connectionClass->clients >= connectionClass->maxClients)
+			verdict = ConnectionLimiter::CLASS_FULL;
+		else if (hostKey.isSet())
+			verdict = connectionClass->limiter.admit(hostKey, now);
+		if (verdict != ConnectionLimiter::ADMIT)
 		{
-			std::cerr << "Failed to set client socket non-blocking: " << e.what() << std::endl;
-			close(clientFd);
+			_rejectConnection(clientFd, verdict);
 			continue;
 		}
-		
+
 		// create a new Client object and add it to the clients map
-		Client* newClient = new Client(clientFd, clientIP, clientPort);
+		// the address stays binary until something needs it as text (Client::getIpAddress)
+		Client* newClient = new Client(clientFd, std::string(), 0);
+		newClient->setPeerAddress((struct sockaddr*)&clientAddr, clientAddrLen);
+		newClient->setHostKey(hostKey);
+		newClient->setConnectionClass(connectionClass);
+		++connectionClass->clients;
+		if ((listener.tls && !_startTls(newClient)) || (listener.inject && !_acceptInjector(newClient)))
+		{
+			_releaseHost(newClient);
+			delete newClient;
+			_transport->close(clientFd);
+			continue;
+		}
 		_clients[clientFd] = newClient;
+		if (!listener.inject)
+			_capture.record(CAPTURE_CONNECT, newClient->getSerial());
 		
 		// add the new client socket to the poll fds list (to check for events)
-		struct pollfd clientPollFd;
-		clientPollFd.fd = clientFd;
-		clientPollFd.events = POLLIN;
-		clientPollFd.revents = 0;
-		_pollFds.push_back(clientPollFd);
+		_addPollFd(clientFd, POLLIN);
 		
-		std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client [" << clientFd << "] added to poll set (" 
-				<< _clients.size() << " connected)" << std::endl;
+		std::cout << PASTEL_YELLOW << "[CONNECTION] " << DEFAULT << "New connection on fd " << clientFd
+		          << " (" << _clients.size() << " connected)" << std::endl;
+	}
+}
+
+// refuse a socket before anything is allocated for it: one best-effort line, then close
+void Server::_rejectConnection(int fd, ConnectionLimiter::Verdict verdict)
+{
+	static const std::string tooMany = "ERROR :Closing Link: Too many connections from your host\r\n";
+	static const std::string throttled = "ERROR :Closing Link: Reconnecting too fast, throttled\r\n";
+	static const std::string classFull = "ERROR :Closing Link: Server is full for this connection class\r\n";
+	const std::string& reply = (verdict == ConnectionLimiter::TOO_MANY) ? tooMany
+		: (verdict == ConnectionLimiter::THROTTLED) ? throttled : classFull;
+	ssize_t n = _transport->send(fd, reply.c_str(), reply.length()); // accepted non-blocking
+	(void)n;
+	_transport->close(fd);
+	if (verdict == ConnectionLimiter::TOO_MANY)
+		++_rejectedTooMany;
+	else if (verdict == ConnectionLimiter::THROTTLED)
+		++_rejectedThrottled;
+	else
+		++_rejectedClassFull;
+}
+
+// an accepted connection goes away: its host and its class may take another one
+void Server::_releaseHost(Client* client)
+{
+	ConnectionClass* connectionClass = client->getConnectionClass();
+	if (!connectionClass)
+		return;
+	if (client->getHostKey().isSet())
+		connectionClass->limiter.release(client->getHostKey());
+	--connectionClass->clients;
+	client->setHostKey(HostKey());
+	client->setConnectionClass(NULL);
+}
+
+// run the complete commands waiting in a client's buffer, returns false if one of them removed the client
+// a pending password check holds the rest of the input until its result is known
+// at most command_budget commands per turn (server links carry many users: no limit), a client with
+// more goes to the back of the ready queue so a bulk client cannot hold the loop
+bool Server::_processBufferedCommands(Client* client)
+{
+	std::string command;
+	long budget = client->isServerLink() ? -1 : _commandBudget;
+	while (!client->isAuthPending() && budget != 0 && client->extractCommand(command)) // read complete commands from buffer
+	{
+		if (budget > 0)
+			--budget;
+		if (_commandHandler)
+			_commandHandler->processCommand(client, command);
+		if (client->getState() != CLIENT_OPEN) // the command removed the client (QUIT, KILL...)
+			return (false);
+	}
+	if (budget == 0 && !client->isReadyQueued() && client->hasCommand())
+	{
+		client->setReadyQueued(true);
+		_readyClients.push_back(client->getHandle());
 	}
+	return (true);
+}
+
+// one turn for each client queued so far, round-robin: the ones queued again wait for the next iteration
+// a TLS client was not read while it was queued: what OpenSSL decrypted meanwhile never shows in poll(),
+// so it is read now that its buffered commands are done
+void Server::_runReadyClients()
+{
+	for (size_t turns = _readyClients.size(); turns > 0; --turns)
+	{
+		Client* client = getClient(_readyClients.front());
+		_readyClients.pop_front();
+		if (!client) // disconnected meanwhile
+			continue;
+		client->setReadyQueued(false);
+		if (!_processBufferedCommands(client))
+			continue;
+		if (!client->isReadyQueued() && client->getTls() && SSL_pending(client->getTls()) > 0)
+			_readClientData(client->getClientFd());
+	}
+}
+
+// an asynchronous step finished: go on with the commands the client sent meanwhile
+void Server::resumeClient(Client* client)
+{
+	_processBufferedCommands(client);
 }
 
 // handle reading data from a client
+// at most read_budget bytes per call; a client with commands waiting in the ready queue is not read at all
+// (its socket buffer fills up and TCP slows the sender down)
 void Server::_readClientData(int fd)
 {
 	char buffer[4096];
 	ssize_t bytesRead;
+	long budget = _readBudget;
 	
+	Client* queued = getClient(fd);
+	if (queued && queued->isReadyQueued())
+		return;
 	while (true)
 	{
-		bytesRead = recv(fd, buffer, sizeof(buffer) - 1, 0); // recv to read up to 4095 bytes
+		Client* tlsClient = getClient(fd);
+		if (tlsClient && tlsClient->getTls()) // decrypted by OpenSSL (or already by the kernel with kTLS)
+			bytesRead = _recvTls(tlsClient, buffer, sizeof(buffer) - 1);
+		else
+			bytesRead = _transport->recv(fd, buffer, sizeof(buffer) - 1); // recv to read up to 4095 bytes
 		
 		if (bytesRead > 0)
 		{
@@ -393,13 +1124,16 @@ void Server::_readClientData(int fd)
 			if (client)
 			{
 				client->appendToReceiveBuffer(buffer, bytesRead); // add data to client's receive buffer
+				if (!client->isInjector())
+					_capture.record(CAPTURE_DATA, client->getSerial(), buffer, bytesRead);
 				
-				std::string command;
-				while (client->extractCommand(command)) // read complete commands from buffer
-				{
-					if (_commandHandler)
-						_commandHandler->processCommand(client, command);
-				}
+				if (client->isInjector() ? !_processInjectFrames(client) : !_processBufferedCommands(client))
+					return;
+				budget -= bytesRead;
+				// OpenSSL may hold decrypted bytes poll() cannot see: a TLS client reads them before stopping
+				bool tlsPending = client->getTls() && SSL_pending(client->getTls()) > 0;
+				if (client->isReadyQueued() || (budget <= 0 && !tlsPending))
+					break;
 			}
 		}
 		else if (bytesRead == 0)
@@ -425,56 +1159,132 @@ void Server::_readClientData(int fd)
 	}
 }
 
-// handle properly the disconnection of a client (delete client object, remove from lists, close socket)
+// handle properly the disconnection of a client: out of its channels, links and lists now,
+// socket closed and object deleted at the end of the loop iteration (_closeDisconnected)
 void Server::_disconnectClient(int fd)
 {
 	std::cout << PASTEL_YELLOW << "[DISCONNECTION] " << DEFAULT << "Disconnecting client... " << fd << std::endl;
 	
 	std::map<int, Client*>::iterator it = _clients.find(fd);
-	if (it != _clients.end())
+	if (it == _clients.end())
+	{
+		std::cout << "   Warning: Client [" << fd << "] not found in client map" << std::endl;
+		return;
+	}
+	Client* client = it->second;
+	if (client->isServerLink())
+		_dropLink(client);
+	else if (client->isInjector())
+		_dropSubscriptions(client);
+	else
 	{
-		if (it->second != NULL)
+		std::string nickname = client->getNickname();
+		if (!nickname.empty())
+			std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client nickname: [" << nickname << "]" << std::endl;
+		
+		// while draining every local member is on its way out too: the QUIT only goes to the links
+		std::string quitMsg = client->getPrefix() + (_draining ? " QUIT :Server shutting down\r\n" : " QUIT :Client disconnected\r\n");
+		const std::set<Channel*> channels = client->getJoinedChannels(); // a copy: partChannel() edits it
+		for (std::set<Channel*>::const_iterator chanIt = channels.begin(); chanIt != channels.end(); ++chanIt)
 		{
-			std::string nickname = it->second->getNickname();
-			if (!nickname.empty())
-				std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client nickname: [" << nickname << "]" << std::endl;
-			
-			const std::set<std::string>& channels = it->second->getJoinedChannels();
-			for (std::set<std::string>::const_iterator chanIt = channels.begin(); chanIt != channels.end(); ++chanIt)
-			{
-				Channel* chan = getChannel(*chanIt);
-				if (chan)
-				{
-					std::string quitMsg = it->second->getPrefix() + " QUIT :Client disconnected\r\n";
-					broadcastToChannel(*chanIt, quitMsg, fd);
-					chan->removeUser(it->second);
-					chan->removeOperator(it->second);
-				}
-			}			
-			delete it->second; // delete the Client object
+			if (!_draining)
+				broadcastMembership((*chanIt)->getName(), quitMsg, client, fd, false);
+			else if ((*chanIt)->isOperator(client))
+				(*chanIt)->addFormerOperator(nickname); // the final snapshot still records them
+			partChannel(*chanIt, client);
 		}
-		_clients.erase(it); // remove from clients map
-		std::cout << "   Client removed from client list " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+		if (client->isRegistered())
+			propagateToLinks(quitMsg);
+	}
+	removeClient(fd);
+	std::cout << "   Client removed from client list " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// once a second: clients that let their control output pile up past the SendQ are not reading any more
+void Server::_dropSendqExceeded()
+{
+	std::vector<int> exceeded;
+	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		if (it->second->isSendqExceeded())
+			exceeded.push_back(it->first);
+	}
+	for (size_t i = 0; i < exceeded.size(); ++i)
+	{
+		Client* client = getClient(exceeded[i]);
+		if (!client)
+			continue;
+		std::cerr << "[SENDQ] Disconnecting client [" << exceeded[i] << "]: " << client->getSendQueued()
+		          << " bytes queued" << std::endl;
+		client->clearSendBuffer();
+		client->sendMessage("ERROR :Closing Link: " + client->getIpAddress() + " (SendQ exceeded)\r\n");
+		_disconnectClient(exceeded[i]);
 	}
-	else
-		std::cout << "   Warning: Client [" << fd << "] not found in client map" << std::endl;
-	
-	_removePollFd(fd); // clean up poll fds list
-	::shutdown(fd, SHUT_RDWR); // shutdown the socket
-	
-	if (close(fd) == -1)
-		std::cerr << "   close() error: " << strerror(errno) << std::endl;
-	else
-		std::cout << "   Socket closed " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-	
-	std::cout <<  "Client [" << fd << "] disconnected (" 
-			<< _clients.size() << " remaining)" << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// every BUFFER_RECLAIM_INTERVAL seconds: clients quiet for a whole interval give their buffers back, a burst
+// (a big NAMES, a history replay) does not stay allocated for as long as the client stays idle
+void Server::_reclaimIdleBuffers(time_t now)
+{
+	size_t bytes = 0;
+	size_t idle = 0;
+	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		size_t reclaimed = it->second->reclaimBuffers(now, BUFFER_RECLAIM_INTERVAL);
+		if (reclaimed > 0)
+			++idle;
+		bytes += reclaimed;
+	}
+	_bytesReclaimed += bytes;
+	if (bytes > 0)
+		std::cout << PASTEL_YELLOW << "[MEMORY] " << DEFAULT << idle << " idle clients gave back " << bytes << " bytes (pool: "
+		          << Client::bufferPool().spareBuffers() << " buffers, " << Client::bufferPool().spareBytes() << " bytes)" << std::endl;
+}
+
+// end of a loop iteration: the clients disconnected during it get one last non-blocking write of their
+// output (ERROR, numerics), then their sockets close; the poll set is compacted in a single pass
+void Server::_closeDisconnected()
+{
+	if (_closing.empty())
+		return;
+	std::set<int> closed;
+	for (size_t i = 0; i < _closing.size(); ++i)
+	{
+		Client* client = _closing[i];
+		int fd = client->getClientFd();
+		while (client->hasOutput() && !client->isMeshLink() && !client->isTlsHandshaking())
+		{
+			const std::string& output = client->nextOutput();
+			size_t length = output.length();
+			ssize_t n = client->getTls() ? _sendTls(client, output) : _transport->send(fd, output.c_str(), length);
+			if (n <= 0)
+				break;
+			client->consumeFromSendBuffer(n);
+			if ((size_t)n < length) // the socket is full
+				break;
+		}
+		if (!client->isInjector())
+			_capture.record(CAPTURE_CLOSE, client->getSerial());
+		_releaseHost(client);
+		::shutdown(fd, SHUT_RDWR);
+		if (_transport->close(fd) == -1)
+			std::cerr << "   close() error on fd [" << fd << "]: " << strerror(errno) << std::endl;
+		closed.insert(fd);
+		delete client;
+	}
+	_closing.clear();
+
+	_removePollFds(closed);
+	std::cout << PASTEL_YELLOW << "[DISCONNECTION] " << DEFAULT << closed.size() << " client(s) closed ("
+	          << _clients.size() << " remaining)" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
 }
 
 // send a message immediately to a client via its socket
 void Server::_sendMsgToClient(int fd, const std::string& message)
 {
-	ssize_t bytesSent = send(fd, message.c_str(), message.length(), 0);
+	Client* client = getClient(fd);
+	ssize_t bytesSent = (client && client->getTls()) ? _sendTls(client, message)
+		: _transport->send(fd, message.c_str(), message.length());
 	if (bytesSent == -1)
 	{
 		if (errno == EWOULDBLOCK || errno == EAGAIN)
@@ -501,79 +1311,112 @@ void Server::_sendPendingData(int fd)
 		return;
 	}
 	
-	const std::string& sendBuffer = client->getSendBuffer();
-	if (sendBuffer.empty())
-	{
-		_unsetPollOut(fd);
-		return;
-	}
-	
-	ssize_t bytesSent = send(fd, sendBuffer.c_str(), sendBuffer.length(), 0);
-	if (bytesSent > 0)
+	// the output comes from the lanes a chunk at a time: keep writing until the socket is full
+	while (true)
 	{
-		std::cout << PASTEL_GREEN << "[SEND] " << DEFAULT << "Sent " << bytesSent << " bytes to client [" << fd << "]" << std::endl;
-		client->consumeFromSendBuffer(bytesSent);
-		
-		if (client->getSendBuffer().empty())
+		const std::string& sendBuffer = client->nextOutput();
+		if (sendBuffer.empty())
+		{
 			_unsetPollOut(fd);
+			return;
+		}
+		
+		size_t length = sendBuffer.length();
+		ssize_t bytesSent;
+		if (client->isMeshLink())
+			bytesSent = _writeMesh(client, sendBuffer);
+		else if (client->getTls())
+			bytesSent = _sendTls(client, sendBuffer);
+		else
+			bytesSent = _transport->send(fd, sendBuffer.c_str(), length);
+		if (bytesSent > 0)
+		{
+			std::cout << PASTEL_GREEN << "[SEND] " << DEFAULT << "Sent " << bytesSent << " bytes to client [" << fd << "]" << std::endl;
+			client->consumeFromSendBuffer(bytesSent);
+			if ((size_t)bytesSent < length)
+				return;
+			continue;
+		}
+		if (bytesSent == -1)
+		{
+			if (errno != EWOULDBLOCK && errno != EAGAIN)
+			{
+				std::cerr << "send() error on client [" << fd << "]: " << strerror(errno) << std::endl;
+				_disconnectClient(fd);
+			}
+			else if (client->isMeshLink()) // ring full: the peer wakes us up once it made room
+				_unsetPollOut(fd);
+		}
+		return;
 	}
-	else if (bytesSent == -1)
+}
+
+// add a socket to the poll set
+void Server::_addPollFd(int fd, short events)
+{
+	struct pollfd entry;
+	entry.fd = fd;
+	entry.events = events;
+	entry.revents = 0;
+	if ((size_t)fd >= _pollIndex.size())
+		_pollIndex.resize(fd + 1, -1);
+	_pollIndex[fd] = _pollFds.size();
+	_pollFds.push_back(entry);
+}
+
+// take sockets out of the poll set in one pass, the others keep their order
+void Server::_removePollFds(const std::set<int>& fds)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < _pollFds.size(); ++i)
 	{
-		if (errno != EWOULDBLOCK && errno != EAGAIN)
+		int fd = _pollFds[i].fd;
+		if (fds.count(fd))
 		{
-			std::cerr << "send() error on client [" << fd << "]: " << strerror(errno) << std::endl;
-			_disconnectClient(fd);
+			_pollIndex[fd] = -1;
+			continue;
 		}
+		_pollIndex[fd] = kept;
+		_pollFds[kept++] = _pollFds[i];
 	}
+	_pollFds.resize(kept);
+}
+
+struct pollfd* Server::_findPollFd(int fd)
+{
+	if (fd < 0 || (size_t)fd >= _pollIndex.size() || _pollIndex[fd] == -1)
+		return (NULL);
+	return (&_pollFds[_pollIndex[fd]]);
 }
 
 // enable POLLOUT event for a client fd
 void Server::_setPollOut(int fd)
 {
-	for (std::vector<struct pollfd>::iterator it = _pollFds.begin(); it != _pollFds.end(); ++it)
+	struct pollfd* entry = _findPollFd(fd);
+	if (!entry)
 	{
-		if (it->fd == fd)
-		{
-			if (!(it->events & POLLOUT))
-			{
-				it->events |= POLLOUT;
-				std::cout << "   POLLOUT enabled for fd [" << fd << "]" << PASTEL_GREEN << " ✓ " << DEFAULT << std::endl;
-			}
-			return;
-		}
+		std::cerr << "Warning: fd [" << fd << "] not found in _setPollOut" << std::endl;
+		return;
+	}
+	if (!(entry->events & POLLOUT))
+	{
+		entry->events |= POLLOUT;
+		std::cout << "   POLLOUT enabled for fd [" << fd << "]" << PASTEL_GREEN << " ✓ " << DEFAULT << std::endl;
 	}
-	std::cerr << "Warning: fd [" << fd << "] not found in _setPollOut" << std::endl;
 }
 
 // disable POLLOUT event for a client fd
 void Server::_unsetPollOut(int fd)
 {
-	for (std::vector<struct pollfd>::iterator it = _pollFds.begin(); it != _pollFds.end(); ++it)
+	struct pollfd* entry = _findPollFd(fd);
+	if (!entry)
 	{
-		if (it->fd == fd)
-		{
-			if (it->events & POLLOUT)
-			{
-				it->events &= ~POLLOUT;
-				std::cout << "   POLLOUT disabled for fd [" << fd << "]" << PASTEL_GREEN << " ✓ " << DEFAULT << std::endl;
-			}
-			return;
-		}
+		std::cerr << "Warning: fd [" << fd << "] not found in _unsetPollOut" << std::endl;
+		return;
 	}
-	std::cerr << "Warning: fd [" << fd << "] not found in _unsetPollOut" << std::endl;
-}
-
-// remove a fd from the poll fds list
-void Server::_removePollFd(int fd)
-{
-	for (std::vector<struct pollfd>::iterator it = _pollFds.begin(); it != _pollFds.end(); ++it)
+	if (entry->events & POLLOUT)
 	{
-		if (it->fd == fd)
-		{
-			_pollFds.erase(it);
-			std::cout << "   File descriptor [" << fd << "] removed from poll set " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
-			return;
-		}
+		entry->events &= ~POLLOUT;
+		std::cout << "   POLLOUT disabled for fd [" << fd << "]" << PASTEL_GREEN << " ✓ " << DEFAULT << std::endl;
 	}
-	std::cerr << "Warning: fd [" << fd << "] not found in poll set" << std::endl;
 }
@@ -0,0 +1,204 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "CommandHandler.hpp"
+#include "Colors.hpp"
+#include "Inject.hpp"
+#include "Snapshot.hpp"
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// [u32 length][body]: body starts with the frame type
+static std::string injectFrame(const SnapshotWriter& body)
+{
+	uint32_t length = body.data().length();
+	std::string frame((const char*)&length, sizeof(length));
+	frame += body.data();
+	return (frame);
+}
+
+// the injection socket is privileged: besides its 0600 mode, the peer must run as our user or as root
+bool Server::_acceptInjector(Client* client)
+{
+	struct ucred credentials;
+	socklen_t length = sizeof(credentials);
+	if (getsockopt(client->getClientFd(), SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1
+		|| (credentials.uid != getuid() && credentials.uid != 0))
+	{
+		std::cerr << "[INJECT] Refused injection client [" << client->getClientFd() << "]: not our user" << std::endl;
+		return (false);
+	}
+	client->setInjector(true);
+	std::cout << PASTEL_YELLOW << "[INJECT] " << DEFAULT << "Injection client [" << client->getClientFd()
+	          << "] connected (pid " << credentials.pid << ")" << std::endl;
+	return (true);
+}
+
+void Server::_injectError(Client* client, unsigned long frame, const std::string& code, const std::string& target)
+{
+	SnapshotWriter body;
+	body.putU8(INJECT_ERROR);
+	body.putU32(frame);
+	body.putString(code);
+	body.putString(target);
+	client->appendToSendBuffer(injectFrame(body));
+}
+
+// INJECT_MESSAGE: checked like PRIVMSG/NOTICE input, then handed to the same delivery code
+void Server::_injectMessage(Client* client, unsigned long frame, SnapshotReader& in)
+{
+	std::string command, sender, target;
+	uint32_t count;
+	if (!in.getString(command) || !in.getString(sender) || !in.getString(target) || !in.getU32(count))
+	{
+		_injectError(client, frame, INJECT_FRAME_ERROR, "");
+		return;
+	}
+	if (command != "PRIVMSG" && command != "NOTICE")
+	{
+		_injectError(client, frame, ERR_UNKNOWNCOMMAND, command);
+		return;
+	}
+
+	// a nickname speaks with its own prefix and permissions, a full prefix is trusted as is
+	Client* source = NULL;
+	std::string prefix;
+	if (sender.find('!') != std::string::npos && sender.find('@') != std::string::npos)
+		prefix = ":" + sender;
+	else
+	{
+		source = getClientByNick(sender);
+		if (!source || !source->isRegistered())
+		{
+			_injectError(client, frame, ERR_NOSUCHNICK, sender);
+			return;
+		}
+		prefix = source->getPrefix();
+	}
+	if (prefix.find_first_of(" \r\n", 1) != std::string::npos || target.find_first_of(" \r\n") != std::string::npos)
+	{
+		_injectError(client, frame, INJECT_FRAME_ERROR, target);
+		return;
+	}
+
+	// every text must fit one IRC line (510 bytes before CRLF) and carry no line break
+	size_t overhead = prefix.length() + command.length() + target.length() + 4;
+	std::vector<std::string> texts(count <= INJECT_MAX_FRAME / 4 ? count : 0);
+	for (uint32_t i = 0; i < texts.size(); ++i)
+	{
+		if (!in.getString(texts[i]) || texts[i].find_first_of(std::string("\r\n\0", 3)) != std::string::npos)
+		{
+			_injectError(client, frame, INJECT_FRAME_ERROR, target);
+			return;
+		}
+		if (overhead + texts[i].length() > 510)
+		{
+			_injectError(client, frame, ERR_INPUTTOOLONG, target);
+			return;
+		}
+	}
+	std::string error = _commandHandler->deliverMessage(source, prefix, command, target,
+		texts.empty() ? NULL : &texts[0], texts.size());
+	if (!error.empty())
+		_injectError(client, frame, error, target);
+}
+
+// run every complete frame of the receive buffer; false if the client was disconnected
+bool Server::_processInjectFrames(Client* client)
+{
+	int fd = client->getClientFd();
+	const std::string& buffer = client->getReceiveBuffer();
+	size_t offset = 0;
+	while (buffer.length() - offset >= sizeof(uint32_t))
+	{
+		uint32_t length;
+		std::memcpy(&length, buffer.data() + offset, sizeof(length));
+		if (length == 0 || length > INJECT_MAX_FRAME)
+		{
+			std::cerr << "[INJECT] Invalid frame length " << length << " from client [" << fd << "]" << std::endl;
+			_disconnectClient(fd);
+			return (false);
+		}
+		if (buffer.length() - offset - sizeof(length) < length)
+			break;
+		SnapshotReader in(buffer.data() + offset + sizeof(length), length);
+		offset += sizeof(length) + length;
+		unsigned long frame = client->nextInjectFrame();
+
+		uint8_t type;
+		std::string channel;
+		uint32_t token;
+		in.getU8(type);
+		if (type == INJECT_MESSAGE)
+			_injectMessage(client, frame, in);
+		else if ((type == INJECT_SUBSCRIBE || type == INJECT_UNSUBSCRIBE) && in.getString(channel)
+			&& !channel.empty() && (channel[0] == '#' || channel[0] == '&'))
+		{
+			std::string folded = foldName(channel); // "#Foo" and "#FOO" are one subscription
+			if (type == INJECT_SUBSCRIBE)
+				_subscribers[folded].insert(client);
+			else if (_subscribers.count(folded) && _subscribers[folded].erase(client) && _subscribers[folded].empty())
+				_subscribers.erase(folded);
+			std::cout << PASTEL_YELLOW << "[INJECT] " << DEFAULT << "Client [" << fd << "] "
+			          << (type == INJECT_SUBSCRIBE ? "subscribed to " : "unsubscribed from ") << channel << std::endl;
+		}
+		else if (type == INJECT_SYNC && in.getU32(token))
+		{
+			SnapshotWriter body;
+			body.putU8(INJECT_SYNC);
+			body.putU32(token);
+			client->appendToSendBuffer(injectFrame(body));
+		}
+		else
+			_injectError(client, frame, INJECT_FRAME_ERROR, channel);
+	}
+	client->consumeFromReceiveBuffer(offset);
+	if (client->hasOutput())
+		_setPollOut(fd);
+	return (true);
+}
+
+// copy a channel broadcast (one or more CRLF-terminated lines) to the sockets subscribed to the channel,
+// in whatever case the sender spelled it: the events carry the channel's own name
+void Server::_notifySubscribers(Channel* channel, const std::string& message)
+{
+	std::map<std::string, std::set<Client*> >::iterator it = _subscribers.find(foldName(channel->getName()));
+	if (it == _subscribers.end())
+		return;
+	std::string channelName = channel->getName();
+	std::string frames;
+	size_t start = 0;
+	while (start < message.length())
+	{
+		size_t end = message.find('\n', start);
+		if (end == std::string::npos)
+			end = message.length();
+		size_t stop = (end > start && message[end - 1] == '\r') ? end - 1 : end;
+		SnapshotWriter body;
+		body.putU8(INJECT_EVENT);
+		body.putString(channelName);
+		body.putString(message.substr(start, stop - start));
+		frames += injectFrame(body);
+		start = end + 1;
+	}
+	for (std::set<Client*>::iterator sub = it->second.begin(); sub != it->second.end(); ++sub)
+	{
+		(*sub)->appendToSendBuffer(frames);
+		_setPollOut((*sub)->getClientFd());
+	}
+}
+
+void Server::_dropSubscriptions(Client* client)
+{
+	std::map<std::string, std::set<Client*> >::iterator it = _subscribers.begin();
+	while (it != _subscribers.end())
+	{
+		it->second.erase(client);
+		if (it->second.empty())
+			_subscribers.erase(it++);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,261 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define LINK_BURST_LINE_MAX	400	// member list bytes per SJOIN line (keeps lines under 512 bytes)
+
+// open the configured outgoing links that are not connected (non-blocking connect, SERVER queued)
+void Server::_connectLinks()
+{
+	for (std::map<std::string, int>::iterator it = _linkConnects.begin(); it != _linkConnects.end(); ++it)
+	{
+		if (it->second != -1)
+		{
+			Client* existing = getClient(it->second);
+			if (existing && existing->isLinkOutbound())
+				continue;
+			it->second = -1;
+		}
+
+		size_t colon = it->first.rfind(':');
+		if (colon == std::string::npos)
+		{
+			std::cerr << "[LINK] Invalid link_connect '" << it->first << "' (expected host:port)" << std::endl;
+			continue;
+		}
+		std::string host = it->first.substr(0, colon);
+		std::string port = it->first.substr(colon + 1);
+
+		struct addrinfo hints;
+		struct addrinfo* res = NULL;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+		{
+			std::cerr << "[LINK] Cannot resolve " << it->first << std::endl;
+			continue;
+		}
+		int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd == -1)
+		{
+			freeaddrinfo(res);
+			continue;
+		}
+		try
+		{
+			_setNonBlocking(fd);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "[LINK] " << e.what() << std::endl;
+			close(fd);
+			freeaddrinfo(res);
+			continue;
+		}
+		int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+		if (rc == -1 && errno != EINPROGRESS)
+		{
+			std::cerr << "[LINK] connect(" << it->first << ") failed: " << strerror(errno) << std::endl;
+			close(fd);
+			continue;
+		}
+
+		Client* link = new Client(fd, host, std::atoi(port.c_str()));
+		link->setLinkOutbound(true);
+		link->sendMessage("SERVER " + _serverName + " " + _config.get("link_password") + " :ft_irc server");
+		_clients[fd] = link;
+		_addPollFd(fd, POLLIN | POLLOUT); // POLLOUT also reports the end of the non-blocking connect
+		it->second = fd;
+		std::cout << PASTEL_YELLOW << "[LINK] " << DEFAULT << "Connecting to " << it->first << " (fd: " << fd << ")" << std::endl;
+	}
+}
+
+// a SERVER handshake succeeded: answer it if the peer connected to us, then send our burst
+bool Server::establishLink(Client* link, const std::string& name)
+{
+	if (name == _serverName || getLinkByName(name))
+	{
+		std::cerr << "[LINK] Rejecting link " << name << ": server already linked" << std::endl;
+		return (false);
+	}
+	link->setServerLink(name);
+	_links.insert(link);
+	if (!link->isLinkOutbound())
+		link->sendMessage("SERVER " + _serverName + " " + _config.get("link_password") + " :ft_irc server");
+	_sendBurst(link);
+	_setPollOut(link->getClientFd());
+	std::cout << PASTEL_YELLOW << "[LINK] " << DEFAULT << "Linked with " << name << " (" << _links.size() << " links)" << std::endl;
+	return (true);
+}
+
+// a SERVER handshake that failed: the peer learns why, then the connection goes
+void Server::refuseLink(Client* client)
+{
+	int fd = client->getClientFd();
+	_sendMsgToClient(fd, "ERROR :Link refused\r\n");
+	_disconnectClient(fd);
+}
+
+Client* Server::getLinkByName(const std::string& name)
+{
+	for (std::set<Client*>::iterator it = _links.begin(); it != _links.end(); ++it)
+	{
+		if ((*it)->getLinkName() == name)
+			return (*it);
+	}
+	return (NULL);
+}
+
+std::string Server::_uidLine(Client* client) const
+{
+	return (":" + _serverName + " UID " + client->getNickname() + " " + client->getUsername() + " "
+		+ client->getHostname() + " " + client->getIpAddress() + " :" + client->getRealname() + "\r\n");
+}
+
+// introduce every client and channel the peer cannot know about (everything not behind this link)
+void Server::_sendBurst(Client* link)
+{
+	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		if (it->second->isRegistered() && !it->second->isServerLink())
+			link->sendMessage(_uidLine(it->second));
+	}
+	for (std::set<Client*>::iterator it = _remoteClients.begin(); it != _remoteClients.end(); ++it)
+	{
+		if ((*it)->getUplink() != link)
+			link->sendMessage(_uidLine(*it));
+	}
+
+	for (std::set<Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+	{
+		Channel* channel = *it;
+		std::string modes = "+";
+		std::string modeParams;
+		if (channel->getMode('i')) modes += "i";
+		if (channel->getMode('t')) modes += "t";
+		if (channel->getMode('u')) modes += "u";
+		if (channel->getMode('k'))
+		{
+			modes += "k";
+			modeParams += " " + channel->getKey();
+		}
+		if (channel->getMode('l'))
+		{
+			std::stringstream limit;
+			limit << channel->getLimit();
+			modes += "l";
+			modeParams += " " + limit.str();
+		}
+		std::string head = ":" + _serverName + " SJOIN " + channel->getName() + " " + modes + modeParams + " :";
+
+		std::string members;
+		const std::set<Client*>& all = channel->getMembers();
+		for (std::set<Client*>::const_iterator m = all.begin(); m != all.end(); ++m)
+		{
+			if ((*m)->getUplink() == link)
+				continue;
+			if (members.length() > LINK_BURST_LINE_MAX)
+			{
+				link->sendMessage(head + members + "\r\n");
+				members.clear();
+			}
+			members += (members.empty() ? "" : " ") + std::string(channel->isOperator(*m) ? "@" : "") + (*m)->getNickname();
+		}
+		if (members.empty())
+			continue;
+		link->sendMessage(head + members + "\r\n");
+		if (!channel->getTopic().empty())
+			link->sendMessage(":" + _serverName + " TB " + channel->getName() + " :" + channel->getTopic() + "\r\n");
+	}
+	link->sendMessage(":" + _serverName + " EOB\r\n");
+}
+
+// a link closed: every client behind it quits (netsplit)
+void Server::_dropLink(Client* link)
+{
+	std::cout << PASTEL_YELLOW << "[LINK] " << DEFAULT << "Lost link with " << link->getLinkName() << std::endl;
+	_links.erase(link);
+
+	std::vector<Client*> lost;
+	for (std::set<Client*>::iterator it = _remoteClients.begin(); it != _remoteClients.end(); ++it)
+	{
+		if ((*it)->getUplink() == link)
+			lost.push_back(*it);
+	}
+	for (size_t i = 0; i < lost.size(); ++i)
+		removeRemoteClient(lost[i], lost[i]->getPrefix() + " QUIT :" + _serverName + " " + link->getLinkName() + "\r\n");
+}
+
+// send a line once to every link except the one excludeFd designates
+// workers form a full mesh: what came from a worker already reached all the others
+void Server::propagateToLinks(const std::string& message, int excludeFd)
+{
+	Client* origin = getClient(excludeFd);
+	bool fromMesh = (origin && origin->isMeshLink());
+	for (std::set<Client*>::iterator it = _links.begin(); it != _links.end(); ++it)
+	{
+		if ((*it)->getClientFd() == excludeFd || (fromMesh && (*it)->isMeshLink()))
+			continue;
+		(*it)->sendMessage(message);
+		_setPollOut((*it)->getClientFd());
+	}
+}
+
+// a local client finished registration: tell the other servers
+void Server::introduceClient(Client* client)
+{
+	propagateToLinks(_uidLine(client));
+}
+
+Client* Server::addRemoteClient(Client* link, const std::string& nickname, const std::string& username,
+	const std::string& hostname, const std::string& ipAddress, const std::string& realname)
+{
+	Client* client = new Client(link->getClientFd(), ipAddress, 0);
+	client->setUplink(link);
+	setNick(client, nickname);
+	client->setUsername(username);
+	client->setHostname(hostname);
+	client->setRealname(realname);
+	client->setRegistered(true);
+	_remoteClients.insert(client);
+	return (client);
+}
+
+// a remote client quit (or its link is gone): tell local members and the other links, then forget it
+void Server::removeRemoteClient(Client* client, const std::string& quitMsg)
+{
+	const std::set<Channel*> channels = client->getJoinedChannels(); // a copy: partChannel() edits it
+	for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		broadcastMembership((*it)->getName(), quitMsg, client, client->getClientFd(), false);
+		partChannel(*it, client);
+	}
+	propagateToLinks(quitMsg, client->getClientFd());
+	_releaseNick(client);
+	_remoteClients.erase(client);
+	delete client;
+}
+
+void Server::renameRemoteClient(Client* client, const std::string& newNick)
+{
+	setNick(client, newNick);
+}
+
+// a peer server killed one of our clients (nickname collision)
+void Server::killClient(Client* client, const std::string& reason)
+{
+	int fd = client->getClientFd();
+	_sendMsgToClient(fd, "ERROR :Closing Link: " + client->getNickname() + " (Killed: " + reason + ")\r\n");
+	_disconnectClient(fd);
+}
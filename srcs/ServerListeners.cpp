@@ -0,0 +1,282 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+// "key=value" words of a connection_class line
+static void parseClassOptions(ConnectionClass* connectionClass, std::istringstream& words, long& maxPerHost,
+	long& rate, long& burst)
+{
+	std::string word;
+	while (words >> word)
+	{
+		size_t eq = word.find('=');
+		std::string key = word.substr(0, eq);
+		char* end = NULL;
+		long value = (eq == std::string::npos) ? 0 : std::strtol(word.c_str() + eq + 1, &end, 10);
+		if (eq == std::string::npos || eq + 1 == word.length() || *end != '\0')
+			throw std::runtime_error("Error: connection_class " + connectionClass->name + ": expected option=number, got '" + word + "'");
+		if (key == "max_clients")
+			connectionClass->maxClients = value;
+		else if (key == "max_per_host")
+			maxPerHost = value;
+		else if (key == "connect_rate")
+			rate = value;
+		else if (key == "connect_burst")
+			burst = value;
+		else if (key == "sendq")
+			connectionClass->sendq = value;
+		else
+			throw std::runtime_error("Error: connection_class " + connectionClass->name + ": unknown option '" + key + "'");
+	}
+}
+
+// the default class takes the global keys, each "connection_class" line adds a named class
+// (options a named class does not give fall back to the global keys too)
+void Server::_initClasses()
+{
+	long globalPerHost = _config.getInt("max_connections_per_host", LIMIT_DEFAULT_PER_HOST);
+	long globalRate = _config.getInt("connect_rate", LIMIT_DEFAULT_RATE);
+	long globalBurst = _config.getInt("connect_burst", LIMIT_DEFAULT_BURST);
+	long globalSendq = _config.getInt("sendq", SENDQ_DEFAULT_BYTES);
+
+	ConnectionClass* defaultClass = new ConnectionClass;
+	defaultClass->name = DEFAULT_CONNECTION_CLASS;
+	defaultClass->maxClients = _config.getInt("max_clients", 0);
+	defaultClass->clients = 0;
+	defaultClass->sendq = globalSendq;
+	defaultClass->limiter.configure(globalPerHost, globalRate, globalBurst);
+	_classes[defaultClass->name] = defaultClass;
+
+	std::vector<std::string> lines = _config.getAll("connection_class");
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		std::istringstream words(lines[i]);
+		std::string name;
+		words >> name;
+		if (name.empty() || _classes.count(name))
+			throw std::runtime_error("Error: connection_class '" + name + "' is empty or defined twice");
+		ConnectionClass* connectionClass = new ConnectionClass;
+		connectionClass->name = name;
+		connectionClass->maxClients = 0;
+		connectionClass->clients = 0;
+		connectionClass->sendq = globalSendq;
+		_classes[name] = connectionClass;
+		long maxPerHost = globalPerHost;
+		long rate = globalRate;
+		long burst = globalBurst;
+		parseClassOptions(connectionClass, words, maxPerHost, rate, burst);
+		connectionClass->limiter.configure(maxPerHost, rate, burst);
+	}
+}
+
+ConnectionClass* Server::_getClass(const std::string& name)
+{
+	std::map<std::string, ConnectionClass*>::iterator it = _classes.find(name);
+	if (it == _classes.end())
+		throw std::runtime_error("Error: unknown connection class '" + name + "'");
+	return (it->second);
+}
+
+// identifies a listener across a binary upgrade
+std::string Server::_listenerKey(const Listener& listener)
+{
+	return (listener.address + (listener.tls ? " tls" : "") + (listener.inject ? " inject" : ""));
+}
+
+// "<port>" (empty host: dual-stack), "<ipv4>:<port>", "[<ipv6>]:<port>", "*:<port>"
+static bool parseTcpAddress(const std::string& address, std::string& host, std::string& port)
+{
+	if (address.find_first_not_of("0123456789") == std::string::npos)
+	{
+		host = "";
+		port = address;
+	}
+	else if (address[0] == '[')
+	{
+		size_t close = address.find("]:");
+		if (close == std::string::npos)
+			return (false);
+		host = address.substr(1, close - 1);
+		port = address.substr(close + 2);
+	}
+	else
+	{
+		size_t colon = address.rfind(':');
+		if (colon == std::string::npos)
+			return (false);
+		host = address.substr(0, colon);
+		port = address.substr(colon + 1);
+		if (host == "*")
+			host = "";
+	}
+	return (!port.empty() && port.find_first_not_of("0123456789") == std::string::npos);
+}
+
+// a unix domain socket: a stale file left by a dead server is replaced, a live one is an error
+static int bindUnix(const std::string& path)
+{
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.length() >= sizeof(addr.sun_path))
+		throw std::runtime_error("Error: invalid unix socket path '" + path + "'");
+	std::memcpy(addr.sun_path, path.c_str(), path.length());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		throw std::runtime_error(std::string("socket(AF_UNIX) failed: ") + strerror(errno));
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+		{
+			close(fd);
+			throw std::runtime_error("Error: " + path + " is in use by another server");
+		}
+		unlink(path.c_str());
+	}
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1)
+	{
+		std::string error = strerror(errno);
+		close(fd);
+		throw std::runtime_error("Error: cannot listen on " + path + ": " + error);
+	}
+	return (fd);
+}
+
+// open (or take over from a binary upgrade) one listener and add it to the poll set
+// listener comes with its address, options and class set
+void Server::_openListener(Listener listener)
+{
+	const std::string& address = listener.address;
+	std::string key = _listenerKey(listener);
+	for (size_t i = 0; i < _listeners.size(); ++i)
+	{
+		if (_listenerKey(_listeners[i]) == key)
+			throw std::runtime_error("Error: listener " + key + " is configured twice");
+	}
+	listener.fd = -1;
+	bool isUnix = (address.compare(0, 5, "unix:") == 0);
+	if (isUnix)
+		listener.unixPath = address.substr(5);
+	if (listener.inject && (!isUnix || listener.tls))
+		throw std::runtime_error("Error: listener " + key + ": inject is for plaintext unix domain sockets only");
+
+	std::map<std::string, int>::iterator inherited = _inheritedListeners.find(key);
+	if (inherited != _inheritedListeners.end())
+	{
+		listener.fd = inherited->second;
+		_inheritedListeners.erase(inherited);
+	}
+	else if (isUnix)
+	{
+		listener.fd = bindUnix(listener.unixPath);
+		if (listener.inject) // privileged: only our own user may connect (checked again at accept)
+			chmod(listener.unixPath.c_str(), 0600);
+	}
+	else
+	{
+		std::string host, port;
+		if (!parseTcpAddress(address, host, port))
+			throw std::runtime_error("Error: invalid listen address '" + address + "'");
+		bool dualStack = host.empty(); // [::] with IPV6_V6ONLY off takes IPv4 too, as ::ffff:a.b.c.d
+		const char* hosts[] = { dualStack ? "::" : host.c_str(), dualStack ? "0.0.0.0" : NULL };
+		std::string error = "no usable address";
+		for (size_t h = 0; h < 2 && hosts[h] && listener.fd == -1; ++h)
+		{
+			struct addrinfo hints;
+			struct addrinfo* result;
+			std::memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+			int gai = getaddrinfo(hosts[h], port.c_str(), &hints, &result);
+			if (gai != 0)
+			{
+				error = gai_strerror(gai);
+				continue;
+			}
+			int fd = socket(result->ai_family, SOCK_STREAM, 0);
+			if (fd == -1) // no IPv6 on this host: the dual-stack listener falls back to 0.0.0.0
+			{
+				error = strerror(errno);
+				freeaddrinfo(result);
+				continue;
+			}
+			int opt = 1;
+			int v6only = dualStack ? 0 : 1; // an explicit IPv6 address may share its port with an IPv4 listener
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+			if (result->ai_family == AF_INET6)
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+			_tuneListener(fd);
+			if (bind(fd, result->ai_addr, result->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1)
+			{
+				error = strerror(errno);
+				close(fd);
+				freeaddrinfo(result);
+				break; // the address exists but cannot be used (EADDRINUSE, EACCES...)
+			}
+			freeaddrinfo(result);
+			listener.fd = fd;
+		}
+		if (listener.fd == -1)
+			throw std::runtime_error("Error: cannot listen on " + address + ": " + error);
+	}
+	_setNonBlocking(listener.fd);
+	_listeners.push_back(listener);
+
+	_addPollFd(listener.fd, POLLIN);
+	std::cout << "   Listening on " << address << (listener.tls ? " (tls" : listener.inject ? " (inject" : " (plaintext")
+	          << ", class " << listener.connectionClass->name << ", fd " << listener.fd << ") " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// a transport with its own listener (SimTransport) gets a plaintext listener in the default class
+void Server::setTransport(Transport* transport)
+{
+	_transport = transport;
+	if (transport->listenFd() == -1)
+		return;
+	Listener listener;
+	listener.fd = transport->listenFd();
+	listener.address = "sim";
+	listener.tls = false;
+	listener.inject = false;
+	listener.connectionClass = _getClass(DEFAULT_CONNECTION_CLASS);
+	_listeners.push_back(listener);
+
+	_addPollFd(listener.fd, POLLIN);
+	std::cout << "   Listening on the simulated network (fd " << listener.fd << ") " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+Listener* Server::_findListener(int fd)
+{
+	for (size_t i = 0; i < _listeners.size(); ++i)
+	{
+		if (_listeners[i].fd == fd)
+			return (&_listeners[i]);
+	}
+	return (NULL);
+}
+
+// removePaths: the unix socket files go too (not when a new process or another worker still uses them)
+void Server::_closeListeners(bool removePaths)
+{
+	for (size_t i = 0; i < _listeners.size(); ++i)
+	{
+		close(_listeners[i].fd);
+		if (removePaths && !_listeners[i].unixPath.empty())
+			unlink(_listeners[i].unixPath.c_str());
+	}
+	_listeners.clear();
+}
@@ -0,0 +1,116 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <set>
+#include <csignal>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+static double nowSeconds()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+// first step of a graceful shutdown: no more accepts, every client is told, the workers drain too
+// the loop keeps running, so queued and in-flight messages are still delivered
+void Server::_beginDrain()
+{
+	_draining = true;
+	double now = nowSeconds();
+	_drainDeadline = now + _drainTimeout;
+	_nextDrainBatch = now;
+
+	// new connections are refused from now on (another server, or this one once restarted, takes them)
+	std::set<int> listenFds;
+	for (size_t i = 0; i < _listeners.size(); ++i)
+		listenFds.insert(_listeners[i].fd);
+	_closeListeners(!_handedOff && _workerId == 0);
+
+	// drop the listeners from the poll set, then queue the notice and ask for POLLOUT
+	_removePollFds(listenFds);
+	size_t notified = 0;
+	for (size_t i = 0; i < _pollFds.size(); ++i)
+	{
+		Client* client = getClient(_pollFds[i].fd);
+		if (!client || client->isServerLink() || client->isInjector() || client->isTlsHandshaking())
+			continue;
+		std::string nickname = client->getNickname().empty() ? "*" : client->getNickname();
+		client->sendMessage(":" + _serverName + " NOTICE " + nickname + " :*** Server shutting down, closing connections\r\n");
+		_pollFds[i].events |= POLLOUT;
+		++notified;
+	}
+
+	for (size_t i = 0; i < _workerPids.size(); ++i)
+		kill(_workerPids[i], SIGTERM);
+	std::cout << PASTEL_YELLOW << "[SHUTDOWN] " << DEFAULT << "Draining " << notified << " clients: at least " << _drainBatch
+	          << " closed every " << _drainInterval << " ms once their output is out, the rest at the " << _drainTimeout
+	          << " s deadline" << std::endl;
+}
+
+// one drain step per interval: close a batch of the clients with nothing left to send or to run, sized
+// so the last batch lands at the deadline (a slow reader keeps its connection until then), links go last
+void Server::_continueDrain()
+{
+	double now = nowSeconds();
+	if (now < _nextDrainBatch)
+		return;
+	_nextDrainBatch = now + _drainInterval / 1000.0;
+	bool late = (now >= _drainDeadline);
+
+	size_t remaining = 0;
+	std::vector<int> flushed;
+	for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		if (it->second->isServerLink())
+			continue;
+		++remaining;
+		if (late || (!it->second->hasOutput() && !it->second->hasCommand()))
+			flushed.push_back(it->first);
+	}
+	if (remaining == 0)
+	{
+		// the links carried the clients' QUITs: they close once those are written (mesh links stay to the end)
+		std::vector<int> links;
+		for (std::set<Client*>::iterator it = _links.begin(); it != _links.end(); ++it)
+		{
+			if (!(*it)->isMeshLink())
+				links.push_back((*it)->getClientFd());
+		}
+		for (size_t i = 0; i < links.size(); ++i)
+			_disconnectClient(links[i]);
+		std::cout << PASTEL_YELLOW << "[SHUTDOWN] " << DEFAULT << "Drained: " << _drainClosed << " clients closed, "
+		          << _drainForced << " of them with output left at the deadline" << std::endl;
+		_isrunning = false;
+		return;
+	}
+
+	size_t batch = flushed.size();
+	if (!late)
+	{
+		size_t batchesLeft = (size_t)((_drainDeadline - now) * 1000 / _drainInterval) + 1;
+		batch = (remaining + batchesLeft - 1) / batchesLeft;
+		if (batch < (size_t)_drainBatch)
+			batch = _drainBatch;
+	}
+	size_t closed = 0;
+	for (size_t i = 0; i < flushed.size() && closed < batch; ++i)
+	{
+		Client* client = getClient(flushed[i]);
+		int unread = 0;
+		if (!late && ioctl(flushed[i], FIONREAD, &unread) == 0 && unread > 0) // input still on its way in
+			continue;
+		if (client->hasOutput())
+			++_drainForced;
+		if (!client->isInjector() && !client->isTlsHandshaking())
+			client->sendMessage("ERROR :Closing Link: " + client->getIpAddress() + " (Server shutting down)\r\n");
+		_disconnectClient(flushed[i]);
+		++_drainClosed;
+		++closed;
+	}
+	if (closed > 0)
+		std::cout << PASTEL_YELLOW << "[SHUTDOWN] " << DEFAULT << "Closed " << closed << " clients, "
+		          << remaining - closed << " left" << std::endl;
+}
@@ -0,0 +1,145 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// last OpenSSL error of this thread, for the logs
+static std::string tlsError()
+{
+	unsigned long code = ERR_get_error();
+	if (code == 0)
+		return (errno ? strerror(errno) : "connection closed");
+	char buffer[256];
+	ERR_error_string_n(code, buffer, sizeof(buffer));
+	return (buffer);
+}
+
+// TLS context for the listeners marked tls ("tls_port" or "listen = <address> tls"):
+// "tls_cert" (PEM chain) and "tls_key" (PEM) in the config
+// handshakes run inside the event loop, then record encryption moves to the kernel (kTLS) when it supports it
+void Server::_initTls()
+{
+	SSL_CTX* context = SSL_CTX_new(TLS_server_method());
+	if (!context)
+		throw std::runtime_error("SSL_CTX_new() failed: " + tlsError());
+	SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+	// kTLS is picked up by OpenSSL when the handshake ends, if the kernel has the tls module and knows the cipher
+	SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	// SSL_write retries come from our send buffer, which may have moved and grown since
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	std::string cert = _config.get("tls_cert");
+	std::string key = _config.get("tls_key", cert);
+	if (SSL_CTX_use_certificate_chain_file(context, cert.c_str()) != 1
+		|| SSL_CTX_use_PrivateKey_file(context, key.c_str(), SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(context) != 1)
+	{
+		std::string error = tlsError();
+		SSL_CTX_free(context);
+		throw std::runtime_error("Error: Cannot load tls_cert/tls_key: " + error);
+	}
+	_tlsContext = context;
+	std::cout << "   TLS certificate loaded (" << cert << ") " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// attach a server-side session to a client accepted on the TLS listener
+// nothing is sent yet: the handshake starts when the ClientHello arrives
+bool Server::_startTls(Client* client)
+{
+	SSL* tls = SSL_new(_tlsContext);
+	if (!tls || SSL_set_fd(tls, client->getClientFd()) != 1)
+	{
+		std::cerr << "[TLS] Cannot create a session for client [" << client->getClientFd() << "]: " << tlsError() << std::endl;
+		if (tls)
+			SSL_free(tls);
+		return (false);
+	}
+	SSL_set_accept_state(tls);
+	client->setTls(tls);
+	client->setTlsHandshaking(true);
+	return (true);
+}
+
+// drive a non-blocking handshake one step: OpenSSL tells whether it waits to read or to write
+void Server::_continueTlsHandshake(Client* client)
+{
+	SSL* tls = client->getTls();
+	int fd = client->getClientFd();
+
+	ERR_clear_error();
+	int ret = SSL_do_handshake(tls);
+	if (ret == 1)
+	{
+		client->setTlsHandshaking(false);
+		client->setKtlsSend(BIO_get_ktls_send(SSL_get_wbio(tls)));
+		std::cout << PASTEL_VIOLET << "[TLS] " << DEFAULT << "Client [" << fd << "] handshake done ("
+		          << SSL_get_version(tls) << ", " << SSL_get_cipher_name(tls) << ", kTLS send "
+		          << (client->isKtlsSend() ? "on" : "off") << ", kTLS recv "
+		          << (BIO_get_ktls_recv(SSL_get_rbio(tls)) ? "on" : "off") << ")" << std::endl;
+		_unsetPollOut(fd);
+		_readClientData(fd); // the client's first lines may have come with its last handshake flight
+		return;
+	}
+	int error = SSL_get_error(tls, ret);
+	if (error == SSL_ERROR_WANT_READ)
+		_unsetPollOut(fd);
+	else if (error == SSL_ERROR_WANT_WRITE)
+		_setPollOut(fd);
+	else
+	{
+		std::cerr << "[TLS] Handshake failed with client [" << fd << "]: " << tlsError() << std::endl;
+		_disconnectClient(fd);
+	}
+}
+
+// SSL_read with recv()'s return convention, so _readClientData keeps a single loop
+ssize_t Server::_recvTls(Client* client, char* buffer, size_t length)
+{
+	SSL* tls = client->getTls();
+
+	ERR_clear_error();
+	int ret = SSL_read(tls, buffer, length > INT_MAX ? INT_MAX : length);
+	if (ret > 0)
+		return (ret);
+	int error = SSL_get_error(tls, ret);
+	if (error == SSL_ERROR_ZERO_RETURN) // close_notify or EOF
+		return (0);
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+		errno = EAGAIN;
+	else if (error != SSL_ERROR_SYSCALL || errno == 0)
+	{
+		std::cerr << "[TLS] SSL_read() failed on client [" << client->getClientFd() << "]: " << tlsError() << std::endl;
+		errno = EPROTO;
+	}
+	return (-1);
+}
+
+// with kTLS the kernel builds the records, so the plain send() path (and its batching) is kept
+// otherwise SSL_write encrypts in user space, with send()'s return convention
+ssize_t Server::_sendTls(Client* client, const std::string& data)
+{
+	if (client->isKtlsSend())
+		return (send(client->getClientFd(), data.c_str(), data.length(), 0));
+
+	SSL* tls = client->getTls();
+	ERR_clear_error();
+	int ret = SSL_write(tls, data.c_str(), data.length() > INT_MAX ? INT_MAX : data.length());
+	if (ret > 0)
+		return (ret);
+	int error = SSL_get_error(tls, ret);
+	if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)
+		errno = EAGAIN;
+	else if (error != SSL_ERROR_SYSCALL || errno == 0)
+	{
+		std::cerr << "[TLS] SSL_write() failed on client [" << client->getClientFd() << "]: " << tlsError() << std::endl;
+		errno = EPROTO;
+	}
+	return (-1);
+}
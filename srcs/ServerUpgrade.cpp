@@ -0,0 +1,495 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Snapshot.hpp"
+#include "ThreadPool.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define UPGRADE_FDS_PER_MSG	250	// fds passed per sendmsg() (kernel limit is SCM_MAX_FD = 253)
+
+// client flags stored in the handoff state
+#define UPG_AUTHENTICATED	0x01
+#define UPG_PASSWORD_GIVEN	0x02
+#define UPG_REGISTERED		0x04
+#define UPG_CAP_NEGOTIATING	0x08
+
+// read or write exactly size bytes on a blocking socket
+static bool writeAll(int fd, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = write(fd, data, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (false);
+		data += n;
+		size -= n;
+	}
+	return (true);
+}
+
+static bool readAll(int fd, char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = read(fd, data, size);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (false);
+		data += n;
+		size -= n;
+	}
+	return (true);
+}
+
+// SIGUSR2: start the new binary, pass it every socket and the whole state, then step aside
+void Server::_performUpgrade()
+{
+	_threadPool->wait(); // pending password checks resolve before the state is captured
+	_capture.flush(); // the new process appends to the capture file after our records
+	std::cout << PASTEL_YELLOW << "[UPGRADE] " << DEFAULT << "Handing off " << _clients.size()
+	          << " clients and " << _channels.size() << " channels to a new process..." << std::endl;
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+	{
+		std::cerr << "[UPGRADE] socketpair() failed: " << strerror(errno) << std::endl;
+		return;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		std::cerr << "[UPGRADE] fork() failed: " << strerror(errno) << std::endl;
+		close(pair[0]);
+		close(pair[1]);
+		return;
+	}
+	if (pid == 0)
+	{
+		// the new process only receives the sockets over the unix socket
+		close(pair[0]);
+		for (size_t i = 0; i < _listeners.size(); ++i)
+			close(_listeners[i].fd);
+		for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+			close(it->first);
+
+		std::stringstream fdStr, portStr;
+		fdStr << pair[1];
+		portStr << _port;
+		setenv(UPGRADE_ENV, fdStr.str().c_str(), 1);
+		std::string path = _executablePath.empty() ? "/proc/self/exe" : _executablePath;
+		std::string port = portStr.str();
+		char* args[] = { (char*)path.c_str(), (char*)port.c_str(), (char*)_password.c_str(),
+			_config.getPath().empty() ? NULL : (char*)_config.getPath().c_str(), NULL };
+		execv(path.c_str(), args);
+		std::cerr << "[UPGRADE] execv(" << path << ") failed: " << strerror(errno) << std::endl;
+		_exit(1);
+	}
+	close(pair[1]);
+
+	std::vector<int> fds;
+	std::string state = _serializeState(fds);
+	bool ok = _sendHandoff(pair[0], state, fds);
+
+	// wait for the new process to confirm it owns the sockets
+	char ack = 0;
+	if (ok)
+	{
+		struct pollfd pfd;
+		pfd.fd = pair[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ok = (poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1 && read(pair[0], &ack, 1) == 1 && ack == 'K');
+	}
+	close(pair[0]);
+
+	if (!ok)
+	{
+		std::cerr << "[UPGRADE] Handoff failed, keeping the current process" << std::endl;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	std::cout << PASTEL_YELLOW << "[UPGRADE] " << DEFAULT << "New process (pid " << pid
+	          << ") took over, exiting " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+	_handedOff = true;
+	_isrunning = false;
+}
+
+// server links are not handed over: they drop with the old process and the new one reconnects, and so do
+// the remote clients behind them; neither are TLS clients: their session state lives in this process's
+// OpenSSL, they reconnect too (and so do injection sockets, with their subscriptions)
+static bool isHandedOver(const Client* client)
+{
+	return (!client->isRemote() && !client->isServerLink() && !client->isLinkOutbound() && !client->getTls()
+		&& !client->isInjector());
+}
+
+// the handed-over members of a channel see the others leave: one QUIT per client that stays behind and
+// shares a channel with them, queued in the output the new process gets (this one keeps its state, in
+// case the handoff fails)
+static std::map<Client*, std::string> upgradeQuits(const std::set<Channel*>& channels)
+{
+	std::map<Client*, std::set<Client*> > gone;
+	for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+	{
+		const std::set<Client*>& members = (*it)->getMembers();
+		for (std::set<Client*>::const_iterator left = members.begin(); left != members.end(); ++left)
+		{
+			if (isHandedOver(*left))
+				continue;
+			for (std::set<Client*>::const_iterator m = members.begin(); m != members.end(); ++m)
+			{
+				if (isHandedOver(*m) && (!(*it)->getMode('u') || (*it)->isOperator(*m)))
+					gone[*m].insert(*left);
+			}
+		}
+	}
+	std::map<Client*, std::string> quits;
+	for (std::map<Client*, std::set<Client*> >::iterator it = gone.begin(); it != gone.end(); ++it)
+	{
+		for (std::set<Client*>::iterator left = it->second.begin(); left != it->second.end(); ++left)
+			quits[it->first] += (*left)->getPrefix() + " QUIT :Server upgrade\r\n";
+	}
+	return (quits);
+}
+
+// encode clients, channels, memberships and history; fds receives the sockets in the same order
+std::string Server::_serializeState(std::vector<int>& fds) const
+{
+	SnapshotWriter out;
+	std::map<Client*, uint32_t> clientIndex;
+	std::map<Client*, std::string> quits = upgradeQuits(_channels);
+
+	out.putRaw(UPGRADE_MAGIC, 8);
+	out.putU64(_nextMsgId);
+
+	uint32_t localCount = 0;
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		if (isHandedOver(it->second))
+			++localCount;
+	}
+
+	// listeners come first, named by their configuration so the new process can match them
+	out.putU32(_listeners.size());
+	for (size_t i = 0; i < _listeners.size(); ++i)
+	{
+		out.putString(_listenerKey(_listeners[i]));
+		fds.push_back(_listeners[i].fd);
+	}
+	out.putU32(localCount);
+	for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it)
+	{
+		Client* client = it->second;
+		if (!isHandedOver(client))
+			continue;
+		uint32_t index = clientIndex.size();
+		clientIndex[client] = index;
+		fds.push_back(it->first);
+
+		uint8_t flags = 0;
+		if (client->isAuthenticated()) flags |= UPG_AUTHENTICATED;
+		if (client->isPasswordGiven()) flags |= UPG_PASSWORD_GIVEN;
+		if (client->isRegistered()) flags |= UPG_REGISTERED;
+		if (client->isCapNegotiating()) flags |= UPG_CAP_NEGOTIATING;
+
+		out.putString(client->getIpAddress());
+		out.putI32(client->getPort());
+		out.putString(client->getNickname());
+		out.putString(client->getUsername());
+		out.putString(client->getRealname());
+		out.putString(client->getHostname());
+		out.putString(client->getAccount());
+		out.putString(client->getConnectionClass() ? client->getConnectionClass()->name : DEFAULT_CONNECTION_CLASS);
+		out.putU8(flags);
+		const std::set<std::string>& caps = client->getCapabilities();
+		out.putU32(caps.size());
+		for (std::set<std::string>::const_iterator cap = caps.begin(); cap != caps.end(); ++cap)
+			out.putString(*cap);
+		out.putString(client->getReceiveBuffer());
+		std::map<Client*, std::string>::iterator quit = quits.find(client);
+		out.putString(quit == quits.end() ? client->getSendBuffer() : client->getSendBuffer() + quit->second);
+	}
+
+	out.putU32(_channels.size());
+	for (std::set<Channel*>::const_iterator it = _channels.begin(); it != _channels.end(); ++it)
+	{
+		Channel* channel = *it;
+		Snapshot::writeChannel(out, *channel);
+
+		const std::set<Client*>& members = channel->getMembers();
+		uint32_t localMembers = 0;
+		for (std::set<Client*>::const_iterator m = members.begin(); m != members.end(); ++m)
+		{
+			if (clientIndex.count(*m))
+				++localMembers;
+		}
+		out.putU32(localMembers);
+		for (std::set<Client*>::const_iterator m = members.begin(); m != members.end(); ++m)
+		{
+			if (!clientIndex.count(*m)) // remote or TLS member
+				continue;
+			out.putU32(clientIndex.find(*m)->second);
+			out.putU8(channel->isOperator(*m) ? 1 : 0);
+		}
+
+		const std::deque<HistoryEntry>& history = channel->getHistory();
+		out.putU32(history.size());
+		for (std::deque<HistoryEntry>::const_iterator h = history.begin(); h != history.end(); ++h)
+		{
+			out.putU64(h->msgid);
+			out.putU64(h->time);
+			out.putString(h->line);
+		}
+	}
+	return (out.data());
+}
+
+// wire format: [u32 fd count][u32 state length][state], then the fds in SCM_RIGHTS batches
+bool Server::_sendHandoff(int sock, const std::string& state, const std::vector<int>& fds)
+{
+	struct timeval timeout;
+	timeout.tv_sec = UPGRADE_TIMEOUT_MS / 1000;
+	timeout.tv_usec = 0;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	uint32_t header[2];
+	header[0] = fds.size();
+	header[1] = state.length();
+	if (!writeAll(sock, (const char*)header, sizeof(header)) || !writeAll(sock, state.c_str(), state.length()))
+	{
+		std::cerr << "[UPGRADE] Failed to send state: " << strerror(errno) << std::endl;
+		return (false);
+	}
+
+	for (size_t sent = 0; sent < fds.size(); sent += UPGRADE_FDS_PER_MSG)
+	{
+		size_t count = std::min((size_t)UPGRADE_FDS_PER_MSG, fds.size() - sent);
+		char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+		std::memset(control, 0, sizeof(control));
+		char byte = 'F';
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fds[sent], count * sizeof(int));
+		if (sendmsg(sock, &msg, 0) != 1)
+		{
+			std::cerr << "[UPGRADE] sendmsg() failed: " << strerror(errno) << std::endl;
+			return (false);
+		}
+	}
+	return (true);
+}
+
+// new process side: receive the state and the sockets from the old process
+void Server::_resumeFromUpgrade(int sock)
+{
+	std::cout << PASTEL_YELLOW << "[UPGRADE] " << DEFAULT << "Resuming from a running server..." << std::endl;
+
+	uint32_t header[2];
+	if (!readAll(sock, (char*)header, sizeof(header)))
+		throw std::runtime_error("upgrade: failed to read handoff header");
+	std::string state(header[1], '\0');
+	if (header[1] > 0 && !readAll(sock, &state[0], header[1]))
+		throw std::runtime_error("upgrade: failed to read handoff state");
+
+	std::vector<int> fds;
+	while (fds.size() < header[0])
+	{
+		char control[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+		char byte;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t n = recvmsg(sock, &msg, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n != 1)
+			throw std::runtime_error("upgrade: failed to receive sockets");
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int* received = (const int*)CMSG_DATA(cmsg);
+			fds.insert(fds.end(), received, received + count);
+		}
+	}
+
+	_restoreState(state, fds);
+	_upgradeSock = sock; // acknowledged once the whole constructor went through
+}
+
+// the old process exits on this byte: anything that can still throw (listeners, password hash, accounts)
+// has run by now, so a failing new process leaves the clients with the old one
+void Server::_acknowledgeUpgrade()
+{
+	char ack = 'K';
+	bool sent = (write(_upgradeSock, &ack, 1) == 1);
+	close(_upgradeSock);
+	_upgradeSock = -1;
+	if (!sent)
+		throw std::runtime_error("upgrade: failed to acknowledge handoff");
+	std::cout << PASTEL_YELLOW << "[UPGRADE] " << DEFAULT << "Took over " << _clients.size() << " clients and "
+	          << _channels.size() << " channels " << PASTEL_GREEN << "✓" << DEFAULT << std::endl;
+}
+
+// rebuild clients, channels and the poll set from a handoff state
+void Server::_restoreState(const std::string& state, const std::vector<int>& fds)
+{
+	SnapshotReader in(state.c_str(), state.length());
+	char magic[8];
+	uint64_t nextMsgId;
+	uint32_t listenerCount;
+	uint32_t clientCount;
+	if (!in.getRaw(magic, 8) || std::memcmp(magic, UPGRADE_MAGIC, 8) != 0
+		|| !in.getU64(nextMsgId) || !in.getU32(listenerCount) || listenerCount > fds.size())
+		throw std::runtime_error("upgrade: invalid handoff state");
+	_nextMsgId = nextMsgId;
+	for (uint32_t i = 0; i < listenerCount; ++i) // claimed by _initSocket() if the configuration still has them
+	{
+		std::string key;
+		if (!in.getString(key))
+			throw std::runtime_error("upgrade: truncated listener state");
+		_inheritedListeners[key] = fds[i];
+	}
+	if (!in.getU32(clientCount) || fds.size() != listenerCount + clientCount)
+		throw std::runtime_error("upgrade: invalid handoff state");
+
+	std::vector<Client*> clients;
+	for (uint32_t i = 0; i < clientCount; ++i)
+	{
+		std::string ip, nick, user, real, host, account, className, recvBuffer, sendBuffer;
+		int32_t port;
+		uint8_t flags;
+		uint32_t capCount;
+		if (!in.getString(ip) || !in.getI32(port) || !in.getString(nick) || !in.getString(user)
+			|| !in.getString(real) || !in.getString(host) || !in.getString(account) || !in.getString(className) || !in.getU8(flags)
+			|| !in.getU32(capCount))
+			throw std::runtime_error("upgrade: truncated client state");
+
+		int fd = fds[listenerCount + i];
+		Client* client = new Client(fd, ip, port);
+		_clients[fd] = client;
+		clients.push_back(client);
+		setNick(client, nick);
+		client->setUsername(user);
+		client->setRealname(real);
+		client->setHostname(host);
+		client->setAccount(account);
+		// a class the new configuration dropped: the client moves to the default one
+		ConnectionClass* connectionClass = _classes.count(className) ? _classes[className] : _getClass(DEFAULT_CONNECTION_CLASS);
+		client->setHostKey(ConnectionLimiter::keyOf(ip));
+		client->setConnectionClass(connectionClass);
+		++connectionClass->clients;
+		if (client->getHostKey().isSet())
+			connectionClass->limiter.track(client->getHostKey());
+		client->setAuthenticated(flags & UPG_AUTHENTICATED);
+		client->setPasswordGiven(flags & UPG_PASSWORD_GIVEN);
+		client->setRegistered(flags & UPG_REGISTERED);
+		client->setCapNegotiating(flags & UPG_CAP_NEGOTIATING);
+		for (uint32_t c = 0; c < capCount; ++c)
+		{
+			std::string cap;
+			if (!in.getString(cap))
+				throw std::runtime_error("upgrade: truncated client state");
+			client->setCapability(cap, true);
+		}
+		if (!in.getString(recvBuffer) || !in.getString(sendBuffer))
+			throw std::runtime_error("upgrade: truncated client state");
+		client->appendToReceiveBuffer(recvBuffer.c_str(), recvBuffer.length());
+		if (client->hasCommand()) // the old process had not got to them yet: they run on the first iteration
+		{
+			client->setReadyQueued(true);
+			_readyClients.push_back(client->getHandle());
+		}
+		if (!sendBuffer.empty())
+			client->appendToSendBuffer(sendBuffer);
+
+		_addPollFd(fd, POLLIN | (sendBuffer.empty() ? 0 : POLLOUT));
+	}
+
+	uint32_t channelCount;
+	if (!in.getU32(channelCount))
+		throw std::runtime_error("upgrade: truncated channel state");
+	std::vector<std::pair<unsigned long, std::string> > historyOrder;
+	for (uint32_t i = 0; i < channelCount; ++i)
+	{
+		Channel* channel = Snapshot::readChannel(in);
+		if (!channel)
+			throw std::runtime_error("upgrade: truncated channel state");
+		// an older process kept "#Foo" and "#foo" apart: the members of the second join the first
+		Channel* target = _addChannel(channel) ? channel : getChannel(channel->getName());
+
+		uint32_t memberCount;
+		if (!in.getU32(memberCount))
+			throw std::runtime_error("upgrade: truncated channel state");
+		for (uint32_t m = 0; m < memberCount; ++m)
+		{
+			uint32_t index;
+			uint8_t isOperator;
+			if (!in.getU32(index) || !in.getU8(isOperator) || index >= clients.size())
+				throw std::runtime_error("upgrade: invalid channel member");
+			target->restoreMember(clients[index], isOperator);
+			clients[index]->joinChannel(target);
+		}
+		// the live operators came back as members above, the rest is a snapshot's and goes with its grace
+		target->clearFormerOperators();
+
+		uint32_t historyCount;
+		if (!in.getU32(historyCount))
+			throw std::runtime_error("upgrade: truncated channel history");
+		for (uint32_t h = 0; h < historyCount; ++h)
+		{
+			uint64_t msgid, time;
+			HistoryEntry entry;
+			if (!in.getU64(msgid) || !in.getU64(time) || !in.getString(entry.line))
+				throw std::runtime_error("upgrade: truncated channel history");
+			entry.msgid = msgid;
+			entry.time = time;
+			if (target != channel)
+				continue;
+			channel->addHistory(entry);
+			_historyBytes += Channel::historyEntrySize(entry);
+			++_historyEntries;
+			historyOrder.push_back(std::make_pair(entry.msgid, channel->getName()));
+		}
+		if (target != channel)
+			delete channel;
+	}
+
+	// global eviction order is by msgid across channels
+	std::sort(historyOrder.begin(), historyOrder.end());
+	for (size_t i = 0; i < historyOrder.size(); ++i)
+		_historyOrder.push_back(std::make_pair(historyOrder[i].second, historyOrder[i].first));
+}
@@ -0,0 +1,200 @@
+#include "Server.hpp"
+#include "Client.hpp"
+#include "CommandHandler.hpp"
+#include "Mesh.hpp"
+#include "Colors.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// fork the extra workers of a multi-process server ("workers = n" in the config)
+// workers share the listening socket and see each other as server links whose transport is a shared-memory ring
+void Server::_startWorkers()
+{
+	int workers = _config.getInt("workers", 1);
+	if (workers <= 1)
+		return;
+	if (workers > MESH_MAX_WORKERS)
+		workers = MESH_MAX_WORKERS;
+
+	_mesh = Mesh::create(workers);
+	if (!_mesh)
+	{
+		std::cerr << "[WORKER] mmap() failed: " << strerror(errno) << ", running a single process" << std::endl;
+		return;
+	}
+	// one wakeup pipe per worker: a peer writes a byte to it after pushing into one of its rings
+	std::vector<int> readEnds(workers, -1);
+	std::vector<int> writeEnds(workers, -1);
+	for (int k = 0; k < workers; ++k)
+	{
+		int fds[2];
+		if (pipe(fds) == -1)
+		{
+			std::cerr << "[WORKER] pipe() failed: " << strerror(errno) << ", running a single process" << std::endl;
+			for (int j = 0; j < k; ++j)
+			{
+				close(readEnds[j]);
+				close(writeEnds[j]);
+			}
+			Mesh::destroy(_mesh, workers);
+			_mesh = NULL;
+			return;
+		}
+		readEnds[k] = fds[0];
+		writeEnds[k] = fds[1];
+		_setNonBlocking(fds[0]);
+		_setNonBlocking(fds[1]);
+	}
+
+	_workerCount = workers;
+	for (int k = 1; k < workers; ++k)
+	{
+		pid_t pid = fork();
+		if (pid == -1)
+		{
+			std::cerr << "[WORKER] fork() failed: " << strerror(errno) << std::endl;
+			continue; // its peers see a closed pipe and drop the link
+		}
+		if (pid == 0)
+		{
+			_workerId = k;
+			_workerPids.clear();
+			break;
+		}
+		_workerPids.push_back(pid);
+	}
+
+	// keep our own read end (and write end, so poll never reports a hangup on it) and the peers' write ends
+	for (int k = 0; k < workers; ++k)
+	{
+		if (k == _workerId)
+			continue;
+		close(readEnds[k]);
+		_addMeshLink(k, writeEnds[k]);
+	}
+	_meshNotifyFd = readEnds[_workerId];
+	_addPollFd(_meshNotifyFd, POLLIN);
+
+	if (_workerId != 0) // outgoing links and snapshots are worker 0's job
+		_linkConnects.clear();
+	std::cout << PASTEL_YELLOW << "[WORKER] " << DEFAULT << "Worker " << _workerId << "/" << _workerCount
+			  << " running (pid " << getpid() << ")" << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
+}
+
+void Server::_addMeshLink(int worker, int wakeFd)
+{
+	std::stringstream name;
+	name << "worker" << worker;
+
+	Client* link = new Client(wakeFd, "127.0.0.1", 0);
+	link->setMeshPeer(worker);
+	link->setServerLink(name.str());
+	_links.insert(link);
+	_clients[wakeFd] = link;
+
+	// nothing to poll for until there is output, POLLERR reports a dead worker
+	_addPollFd(wakeFd, 0);
+}
+
+// push a mesh link's pending output into its ring, returns the bytes written like send() would
+ssize_t Server::_writeMesh(Client* link, const std::string& data)
+{
+	MeshRing* ring = Mesh::ring(_mesh, _workerCount, _workerId, link->getMeshPeer());
+	size_t written = ring->push(data.c_str(), data.length());
+	if (written < data.length())
+	{
+		// ask for a wakeup, then retry once in case the peer drained the ring in between
+		ring->producerWaiting = 1;
+		__sync_synchronize();
+		written += ring->push(data.c_str() + written, data.length() - written);
+	}
+	if (written == 0)
+	{
+		errno = EAGAIN;
+		return (-1);
+	}
+	if (write(link->getClientFd(), "m", 1) == -1 && errno != EAGAIN) // a full pipe already holds a wakeup
+		return (-1);
+	return (written);
+}
+
+// our wakeup pipe is readable: process the lines waiting in every inbound ring
+void Server::_drainMesh()
+{
+	char buffer[65536];
+	while (read(_meshNotifyFd, buffer, sizeof(buffer)) > 0)
+		;
+
+	std::vector<Client*> meshLinks;
+	for (std::set<Client*>::iterator it = _links.begin(); it != _links.end(); ++it)
+	{
+		if ((*it)->isMeshLink())
+			meshLinks.push_back(*it);
+	}
+	for (size_t i = 0; i < meshLinks.size(); ++i)
+	{
+		Client* link = meshLinks[i];
+		int fd = link->getClientFd();
+		if (link->getState() != CLIENT_OPEN)
+			continue;
+		MeshRing* ring = Mesh::ring(_mesh, _workerCount, link->getMeshPeer(), _workerId);
+
+		size_t bytes;
+		bool dropped = false;
+		while (!dropped && (bytes = ring->pop(buffer, sizeof(buffer))) > 0)
+		{
+			link->appendToReceiveBuffer(buffer, bytes);
+			std::string command;
+			while (link->extractCommand(command))
+			{
+				_commandHandler->processCommand(link, command);
+				if (link->getState() != CLIENT_OPEN)
+				{
+					dropped = true;
+					break;
+				}
+			}
+		}
+		if (dropped)
+			continue;
+
+		__sync_synchronize(); // our tail is published before the flag is read
+		if (ring->producerWaiting)
+		{
+			ring->producerWaiting = 0;
+			if (write(fd, "w", 1) == -1 && errno != EAGAIN)
+				std::cerr << "[WORKER] wakeup of worker " << link->getMeshPeer() << " failed: " << strerror(errno) << std::endl;
+		}
+		// a wakeup may also mean our own ring towards this peer has room again
+		if (link->hasOutput())
+			_setPollOut(fd);
+	}
+}
+
+// worker 0 notices workers that exited (their links drop on their own through POLLERR)
+void Server::_reapWorkers(bool wait)
+{
+	for (std::vector<pid_t>::iterator it = _workerPids.begin(); it != _workerPids.end(); )
+	{
+		int status;
+		if (waitpid(*it, &status, wait ? 0 : WNOHANG) == *it)
+		{
+			std::cerr << "[WORKER] Worker process " << *it << " exited" << std::endl;
+			it = _workerPids.erase(it);
+		}
+		else
+			++it;
+	}
+}
+
+void Server::_stopWorkers()
+{
+	for (size_t i = 0; !_draining && i < _workerPids.size(); ++i) // a drain signalled them already
+		kill(_workerPids[i], SIGTERM);
+	_reapWorkers(true);
+}
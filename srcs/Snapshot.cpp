@@ -0,0 +1,262 @@
+#include "Snapshot.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "NameTable.hpp"
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// mode bits stored in a snapshot
+#define SNAP_MODE_I	0x01
+#define SNAP_MODE_T	0x02
+#define SNAP_MODE_K	0x04
+#define SNAP_MODE_L	0x08
+#define SNAP_MODE_U	0x10
+
+void SnapshotWriter::putU8(uint8_t value)
+{
+	_data.append(1, (char)value);
+}
+
+void SnapshotWriter::putU32(uint32_t value)
+{
+	_data.append((const char*)&value, sizeof(value));
+}
+
+void SnapshotWriter::putI32(int32_t value)
+{
+	_data.append((const char*)&value, sizeof(value));
+}
+
+void SnapshotWriter::putU64(uint64_t value)
+{
+	_data.append((const char*)&value, sizeof(value));
+}
+
+void SnapshotWriter::putString(const std::string& value)
+{
+	putU32(value.length());
+	_data.append(value);
+}
+
+void SnapshotWriter::putRaw(const char* data, size_t size)
+{
+	_data.append(data, size);
+}
+
+const std::string& SnapshotWriter::data() const
+{
+	return (_data);
+}
+
+SnapshotReader::SnapshotReader(const char* data, size_t size)
+	: _pos(data), _end(data + size)
+{
+}
+
+bool SnapshotReader::getU8(uint8_t& value)
+{
+	return (getRaw((char*)&value, sizeof(value)));
+}
+
+bool SnapshotReader::getU32(uint32_t& value)
+{
+	return (getRaw((char*)&value, sizeof(value)));
+}
+
+bool SnapshotReader::getI32(int32_t& value)
+{
+	return (getRaw((char*)&value, sizeof(value)));
+}
+
+bool SnapshotReader::getU64(uint64_t& value)
+{
+	return (getRaw((char*)&value, sizeof(value)));
+}
+
+bool SnapshotReader::getString(std::string& value)
+{
+	uint32_t len;
+	if (!getU32(len) || (size_t)(_end - _pos) < len)
+		return (false);
+	value.assign(_pos, len);
+	_pos += len;
+	return (true);
+}
+
+bool SnapshotReader::getRaw(char* data, size_t size)
+{
+	if ((size_t)(_end - _pos) < size)
+		return (false);
+	std::memcpy(data, _pos, size);
+	_pos += size;
+	return (true);
+}
+
+bool SnapshotReader::atEnd() const
+{
+	return (_pos == _end);
+}
+
+void Snapshot::writeChannel(SnapshotWriter& out, const Channel& channel)
+{
+	uint8_t modes = 0;
+	if (channel.getMode('i')) modes |= SNAP_MODE_I;
+	if (channel.getMode('t')) modes |= SNAP_MODE_T;
+	if (channel.getMode('k')) modes |= SNAP_MODE_K;
+	if (channel.getMode('l')) modes |= SNAP_MODE_L;
+	if (channel.getMode('u')) modes |= SNAP_MODE_U;
+
+	out.putString(channel.getName());
+	out.putString(channel.getTopic());
+	out.putString(channel.getKey());
+	out.putI32(channel.getLimit());
+	out.putU8(modes);
+	const std::set<std::string>& invited = channel.getInvited();
+	out.putU32(invited.size());
+	for (std::set<std::string>::const_iterator it = invited.begin(); it != invited.end(); ++it)
+		out.putString(*it);
+
+	// the operators by nick, and those of a restored channel that have not rejoined yet
+	std::set<std::string> operators = channel.getFormerOperators();
+	const std::set<Client*>& current = channel.getOperators();
+	for (std::set<Client*>::const_iterator it = current.begin(); it != current.end(); ++it)
+		operators.insert(foldName((*it)->getNickname()));
+	out.putU32(operators.size());
+	for (std::set<std::string>::const_iterator it = operators.begin(); it != operators.end(); ++it)
+		out.putString(*it);
+}
+
+Channel* Snapshot::readChannel(SnapshotReader& in, bool withOperators)
+{
+	std::string name, topic, key;
+	int32_t limit;
+	uint8_t modes;
+	uint32_t invitedCount;
+	if (!in.getString(name) || !in.getString(topic) || !in.getString(key)
+		|| !in.getI32(limit) || !in.getU8(modes) || !in.getU32(invitedCount))
+		return (NULL);
+
+	Channel* channel = new Channel(name);
+	channel->setTopic(topic, NULL);
+	channel->setMode('i', modes & SNAP_MODE_I);
+	channel->setMode('t', modes & SNAP_MODE_T);
+	channel->setMode('u', modes & SNAP_MODE_U);
+	if (modes & SNAP_MODE_K)
+		channel->setKey(key);
+	if (modes & SNAP_MODE_L)
+		channel->setLimit(limit);
+	for (uint32_t i = 0; i < invitedCount; ++i)
+	{
+		std::string nick;
+		if (!in.getString(nick))
+		{
+			delete channel;
+			return (NULL);
+		}
+		channel->addInvite(nick);
+	}
+	uint32_t operatorCount = 0;
+	if (withOperators && !in.getU32(operatorCount))
+	{
+		delete channel;
+		return (NULL);
+	}
+	for (uint32_t i = 0; i < operatorCount; ++i)
+	{
+		std::string nick;
+		if (!in.getString(nick))
+		{
+			delete channel;
+			return (NULL);
+		}
+		channel->addFormerOperator(nick);
+	}
+	return (channel);
+}
+
+bool Snapshot::save(const std::string& path, const std::set<Channel*>& channels)
+{
+	SnapshotWriter out;
+	out.putRaw(SNAPSHOT_MAGIC, 8);
+	out.putU32(channels.size());
+	for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+		writeChannel(out, **it);
+
+	std::string tmpPath = path + ".tmp";
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+	{
+		std::cerr << "Snapshot: open(" << tmpPath << ") failed: " << strerror(errno) << std::endl;
+		return (false);
+	}
+	const std::string& data = out.data();
+	size_t written = 0;
+	while (written < data.length())
+	{
+		ssize_t n = write(fd, data.c_str() + written, data.length() - written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			std::cerr << "Snapshot: write() failed: " << strerror(errno) << std::endl;
+			close(fd);
+			unlink(tmpPath.c_str());
+			return (false);
+		}
+		written += n;
+	}
+	fsync(fd);
+	close(fd);
+	if (rename(tmpPath.c_str(), path.c_str()) == -1)
+	{
+		std::cerr << "Snapshot: rename() failed: " << strerror(errno) << std::endl;
+		unlink(tmpPath.c_str());
+		return (false);
+	}
+	return (true);
+}
+
+long Snapshot::load(const std::string& path, std::vector<Channel*>& channels)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT ? 0 : -1);
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < 12)
+	{
+		close(fd);
+		return (-1);
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	SnapshotReader in((const char*)map, st.st_size);
+	char magic[8];
+	uint32_t count = 0;
+	long restored = 0;
+	bool current = false;
+	if (in.getRaw(magic, 8) && ((current = std::memcmp(magic, SNAPSHOT_MAGIC, 8) == 0)
+		|| std::memcmp(magic, SNAPSHOT_MAGIC_V1, 8) == 0) && in.getU32(count))
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			Channel* channel = readChannel(in, current);
+			if (!channel)
+				break;
+			channels.push_back(channel);
+			++restored;
+		}
+	}
+	else
+		restored = -1;
+	munmap(map, st.st_size);
+	return (restored);
+}
@@ -0,0 +1,197 @@
+#include "ThreadPool.hpp"
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+
+ThreadPool::ThreadPool(size_t threads)
+	: _nextWorker(0), _queued(0), _outstanding(0), _stopping(false)
+{
+	if (pipe(_notifyPipe) == -1)
+		throw std::runtime_error(std::string("pipe() failed: ") + strerror(errno));
+	fcntl(_notifyPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(_notifyPipe[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&_stateLock, NULL);
+	pthread_cond_init(&_wakeCond, NULL);
+	pthread_cond_init(&_idleCond, NULL);
+	pthread_mutex_init(&_doneLock, NULL);
+
+	if (threads == 0)
+		threads = 1;
+	for (size_t i = 0; i < threads; ++i)
+	{
+		Worker* worker = new Worker;
+		worker->pool = this;
+		worker->index = i;
+		pthread_mutex_init(&worker->lock, NULL);
+		_workers.push_back(worker);
+	}
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		if (pthread_create(&_workers[i]->thread, NULL, &ThreadPool::_threadMain, _workers[i]) != 0)
+			throw std::runtime_error("pthread_create() failed");
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&_stateLock);
+	_stopping = true;
+	pthread_cond_broadcast(&_wakeCond);
+	pthread_mutex_unlock(&_stateLock);
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		pthread_join(_workers[i]->thread, NULL);
+		for (std::deque<Task*>::iterator it = _workers[i]->tasks.begin(); it != _workers[i]->tasks.end(); ++it)
+			delete *it;
+		pthread_mutex_destroy(&_workers[i]->lock);
+		delete _workers[i];
+	}
+	for (size_t i = 0; i < _done.size(); ++i)
+		delete _done[i];
+	pthread_mutex_destroy(&_doneLock);
+	pthread_cond_destroy(&_idleCond);
+	pthread_cond_destroy(&_wakeCond);
+	pthread_mutex_destroy(&_stateLock);
+	close(_notifyPipe[0]);
+	close(_notifyPipe[1]);
+}
+
+void ThreadPool::submit(Task* task)
+{
+	Worker* worker = _workers[_nextWorker];
+	_nextWorker = (_nextWorker + 1) % _workers.size();
+
+	pthread_mutex_lock(&worker->lock);
+	worker->tasks.push_back(task);
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&_stateLock);
+	++_queued;
+	++_outstanding;
+	pthread_cond_signal(&_wakeCond);
+	pthread_mutex_unlock(&_stateLock);
+}
+
+// own deque first (oldest task), then steal the newest task of another thread
+Task* ThreadPool::_take(size_t self)
+{
+	Task* task = NULL;
+	for (size_t n = 0; n < _workers.size() && !task; ++n)
+	{
+		Worker* victim = _workers[(self + n) % _workers.size()];
+		pthread_mutex_lock(&victim->lock);
+		if (!victim->tasks.empty())
+		{
+			if (n == 0)
+			{
+				task = victim->tasks.front();
+				victim->tasks.pop_front();
+			}
+			else
+			{
+				task = victim->tasks.back();
+				victim->tasks.pop_back();
+			}
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	if (task)
+	{
+		pthread_mutex_lock(&_stateLock);
+		--_queued;
+		pthread_mutex_unlock(&_stateLock);
+	}
+	return (task);
+}
+
+// hand a finished task to the event loop and wake it up
+void ThreadPool::_finish(Task* task)
+{
+	pthread_mutex_lock(&_doneLock);
+	_done.push_back(task);
+	pthread_mutex_unlock(&_doneLock);
+	ssize_t n = write(_notifyPipe[1], "d", 1); // a full pipe already holds a wakeup
+	(void)n;
+
+	pthread_mutex_lock(&_stateLock);
+	if (--_outstanding == 0)
+		pthread_cond_broadcast(&_idleCond);
+	pthread_mutex_unlock(&_stateLock);
+}
+
+void* ThreadPool::_threadMain(void* arg)
+{
+	Worker* self = static_cast<Worker*>(arg);
+	ThreadPool* pool = self->pool;
+	while (true)
+	{
+		pthread_mutex_lock(&pool->_stateLock);
+		bool stopping = pool->_stopping;
+		pthread_mutex_unlock(&pool->_stateLock);
+		if (stopping) // queued tasks are dropped, the destructor deletes them
+			break;
+		Task* task = pool->_take(self->index);
+		if (task)
+		{
+			task->run();
+			pool->_finish(task);
+			continue;
+		}
+		pthread_mutex_lock(&pool->_stateLock);
+		while (pool->_queued == 0 && !pool->_stopping)
+			pthread_cond_wait(&pool->_wakeCond, &pool->_stateLock);
+		bool stop = pool->_stopping;
+		pthread_mutex_unlock(&pool->_stateLock);
+		if (stop)
+			break;
+	}
+	return (NULL);
+}
+
+int ThreadPool::getNotifyFd() const
+{
+	return (_notifyPipe[0]);
+}
+
+// run complete() of the finished tasks, in the order they finished
+size_t ThreadPool::runCompletions()
+{
+	char buffer[256];
+	while (read(_notifyPipe[0], buffer, sizeof(buffer)) > 0)
+		;
+	std::vector<Task*> done;
+	pthread_mutex_lock(&_doneLock);
+	done.swap(_done);
+	pthread_mutex_unlock(&_doneLock);
+	for (size_t i = 0; i < done.size(); ++i)
+	{
+		done[i]->complete();
+		delete done[i];
+	}
+	return (done.size());
+}
+
+void ThreadPool::wait()
+{
+	pthread_mutex_lock(&_stateLock);
+	while (_outstanding > 0)
+		pthread_cond_wait(&_idleCond, &_stateLock);
+	pthread_mutex_unlock(&_stateLock);
+	runCompletions();
+}
+
+size_t ThreadPool::getThreadCount() const
+{
+	return (_workers.size());
+}
+
+size_t ThreadPool::getOutstanding()
+{
+	pthread_mutex_lock(&_stateLock);
+	size_t outstanding = _outstanding;
+	pthread_mutex_unlock(&_stateLock);
+	return (outstanding);
+}
@@ -0,0 +1,192 @@
+#include "Transport.hpp"
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+
+static uint64_t monotonicMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+Transport::~Transport()
+{
+}
+
+int Transport::listenFd() const
+{
+	return (-1);
+}
+
+int SocketTransport::accept(int listenFd, struct sockaddr* address, socklen_t* length)
+{
+	// non-blocking and close-on-exec from the start: no fcntl() round trips
+	return (accept4(listenFd, address, length, SOCK_NONBLOCK | SOCK_CLOEXEC));
+}
+
+ssize_t SocketTransport::recv(int fd, char* buffer, size_t length)
+{
+	return (::recv(fd, buffer, length, 0));
+}
+
+ssize_t SocketTransport::send(int fd, const char* data, size_t length)
+{
+	return (::send(fd, data, length, MSG_NOSIGNAL));
+}
+
+int SocketTransport::close(int fd)
+{
+	return (::close(fd));
+}
+
+SimTransport::SimTransport(uint32_t seed)
+	: _random(seed ? seed : 1), _eagainPercent(0), _maxWrite(0), _latency(0)
+{
+	if (pipe2(_wake, O_NONBLOCK | O_CLOEXEC) == -1)
+		_wake[0] = _wake[1] = -1;
+	pthread_mutex_init(&_lock, NULL);
+}
+
+// the read end of _wake is the server's listener: the server closes it with its listeners
+SimTransport::~SimTransport()
+{
+	for (std::deque<int>::iterator it = _accepts.begin(); it != _accepts.end(); ++it)
+		::close(*it);
+	if (_wake[1] != -1)
+		::close(_wake[1]);
+	pthread_mutex_destroy(&_lock);
+}
+
+void SimTransport::setEagainPercent(int percent)
+{
+	_eagainPercent = percent;
+}
+
+void SimTransport::setMaxWrite(size_t bytes)
+{
+	_maxWrite = bytes;
+}
+
+void SimTransport::setLatency(long micros)
+{
+	_latency = micros;
+}
+
+// xorshift32: cheap, and the same seed fails the same calls
+bool SimTransport::_fault()
+{
+	if (_eagainPercent <= 0)
+		return (false);
+	_random ^= _random << 13;
+	_random ^= _random >> 17;
+	_random ^= _random << 5;
+	if ((int)(_random % 100) >= _eagainPercent)
+		return (false);
+	errno = EAGAIN;
+	return (true);
+}
+
+int SimTransport::connect()
+{
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) == -1)
+		return (-1);
+	pthread_mutex_lock(&_lock);
+	_accepts.push_back(pair[0]);
+	pthread_mutex_unlock(&_lock);
+	char byte = 'C';
+	ssize_t n = write(_wake[1], &byte, 1); // pipe full: the server is far behind, the connection still waits in the queue
+	(void)n;
+	return (pair[1]);
+}
+
+void SimTransport::pump()
+{
+	uint64_t now = monotonicMicros();
+	pthread_mutex_lock(&_lock);
+	for (std::map<int, std::deque<Delayed> >::iterator it = _delayed.begin(); it != _delayed.end(); ++it)
+	{
+		std::deque<Delayed>& queue = it->second;
+		while (!queue.empty() && queue.front().due <= now)
+		{
+			ssize_t n = ::send(it->first, queue.front().data.data(), queue.front().data.length(), MSG_NOSIGNAL);
+			if (n <= 0)
+				break; // the client is not reading: retried on the next pump()
+			if ((size_t)n < queue.front().data.length())
+			{
+				queue.front().data.erase(0, n);
+				break;
+			}
+			queue.pop_front();
+		}
+	}
+	pthread_mutex_unlock(&_lock);
+}
+
+int SimTransport::accept(int listenFd, struct sockaddr* address, socklen_t* length)
+{
+	if (listenFd != _wake[0])
+		return (accept4(listenFd, address, length, SOCK_NONBLOCK | SOCK_CLOEXEC));
+	pthread_mutex_lock(&_lock);
+	int fd = -1;
+	if (!_accepts.empty())
+	{
+		fd = _accepts.front();
+		_accepts.pop_front();
+	}
+	pthread_mutex_unlock(&_lock);
+	char byte;
+	ssize_t n = read(_wake[0], &byte, 1); // may be missing for a connection queued while the pipe was full
+	(void)n;
+	if (fd == -1)
+	{
+		errno = EAGAIN;
+		return (-1);
+	}
+	if (address && length && *length >= sizeof(sa_family_t))
+	{
+		address->sa_family = AF_UNIX;
+		*length = sizeof(sa_family_t);
+	}
+	return (fd);
+}
+
+ssize_t SimTransport::recv(int fd, char* buffer, size_t length)
+{
+	if (_fault())
+		return (-1);
+	return (::recv(fd, buffer, length, 0));
+}
+
+// with latency the output waits in memory (as much as the server sends) until pump() delivers it
+ssize_t SimTransport::send(int fd, const char* data, size_t length)
+{
+	if (_fault())
+		return (-1);
+	if (_maxWrite && length > _maxWrite)
+		length = _maxWrite;
+	if (_latency <= 0)
+		return (::send(fd, data, length, MSG_NOSIGNAL));
+	Delayed delayed;
+	delayed.due = monotonicMicros() + _latency;
+	delayed.data.assign(data, length);
+	pthread_mutex_lock(&_lock);
+	_delayed[fd].push_back(delayed);
+	pthread_mutex_unlock(&_lock);
+	return (length);
+}
+
+int SimTransport::close(int fd)
+{
+	pthread_mutex_lock(&_lock);
+	_delayed.erase(fd);
+	pthread_mutex_unlock(&_lock);
+	return (::close(fd));
+}
+
+int SimTransport::listenFd() const
+{
+	return (_wake[0]);
+}
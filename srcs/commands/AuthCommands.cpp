@@ -1,7 +1,78 @@
 #include "CommandHandler.hpp"
 #include "Colors.hpp"
+#include "ThreadPool.hpp"
+#include "AccountStore.hpp"
+#include <cstring>
 
-// validate the client's password
+// checks a PASS on the thread pool, then hands the verdict back to the command handler
+class PasswordCheckTask : public Task
+{
+    private:
+        CommandHandler* _handler;
+        const PasswordHash& _hash;
+        std::string _password;
+        ClientHandle _client;
+        bool _accepted;
+
+    public:
+        PasswordCheckTask(CommandHandler* handler, const PasswordHash& hash, const std::string& password, Client* client)
+            : _handler(handler), _hash(hash), _password(password), _client(client), _accepted(false) {}
+
+        void run() { _accepted = _hash.verify(_password); }
+        void complete() { _handler->completePass(_client, _accepted); }
+};
+
+// checks a SASL PLAIN password against the account's hash on the thread pool
+// an unknown account is checked too, against the store's decoy hash, and always fails: both failures
+// take the same path and the same time
+class SaslCheckTask : public Task
+{
+    private:
+        CommandHandler* _handler;
+        PasswordHash _hash; // copied: the account file may be remapped before the task runs
+        std::string _password;
+        std::string _account;
+        ClientHandle _client;
+        bool _known;
+        bool _accepted;
+
+    public:
+        SaslCheckTask(CommandHandler* handler, const PasswordHash& hash, const std::string& password,
+                      const std::string& account, Client* client, bool known)
+            : _handler(handler), _hash(hash), _password(password), _account(account), _client(client), _known(known),
+              _accepted(false) {}
+
+        void run() { _accepted = _hash.verify(_password) && _known; }
+        void complete() { _handler->completeSasl(_client, _account, _accepted); }
+};
+
+// decode base64, false on any character outside the alphabet
+static bool decodeBase64(const std::string& input, std::string& output)
+{
+    static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned int bits = 0;
+    int count = 0;
+
+    output.clear();
+    for (size_t i = 0; i < input.length(); ++i)
+    {
+        if (input[i] == '=')
+            break;
+        size_t value = alphabet.find(input[i]);
+        if (value == std::string::npos)
+            return false;
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            output += static_cast<char>((bits >> count) & 0xFF);
+        }
+    }
+    return true;
+}
+
+// validate the client's password (the key derivation runs on the thread pool)
 void CommandHandler::cmdPass(Client* client, const std::vector<std::string> &params)
 {
     if (client->isRegistered()) 
@@ -16,28 +87,153 @@ void CommandHandler::cmdPass(Client* client, const std::vector<std::string> &par
         return;
     }
 
-    const std::string& password = params[0];
+    if (client->isPasswordGiven()) 
+    {
+        std::cout << "Client " << client->getClientFd() << " tried to resend PASS (already accepted)" << std::endl;
+        return;
+    }
+
+    // the client's next commands wait in its buffer until completePass()
+    client->setAuthPending(true);
+    _server->getThreadPool()->submit(new PasswordCheckTask(this, _server->getPasswordHash(), params[0], client));
+}
+
+// result of a PASS check, back on the event loop
+void CommandHandler::completePass(const ClientHandle& handle, bool accepted)
+{
+    Client* client = _server->getClient(handle);
+    if (!client) // disconnected meanwhile
+        return;
+    int clientFd = handle.fd;
+    client->setAuthPending(false);
 
-    if (password == _server->getPassword()) 
+    if (accepted) 
     {
-        if (client->isPasswordGiven()) 
-        {
-            std::cout << "Client " << client->getClientFd() << " tried to resend PASS (already accepted)" << std::endl;
-            return;
-        }
         client->setPasswordGiven(true);
-        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << client->getClientFd() << " provided correct password" << std::endl;
+        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << clientFd << " provided correct password" << std::endl;
         // Nouvelle logique : enregistrer si nick et user sont déjà là
-        if (!client->getNickname().empty() && !client->getUsername().empty() && !client->isRegistered()) {
-            client->setRegistered(true);
-            sendWelcomeMsg(client);
-        }
+        tryCompleteRegistration(client);
     } 
     else 
     {
         sendNumericReply(client, ERR_PASSWDMISMATCH, ":Password incorrect");
-        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << client->getClientFd() << " provided wrong password" << std::endl;
+        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << clientFd << " provided wrong password" << std::endl;
+    }
+    _server->resumeClient(client);
+}
+
+// SASL PLAIN login against the account file (IRCv3 sasl), verified on the thread pool
+void CommandHandler::cmdAuthenticate(Client* client, const std::vector<std::string> &params)
+{
+    if (!client->hasCapability(CAP_SASL))
+    {
+        sendNumericReply(client, ERR_SASLFAIL, ":SASL authentication failed");
+        return;
+    }
+    if (client->isRegistered() || !client->getAccount().empty())
+    {
+        sendNumericReply(client, ERR_SASLALREADY, ":You have already authenticated using SASL");
+        return;
+    }
+    if (params.empty())
+    {
+        sendNumericReply(client, ERR_NEEDMOREPARAMS, "AUTHENTICATE :Not enough parameters");
+        return;
+    }
+
+    const std::string& data = params[0];
+    if (data == "*")
+    {
+        client->setSaslMechanism("");
+        sendNumericReply(client, ERR_SASLABORTED, ":SASL authentication aborted");
+        return;
+    }
+
+    // first message: the mechanism
+    if (client->getSaslMechanism().empty())
+    {
+        std::string mechanism = data;
+        for (size_t i = 0; i < mechanism.length(); ++i)
+            mechanism[i] = std::toupper(mechanism[i]);
+        if (mechanism != "PLAIN")
+        {
+            sendNumericReply(client, RPL_SASLMECHS, "PLAIN :are available SASL mechanisms");
+            sendNumericReply(client, ERR_SASLFAIL, ":SASL authentication failed");
+            return;
+        }
+        client->setSaslMechanism(mechanism);
+        client->sendMessage("AUTHENTICATE +\r\n");
+        _server->_setPollOut(client->getClientFd());
+        return;
     }
+
+    // then the payload, in chunks of SASL_CHUNK_SIZE ("+" alone for an empty chunk)
+    std::string& buffer = client->getSaslBuffer();
+    if (data.length() > SASL_CHUNK_SIZE || buffer.length() + data.length() > (SASL_PAYLOAD_MAX + 2) / 3 * 4)
+    {
+        client->setSaslMechanism("");
+        sendNumericReply(client, ERR_SASLTOOLONG, ":SASL message too long");
+        return;
+    }
+    if (data != "+")
+        buffer += data;
+    if (data.length() == SASL_CHUNK_SIZE)
+        return;
+
+    // PLAIN: authzid \0 authcid \0 password
+    std::string message;
+    bool decoded = decodeBase64(buffer, message);
+    client->setSaslMechanism("");
+    size_t first = message.find('\0');
+    size_t second = (first == std::string::npos) ? std::string::npos : message.find('\0', first + 1);
+    if (!decoded || second == std::string::npos)
+    {
+        sendNumericReply(client, ERR_SASLFAIL, ":SASL authentication failed");
+        return;
+    }
+    std::string authzid = message.substr(0, first);
+    std::string authcid = message.substr(first + 1, second - first - 1);
+    std::string password = message.substr(second + 1);
+
+    const AccountStore& accounts = _server->getAccountStore();
+    const AccountRecord* record = accounts.find(authcid);
+    bool known = record && (authzid.empty() || AccountStore::normalizeName(authzid) == AccountStore::normalizeName(authcid));
+    if (!known)
+        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << client->getClientFd() << " SASL login for unknown account " << authcid
+                  << ": checked against the decoy hash" << std::endl;
+
+    // like PASS: the client's next commands wait in its buffer until completeSasl()
+    client->setAuthPending(true);
+    _server->getThreadPool()->submit(new SaslCheckTask(this, record ? AccountStore::hashOf(*record) : accounts.decoyHash(), password,
+        record ? std::string(record->name, strnlen(record->name, ACCOUNT_NAME_MAX)) : authcid, client, known));
+}
+
+// result of a SASL PLAIN check, back on the event loop
+void CommandHandler::completeSasl(const ClientHandle& handle, const std::string& account, bool accepted)
+{
+    Client* client = _server->getClient(handle);
+    if (!client) // disconnected meanwhile
+        return;
+    int clientFd = handle.fd;
+    client->setAuthPending(false);
+
+    if (accepted)
+    {
+        std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+        std::string user = client->getUsername().empty() ? "*" : client->getUsername();
+        client->setAccount(account);
+        client->setPasswordGiven(true);
+        sendNumericReply(client, RPL_LOGGEDIN, nick + "!" + user + "@" + client->getHostname() + " " + account + " :You are now logged in as " + account);
+        sendNumericReply(client, RPL_SASLSUCCESS, ":SASL authentication successful");
+        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << clientFd << " logged in as " << account << std::endl;
+        tryCompleteRegistration(client);
+    }
+    else
+    {
+        sendNumericReply(client, ERR_SASLFAIL, ":SASL authentication failed");
+        std::cout << PASTEL_VIOLET << "[INFO] " << DEFAULT << "Client " << clientFd << " SASL login failed for " << account << std::endl;
+    }
+    _server->resumeClient(client);
 }
 
 // validate or update a client's nickname
@@ -67,25 +263,20 @@ void CommandHandler::cmdNick(Client* client, const std::vector<std::string> &par
 
     if (client->isRegistered() && !oldNick.empty()) 
     {
-        const std::set<std::string>& channels = client->getJoinedChannels();
-        for (std::set<std::string>::const_iterator it = channels.begin(); it != channels.end(); ++it) 
+        std::string nickChangeMsg = client->getPrefix() + " NICK :" + newNick + "\r\n";
+        const std::set<Channel*>& channels = client->getJoinedChannels();
+        for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) 
         {
-            Channel* channel = _server->getChannel(*it);
-            if (channel) 
-            {
-                std::string nickChangeMsg = client->getPrefix() + " NICK :" + newNick + "\r\n";
-                _server->broadcastToChannel(*it, nickChangeMsg, -1);
-            }
+            _server->broadcastMembership((*it)->getName(), nickChangeMsg, client, -1, false);
+            (*it)->renameMember(client, newNick);
         }
+        _server->propagateToLinks(nickChangeMsg);
         std::cout << "Client " << oldNick << " changed nickname to " << newNick << std::endl;
     }
 
-    client->setNickname(newNick);
+    _server->setNick(client, newNick);
 
-    if (!client->getUsername().empty() && client->isPasswordGiven() && !client->isRegistered()) {
-        client->setRegistered(true);
-        sendWelcomeMsg(client);
-    }
+    tryCompleteRegistration(client);
 }
 
 // register a new client with username and realname
@@ -103,7 +294,8 @@ void CommandHandler::cmdUser(Client* client, const std::vector<std::string> &par
         return;
     }
     
-    if (!client->isPasswordGiven())
+    // a client that enabled sasl may log in after USER
+    if (!client->isPasswordGiven() && !client->hasCapability(CAP_SASL))
     {
         sendNumericReply(client, ERR_PASSWDMISMATCH, ":You must send PASS first");
         return;
@@ -115,11 +307,75 @@ void CommandHandler::cmdUser(Client* client, const std::vector<std::string> &par
     client->setUsername(username);
     client->setRealname(realname);
     
-    if (!client->getNickname().empty() && client->isPasswordGiven() && !client->isRegistered())
+    tryCompleteRegistration(client);
+}
+
+// IRCv3 capability negotiation (LS, LIST, REQ, END)
+void CommandHandler::cmdCap(Client* client, const std::vector<std::string> &params)
+{
+    if (params.empty())
     {
-        client->setRegistered(true);
-        sendWelcomeMsg(client);
+        sendNumericReply(client, ERR_NEEDMOREPARAMS, "CAP :Not enough parameters");
+        return;
     }
+
+    std::string subcommand = params[0];
+    for (size_t i = 0; i < subcommand.length(); ++i)
+        subcommand[i] = std::toupper(subcommand[i]);
+    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+    std::string prefix = ":" + _server->getServerName() + " CAP " + nick + " ";
+
+    if (subcommand == "LS" || subcommand == "LIST")
+    {
+        const std::set<std::string>& caps = (subcommand == "LS") ? _capabilities : client->getCapabilities();
+        std::string list;
+        for (std::set<std::string>::const_iterator it = caps.begin(); it != caps.end(); ++it)
+            list += (list.empty() ? "" : " ") + *it;
+        if (subcommand == "LS" && !client->isRegistered())
+            client->setCapNegotiating(true);
+        client->sendMessage(prefix + subcommand + " :" + list);
+    }
+    else if (subcommand == "REQ")
+    {
+        if (!client->isRegistered())
+            client->setCapNegotiating(true);
+        std::string requested = (params.size() > 1) ? params[1] : "";
+        std::istringstream iss(requested);
+        std::vector<std::string> caps;
+        std::string cap;
+        bool valid = true;
+        while (iss >> cap)
+        {
+            std::string name = (cap[0] == '-') ? cap.substr(1) : cap;
+            if (_capabilities.find(name) == _capabilities.end())
+                valid = false;
+            caps.push_back(cap);
+        }
+        // a REQ is applied all-or-nothing
+        if (!valid || caps.empty())
+        {
+            client->sendMessage(prefix + "NAK :" + requested);
+        }
+        else
+        {
+            for (size_t i = 0; i < caps.size(); ++i)
+            {
+                if (caps[i][0] == '-')
+                    client->setCapability(caps[i].substr(1), false);
+                else
+                    client->setCapability(caps[i], true);
+            }
+            client->sendMessage(prefix + "ACK :" + requested);
+        }
+    }
+    else if (subcommand == "END")
+    {
+        client->setCapNegotiating(false);
+        tryCompleteRegistration(client);
+    }
+    else
+        sendNumericReply(client, ERR_INVALIDCAPCMD, params[0] + " :Invalid CAP subcommand");
+    _server->_setPollOut(client->getClientFd());
 }
 
 // handle client quit command
@@ -131,18 +387,15 @@ void CommandHandler::cmdQuit(Client* client, const std::vector<std::string> &par
     
     std::cout << "   Client " << client->getNickname() << " quit: " << reason << PASTEL_GREEN << " ✓" << DEFAULT << std::endl;
     
-    const std::set<std::string>& channels = client->getJoinedChannels();
-    for (std::set<std::string>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+    std::string quitMsg = client->getPrefix() + " QUIT :" + reason + "\r\n";
+    const std::set<Channel*> channels = client->getJoinedChannels(); // a copy: partChannel() edits it
+    for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
     {
-        Channel* channel = _server->getChannel(*it);
-        if (channel)
-        {
-            std::string quitMsg = client->getPrefix() + " QUIT :" + reason + "\r\n";
-            _server->broadcastToChannel(*it, quitMsg, client->getClientFd());
-            channel->removeUser(client);
-            channel->removeOperator(client);
-        }
+        _server->broadcastMembership((*it)->getName(), quitMsg, client, client->getClientFd(), false);
+        _server->partChannel(*it, client);
     }
+    if (client->isRegistered())
+        _server->propagateToLinks(quitMsg);
     // finally remove the client from the server (close socket, free resources)
     _server->removeClient(client->getClientFd());
 }
@@ -158,4 +411,5 @@ void CommandHandler::cmdPing(Client* client, const std::vector<std::string> &par
     
     std::string response = ":" + _server->getServerName() + " PONG " + _server->getServerName() + " :" + params[0] + "\r\n";
     client->sendMessage(response);
+    _server->_setPollOut(client->getClientFd());
 }
@@ -33,7 +33,7 @@ void CommandHandler::cmdJoin(Client* client, const std::vector<std::string> &par
     
     for (size_t i = 0; i < channels.size(); ++i)
     {
-        const std::string& channelName = channels[i];
+        std::string channelName = channels[i];
         std::string key = (i < keys.size()) ? keys[i] : "";
         
         if (!isValidChannelName(channelName))
@@ -53,6 +53,7 @@ void CommandHandler::cmdJoin(Client* client, const std::vector<std::string> &par
             sendNumericReply(client, ERR_NOSUCHCHANNEL, channelName + " :Cannot create channel");
             continue;
         }
+        channelName = chan->getName(); // its own spelling, whatever case the client typed
         
         if (!chan->addUser(client, key))
         {
@@ -67,13 +68,14 @@ void CommandHandler::cmdJoin(Client* client, const std::vector<std::string> &par
             continue;
         }
         
-        if (isNewChannel)
+        // the first member of a new (or restored, still empty) channel becomes its operator
+        if (isNewChannel || chan->getMembers().size() == 1)
             chan->addOperator(client);
         
-        client->joinChannel(channelName);
+        client->joinChannel(chan);
         
         std::string joinMsg = client->getPrefix() + " JOIN " + channelName + "\r\n";
-        _server->broadcastToChannel(channelName, joinMsg, -1);
+        _server->broadcastMembership(channelName, joinMsg, client, -1);
 
         std::string topic = chan->getTopic();
         if (!topic.empty())
@@ -81,21 +83,13 @@ void CommandHandler::cmdJoin(Client* client, const std::vector<std::string> &par
         else
             sendNumericReply(client, RPL_NOTOPIC, channelName + " :No topic is set");
 
-        std::string namesList;
-        const std::set<Client*>& members = chan->getMembers();
-        for (std::set<Client*>::const_iterator it = members.begin(); it != members.end(); ++it)
-        {
-            if (!namesList.empty())
-                namesList += " ";
-            
-            if (chan->isOperator(*it))
-                namesList += "@";
-            
-            namesList += (*it)->getNickname();
-        }
-        
-        sendNumericReply(client, RPL_NAMREPLY, "= " + channelName + " :" + namesList);
-        sendNumericReply(client, RPL_ENDOFNAMES, channelName + " :End of /NAMES list");
+        // auditorium channels (+u) only list members to operators or on an explicit NAMES
+        if (client->hasCapability(CAP_NO_IMPLICIT_NAMES))
+            continue;
+        if (chan->getMode('u') && !chan->isOperator(client))
+            sendNumericReply(client, RPL_ENDOFNAMES, channelName + " :End of /NAMES list");
+        else
+            sendNamesReply(client, chan);
     }
 }
 
@@ -138,14 +132,9 @@ void CommandHandler::cmdPart(Client* client, const std::vector<std::string> &par
         }
         
         std::string partMsg = client->getPrefix() + " PART " + channelName + " :" + reason + "\r\n";
-        _server->broadcastToChannel(channelName, partMsg, -1);
+        _server->broadcastMembership(channelName, partMsg, client, -1);
         
-        chan->removeUser(client);
-        chan->removeOperator(client);
-        client->leaveChannel(channelName);
-        
-        if (chan->getMembers().empty())
-            _server->removeChannel(channelName);
+        _server->partChannel(chan, client);
     }
 }
 
@@ -169,19 +158,5 @@ void CommandHandler::cmdNames(Client* client, const std::vector<std::string> &pa
         return;
     }
     
-    std::string namesList;
-    const std::set<Client*>& members = chan->getMembers();
-    for (std::set<Client*>::const_iterator it = members.begin(); it != members.end(); ++it)
-    {
-        if (!namesList.empty())
-            namesList += " ";
-        
-        if (chan->isOperator(*it))
-            namesList += "@";
-        
-        namesList += (*it)->getNickname();
-    }
-    
-    sendNumericReply(client, RPL_NAMREPLY, "= " + channelName + " :" + namesList);
-    sendNumericReply(client, RPL_ENDOFNAMES, channelName + " :End of /NAMES list");
+    sendNamesReply(client, chan);
 }
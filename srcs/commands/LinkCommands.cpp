@@ -0,0 +1,383 @@
+#include "CommandHandler.hpp"
+#include "Colors.hpp"
+#include <openssl/crypto.h>
+
+// no early exit on the first differing byte: the time only tells the length
+static bool isSameSecret(const std::string& given, const std::string& expected)
+{
+    return given.length() == expected.length()
+        && CRYPTO_memcmp(given.c_str(), expected.c_str(), expected.length()) == 0;
+}
+
+// a username or hostname from a peer ends up in "nick!user@host" prefixes: nothing that would split one
+static bool isValidPrefixPart(const std::string& part)
+{
+    if (part.empty() || part.length() > 63 || part[0] == ':')
+        return false;
+    for (size_t i = 0; i < part.length(); ++i)
+    {
+        unsigned char c = part[i];
+        if (c <= ' ' || c == '!' || c == '@' || c == ',' || c == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+// SERVER <name> <password> :<description> -- turns an unregistered connection into a server link
+void CommandHandler::cmdServer(Client* client, const std::vector<std::string> &params)
+{
+    if (client->isRegistered() || !client->getNickname().empty())
+    {
+        sendNumericReply(client, ERR_ALREADYREGISTRED, ":You may not reregister");
+        return;
+    }
+    if (params.size() < 2)
+    {
+        sendNumericReply(client, ERR_NEEDMOREPARAMS, "SERVER :Not enough parameters");
+        return;
+    }
+
+    const std::string linkPassword = _server->getConfig().get("link_password");
+    if (linkPassword.empty() || !isSameSecret(params[1], linkPassword) || !_server->establishLink(client, params[0]))
+    {
+        std::cerr << "   Link refused for " << params[0] << " on client " << client->getClientFd() << PASTEL_RED << " ✗" << DEFAULT << std::endl;
+        _server->refuseLink(client);
+    }
+}
+
+// handle a line from a linked server: ":<source> COMMAND params..."
+void CommandHandler::_processLinkCommand(Client* link, const std::string &input)
+{
+    std::string source;
+    std::string rest = input;
+    if (input[0] == ':')
+    {
+        size_t space = input.find(' ');
+        if (space == std::string::npos)
+            return;
+        source = input.substr(1, space - 1);
+        rest = input.substr(space + 1);
+    }
+
+    std::string command;
+    std::vector<std::string> params;
+    _parseInput(rest, command, params);
+    if (command.empty())
+        return;
+
+    std::map<std::string, LinkHandlerFunction>::iterator it = _linkCommandMap.find(command);
+    if (it == _linkCommandMap.end())
+    {
+        std::cerr << "   Unknown command from link " << link->getLinkName() << ": '" << command << "'" << PASTEL_RED << " ✗" << DEFAULT << std::endl;
+        return;
+    }
+
+    // a user source must be a client announced by this same link, anything else would loop or spoof
+    Client* user = NULL;
+    if (!source.empty())
+    {
+        user = _server->getClientByNick(source.substr(0, source.find('!')));
+        if (user && user->getUplink() != link)
+            user = NULL;
+    }
+
+    LinkHandlerFunction handler = it->second;
+    (this->*handler)(link, user, params, input + "\r\n");
+}
+
+// UID <nick> <user> <host> <ip> :<realname> -- a client behind the link
+void CommandHandler::linkUid(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    if (params.size() < 5)
+        return;
+    if (!isValidNickname(params[0]) || !isValidPrefixPart(params[1]) || !isValidPrefixPart(params[2]))
+    {
+        std::cerr << "   Invalid UID from link " << link->getLinkName() << ": '" << params[0] << "'" << PASTEL_RED << " ✗" << DEFAULT << std::endl;
+        return;
+    }
+
+    Client* existing = _server->getClientByNick(params[0]);
+    if (existing)
+    {
+        // nickname collision: both clients go (UID carries no nick timestamp to keep the older one)
+        std::string kill = ":" + _server->getServerName() + " KILL " + params[0] + " :Nick collision\r\n";
+        link->sendMessage(kill);
+        _server->_setPollOut(link->getClientFd());
+        if (existing->isRemote())
+        {
+            existing->sendMessage(kill);
+            _server->_setPollOut(existing->getClientFd());
+            _server->removeRemoteClient(existing, existing->getPrefix() + " QUIT :Nick collision\r\n");
+        }
+        else
+            _server->killClient(existing, "Nick collision");
+        return;
+    }
+    _server->addRemoteClient(link, params[0], params[1], params[2], params[3], params[4]);
+    _server->propagateToLinks(line, link->getClientFd());
+}
+
+// SJOIN <#channel> <+modes> [key] [limit] :[@]nick... -- channel members behind the link
+void CommandHandler::linkSjoin(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    if (params.size() < 3)
+        return;
+
+    const std::string& channelName = params[0];
+    Channel* chan = _server->getChannel(channelName);
+    bool isNewChannel = (chan == NULL);
+    if (isNewChannel)
+        chan = _server->createChannel(channelName);
+    if (!chan)
+        return;
+
+    // modes are only taken from the burst when we had nothing for this channel
+    size_t paramIndex = 2;
+    const std::string& modeString = params[1];
+    for (size_t i = 1; i < modeString.length(); ++i)
+    {
+        char mode = modeString[i];
+        std::string modeParam;
+        if ((mode == 'k' || mode == 'l') && paramIndex < params.size() - 1)
+            modeParam = params[paramIndex++];
+        if (isNewChannel)
+            chan->setMode(mode, true, NULL, modeParam);
+    }
+
+    std::istringstream members(params[params.size() - 1]);
+    std::string nick;
+    while (members >> nick)
+    {
+        bool isOperator = (nick[0] == '@');
+        if (isOperator)
+            nick.erase(0, 1);
+        Client* member = _server->getClientByNick(nick);
+        if (!member || member->getUplink() != link || chan->isMember(member))
+            continue;
+        chan->restoreMember(member, isOperator);
+        member->joinChannel(chan);
+        _server->broadcastMembership(channelName, member->getPrefix() + " JOIN " + channelName + "\r\n", member, link->getClientFd(), false);
+    }
+    _server->propagateToLinks(line, link->getClientFd());
+}
+
+// TB <#channel> :<topic> -- topic burst, kept only when we have no topic of our own
+void CommandHandler::linkTopicBurst(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    if (params.size() < 2)
+        return;
+    Channel* chan = _server->getChannel(params[0]);
+    if (!chan || !chan->getTopic().empty())
+        return;
+    chan->setTopic(params[1], NULL);
+    _server->propagateToLinks(line, link->getClientFd());
+}
+
+void CommandHandler::linkEob(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    (void)params;
+    (void)line;
+    std::cout << PASTEL_YELLOW << "[LINK] " << DEFAULT << "End of burst from " << link->getLinkName() << std::endl;
+}
+
+// KILL <nick> :<reason> -- drop a local client, or pass it on towards the server that owns it
+void CommandHandler::linkKill(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    if (params.empty())
+        return;
+    Client* target = _server->getClientByNick(params[0]);
+    if (!target || target->getUplink() == link)
+        return;
+    if (target->isRemote())
+    {
+        target->sendMessage(line);
+        _server->_setPollOut(target->getClientFd());
+        return;
+    }
+    _server->killClient(target, params.size() > 1 ? params[1] : "Killed");
+}
+
+void CommandHandler::linkError(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)source;
+    (void)line;
+    std::cerr << "[LINK] ERROR from " << link->getLinkName() << ": " << (params.empty() ? "" : params[0]) << std::endl;
+}
+
+void CommandHandler::linkQuit(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    (void)link;
+    (void)params;
+    if (!source)
+        return;
+    _server->removeRemoteClient(source, line);
+}
+
+void CommandHandler::linkNick(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.empty())
+        return;
+
+    const std::string& newNick = params[0];
+    Client* existing = _server->getClientByNick(newNick);
+    if (existing && existing != source)
+    {
+        link->sendMessage(":" + _server->getServerName() + " KILL " + source->getNickname() + " :Nick collision\r\n");
+        _server->_setPollOut(link->getClientFd());
+        _server->removeRemoteClient(source, source->getPrefix() + " QUIT :Nick collision\r\n");
+        return;
+    }
+
+    const std::set<Channel*>& channels = source->getJoinedChannels();
+    for (std::set<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+    {
+        _server->broadcastMembership((*it)->getName(), line, source, link->getClientFd(), false);
+        (*it)->renameMember(source, newNick);
+    }
+    _server->renameRemoteClient(source, newNick);
+    _server->propagateToLinks(line, link->getClientFd());
+}
+
+void CommandHandler::linkJoin(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.empty())
+        return;
+
+    const std::string& channelName = params[0];
+    Channel* chan = _server->getChannel(channelName);
+    if (!chan)
+        chan = _server->createChannel(channelName);
+    if (!chan || chan->isMember(source))
+        return;
+
+    // same rule as a local JOIN: the first member becomes operator
+    chan->restoreMember(source, chan->getMembers().empty());
+    source->joinChannel(chan);
+    _server->broadcastMembership(channelName, line, source, link->getClientFd());
+}
+
+void CommandHandler::linkPart(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.empty())
+        return;
+
+    const std::string& channelName = params[0];
+    Channel* chan = _server->getChannel(channelName);
+    if (!chan || !chan->isMember(source))
+        return;
+
+    _server->broadcastMembership(channelName, line, source, link->getClientFd());
+    _server->partChannel(chan, source);
+}
+
+void CommandHandler::linkKick(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.size() < 2)
+        return;
+
+    Channel* chan = _server->getChannel(params[0]);
+    Client* target = _server->getClientByNick(params[1]);
+    if (!chan || !target || !chan->isMember(target))
+        return;
+
+    _server->broadcastToChannel(params[0], line, link->getClientFd());
+    _server->partChannel(chan, target);
+}
+
+void CommandHandler::linkTopic(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.size() < 2)
+        return;
+
+    Channel* chan = _server->getChannel(params[0]);
+    if (!chan)
+        return;
+    chan->setTopic(params[1], NULL);
+    _server->broadcastToChannel(params[0], line, link->getClientFd());
+}
+
+// the originating server already checked permissions, so modes are applied as they come
+void CommandHandler::linkMode(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.size() < 2)
+        return;
+
+    Channel* chan = _server->getChannel(params[0]);
+    if (!chan)
+        return;
+
+    const std::string& modeString = params[1];
+    bool adding = true;
+    size_t paramIndex = 2;
+    for (size_t i = 0; i < modeString.length(); ++i)
+    {
+        char mode = modeString[i];
+        if (mode == '+' || mode == '-')
+        {
+            adding = (mode == '+');
+            continue;
+        }
+        if (mode == 'o')
+        {
+            if (paramIndex >= params.size())
+                break;
+            Client* target = _server->getClientByNick(params[paramIndex++]);
+            if (!target || !chan->isMember(target))
+                continue;
+            if (adding)
+                chan->addOperator(target);
+            else
+                chan->removeOperator(target);
+        }
+        else if (adding && (mode == 'k' || mode == 'l'))
+        {
+            if (paramIndex < params.size())
+                chan->setMode(mode, true, NULL, params[paramIndex++]);
+        }
+        else
+            chan->setMode(mode, adding, NULL);
+    }
+    _server->broadcastToChannel(params[0], line, link->getClientFd());
+}
+
+// PRIVMSG/NOTICE: channel messages reach local members and the other links, private ones are routed to their target
+void CommandHandler::linkMessage(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.size() < 2)
+        return;
+
+    const std::string& target = params[0];
+    if (target[0] == '#' || target[0] == '&')
+    {
+        if (!_server->getChannel(target))
+            return;
+        _server->broadcastToChannel(target, line, link->getClientFd(), false, true, LANE_CHANNEL);
+        _server->recordHistory(target, line);
+        return;
+    }
+
+    Client* targetClient = _server->getClientByNick(target);
+    if (!targetClient || targetClient->getUplink() == link)
+        return;
+    targetClient->sendMessage(line, LANE_DIRECT);
+    _server->_setPollOut(targetClient->getClientFd());
+}
+
+void CommandHandler::linkInvite(Client* link, Client* source, const std::vector<std::string> &params, const std::string& line)
+{
+    if (!source || params.size() < 2)
+        return;
+
+    Channel* chan = _server->getChannel(params[1]);
+    Client* target = _server->getClientByNick(params[0]);
+    if (!chan || !target || target->getUplink() == link)
+        return;
+    chan->addInvite(params[0]);
+    target->sendMessage(line);
+    _server->_setPollOut(target->getClientFd());
+}
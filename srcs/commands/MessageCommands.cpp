@@ -1,4 +1,9 @@
 #include "CommandHandler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 
 void CommandHandler::cmdPrivmsg(Client* client, const std::vector<std::string> &params)
 {
@@ -23,69 +28,219 @@ void CommandHandler::cmdPrivmsg(Client* client, const std::vector<std::string> &
         return;
     }
     
+    std::string error = deliverMessage(client, client->getPrefix(), "PRIVMSG", target, &message, 1);
+    if (error == ERR_NOSUCHCHANNEL)
+        sendNumericReply(client, ERR_NOSUCHCHANNEL, target + " :No such channel");
+    else if (error == ERR_CANNOTSENDTOCHAN)
+        sendNumericReply(client, ERR_CANNOTSENDTOCHAN, target + " :Cannot send to channel");
+    else if (error == ERR_NOSUCHNICK)
+        sendNumericReply(client, ERR_NOSUCHNICK, target + " :No such nick/channel");
+}
+
+void CommandHandler::cmdNotice(Client* client, const std::vector<std::string> &params)
+{
+    if (!client->isRegistered())
+        return;
+    
+    if (params.size() < 2)
+        return;
+    
+    const std::string& target = params[0];
+    const std::string& message = params[1];
+    
+    if (message.empty())
+        return;
+    
+    deliverMessage(client, client->getPrefix(), "NOTICE", target, &message, 1); // NOTICE never gets an error reply
+}
+
+// the delivery half of PRIVMSG and NOTICE: returns the numeric that refuses it, empty when delivered
+// count texts reach each recipient in one send buffer append; a NULL sender trusts prefix (injection socket)
+std::string CommandHandler::deliverMessage(Client* sender, const std::string& prefix, const std::string& command,
+                                           const std::string& target, const std::string* texts, size_t count)
+{
+    if (target.empty())
+        return ERR_NOSUCHNICK;
+    if (count == 0)
+        return ERR_NOTEXTTOSEND;
+    std::string lines;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (texts[i].empty())
+            return ERR_NOTEXTTOSEND;
+        lines += prefix + " " + command + " " + target + " :" + texts[i] + "\r\n";
+    }
+    
     if (target[0] == '#' || target[0] == '&')
     {
         Channel* chan = _server->getChannel(target);
         if (!chan)
-        {
-            sendNumericReply(client, ERR_NOSUCHCHANNEL, target + " :No such channel");
-            return;
-        }
+            return ERR_NOSUCHCHANNEL;
+        if (sender && !chan->isMember(sender))
+            return ERR_CANNOTSENDTOCHAN;
         
-        if (!chan->isMember(client))
+        _server->broadcastToChannel(target, lines, sender ? sender->getClientFd() : -1, false, true, LANE_CHANNEL);
+        for (size_t start = 0; start < lines.length(); ) // one history entry per message
         {
-            sendNumericReply(client, ERR_CANNOTSENDTOCHAN, target + " :Cannot send to channel");
-            return;
+            size_t end = lines.find("\r\n", start) + 2;
+            _server->recordHistory(target, lines.substr(start, end - start));
+            start = end;
         }
-        
-        std::string msg = client->getPrefix() + " PRIVMSG " + target + " :" + message + "\r\n";
-        _server->broadcastToChannel(target, msg, client->getClientFd());
     }
     else
     {
         Client* targetClient = _server->getClientByNick(target);
         if (!targetClient)
-        {
-            sendNumericReply(client, ERR_NOSUCHNICK, target + " :No such nick/channel");
-            return;
-        }
+            return ERR_NOSUCHNICK;
         
-        std::string msg = client->getPrefix() + " PRIVMSG " + target + " :" + message + "\r\n";
-        targetClient->sendMessage(msg);
+        targetClient->sendMessage(lines, LANE_DIRECT);
         _server->_setPollOut(targetClient->getClientFd());
     }
+    return "";
 }
 
-void CommandHandler::cmdNotice(Client* client, const std::vector<std::string> &params)
+// format milliseconds since epoch as an IRCv3 server-time (2024-01-31T12:00:00.000Z)
+static std::string formatServerTime(long long timeMs)
+{
+    time_t seconds = (time_t)(timeMs / 1000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    char buf[32];
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + len, sizeof(buf) - len, ".%03dZ", (int)(timeMs % 1000));
+    return std::string(buf);
+}
+
+// parse a server-time back to milliseconds, -1 on error
+static long long parseServerTime(const std::string& value)
+{
+    struct tm tm;
+    int millis = 0;
+    std::memset(&tm, 0, sizeof(tm));
+    if (sscanf(value.c_str(), "%d-%d-%dT%d:%d:%d.%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+            &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &millis) < 6)
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (long long)timegm(&tm) * 1000 + millis;
+}
+
+// replay a channel's stored messages: CHATHISTORY LATEST|BEFORE|AFTER <target> <*|msgid=|timestamp=> <limit>
+void CommandHandler::cmdChathistory(Client* client, const std::vector<std::string> &params)
 {
     if (!client->isRegistered())
         return;
-    
-    if (params.size() < 2)
+
+    if (params.size() < 4)
+    {
+        sendFail(client, "CHATHISTORY", "NEED_MORE_PARAMS", ":Missing parameters");
         return;
-    
-    const std::string& target = params[0];
-    const std::string& message = params[1];
-    
-    if (message.empty())
+    }
+
+    std::string subcommand = params[0];
+    for (size_t i = 0; i < subcommand.length(); ++i)
+        subcommand[i] = std::toupper(subcommand[i]);
+    const std::string& target = params[1];
+    const std::string& reference = params[2];
+
+    if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER")
+    {
+        sendFail(client, "CHATHISTORY", "INVALID_PARAMS", params[0] + " :Unknown subcommand");
         return;
-    
-    if (target[0] == '#' || target[0] == '&')
+    }
+
+    Channel* chan = _server->getChannel(target);
+    if (!chan || !chan->isMember(client))
     {
-        Channel* chan = _server->getChannel(target);
-        if (!chan || !chan->isMember(client))
+        sendFail(client, "CHATHISTORY", "INVALID_TARGET", subcommand + " " + target + " :Messages could not be retrieved");
+        return;
+    }
+
+    int limit = std::atoi(params[3].c_str());
+    if (limit <= 0)
+    {
+        sendFail(client, "CHATHISTORY", "INVALID_PARAMS", params[3] + " :Invalid limit");
+        return;
+    }
+    if (limit > CHATHISTORY_MAX_LIMIT)
+        limit = CHATHISTORY_MAX_LIMIT;
+
+    // resolve the reference to a position in the ring: [0, begin) is before it, [end, size) after it
+    const std::deque<HistoryEntry>& history = chan->getHistory();
+    size_t begin = history.size();
+    size_t end = history.size();
+    if (reference == "*" && subcommand == "LATEST")
+        begin = end = history.size();
+    else if (reference.compare(0, 6, "msgid=") == 0)
+    {
+        unsigned long msgid = std::strtoul(reference.c_str() + 6, NULL, 10);
+        begin = 0;
+        while (begin < history.size() && history[begin].msgid < msgid)
+            ++begin;
+        end = begin;
+        if (end < history.size() && history[end].msgid == msgid)
+            ++end;
+    }
+    else if (reference.compare(0, 10, "timestamp=") == 0)
+    {
+        long long time = parseServerTime(reference.substr(10));
+        if (time < 0)
+        {
+            sendFail(client, "CHATHISTORY", "INVALID_PARAMS", reference + " :Invalid timestamp");
             return;
-        
-        std::string msg = client->getPrefix() + " NOTICE " + target + " :" + message + "\r\n";
-        _server->broadcastToChannel(target, msg, client->getClientFd());
+        }
+        begin = 0;
+        while (begin < history.size() && history[begin].time < time)
+            ++begin;
+        end = begin;
+        while (end < history.size() && history[end].time == time)
+            ++end;
     }
     else
     {
-        Client* targetClient = _server->getClientByNick(target);
-        if (!targetClient)
-            return;
-        
-        std::string msg = client->getPrefix() + " NOTICE " + target + " :" + message + "\r\n";
-        targetClient->sendMessage(msg);
+        sendFail(client, "CHATHISTORY", "INVALID_PARAMS", reference + " :Invalid message reference");
+        return;
+    }
+
+    // select the window: LATEST/BEFORE take the newest messages before the reference, AFTER the oldest after it
+    size_t first;
+    size_t last;
+    if (subcommand == "AFTER")
+    {
+        first = end;
+        last = std::min(history.size(), end + (size_t)limit);
+    }
+    else
+    {
+        size_t stop = (subcommand == "LATEST") ? history.size() : begin;
+        size_t from = (subcommand == "LATEST" && reference != "*") ? end : 0;
+        last = stop;
+        first = (stop - from > (size_t)limit) ? stop - limit : from;
+    }
+
+    std::stringstream batchId;
+    batchId << "hist" << ++_batchCounter;
+    bool useBatch = client->hasCapability(CAP_BATCH);
+    if (useBatch)
+        client->sendMessage(":" + _server->getServerName() + " BATCH +" + batchId.str() + " chathistory " + target);
+    for (size_t i = first; i < last; ++i)
+    {
+        std::string tags;
+        if (useBatch)
+            tags += ";batch=" + batchId.str();
+        if (client->hasCapability(CAP_SERVER_TIME))
+            tags += ";time=" + formatServerTime(history[i].time);
+        if (client->hasCapability(CAP_MESSAGE_TAGS))
+        {
+            std::stringstream id;
+            id << history[i].msgid;
+            tags += ";msgid=" + id.str();
+        }
+        if (!tags.empty())
+            tags = "@" + tags.substr(1) + " ";
+        client->sendMessage(tags + ":" + history[i].line);
     }
+    if (useBatch)
+        client->sendMessage(":" + _server->getServerName() + " BATCH -" + batchId.str());
+    _server->_setPollOut(client->getClientFd());
 }
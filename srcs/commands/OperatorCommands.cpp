@@ -49,11 +49,8 @@ void CommandHandler::cmdKick(Client* client, const std::vector<std::string> &par
     std::string kickMsg = client->getPrefix() + " KICK " + channelName + " " + targetNick + " :" + reason + "\r\n";
     _server->broadcastToChannel(channelName, kickMsg, -1);
     
-    chan->removeUser(targetClient);
-    chan->removeOperator(targetClient);
-    targetClient->leaveChannel(channelName);
-    
     std::cout << targetNick << " kicked from " << channelName << " by " << client->getNickname() << std::endl;
+    _server->partChannel(chan, targetClient);
 }
 
 void CommandHandler::cmdInvite(Client* client, const std::vector<std::string> &params)
@@ -108,6 +105,7 @@ void CommandHandler::cmdInvite(Client* client, const std::vector<std::string> &p
     
     std::string inviteMsg = client->getPrefix() + " INVITE " + targetNick + " " + channelName + "\r\n";
     targetClient->sendMessage(inviteMsg);
+    _server->_setPollOut(targetClient->getClientFd());
     
     std::cout << "Invite: " << targetNick << " invited to " << channelName << " by " << client->getNickname() << std::endl;
 }
@@ -191,6 +189,7 @@ void CommandHandler::cmdMode(Client* client, const std::vector<std::string> &par
         if (chan->getMode('t')) modeStr += "t";
         if (chan->getMode('k')) modeStr += "k";
         if (chan->getMode('l')) modeStr += "l";
+        if (chan->getMode('u')) modeStr += "u";
         
         sendNumericReply(client, RPL_CHANNELMODEIS, channelName + " " + modeStr);
         return;
@@ -224,7 +223,7 @@ void CommandHandler::cmdMode(Client* client, const std::vector<std::string> &par
             continue;
         }
         
-        if (mode == 'i' || mode == 't')
+        if (mode == 'i' || mode == 't' || mode == 'u')
         {
             chan->setMode(mode, adding, client);
             appliedModes += (adding ? '+' : '-');
@@ -3,9 +3,24 @@
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
+#include <climits>
 
 static Server* g_server = NULL;
 
+void upgradeSignalHandler(int signum)
+{
+	(void)signum;
+	if (g_server != NULL)
+		g_server->requestUpgrade();
+}
+
+void statsSignalHandler(int signum)
+{
+	(void)signum;
+	if (g_server != NULL)
+		g_server->requestStats();
+}
+
 void signalHandler(int signum)
 {
 	(void)signum;
@@ -16,9 +31,9 @@ void signalHandler(int signum)
 
 int main(int argc, char** argv)
 {
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
 	{
-		std::cerr << "Usage: ./ircserv <port> <password>" << std::endl;
+		std::cerr << "Usage: ./ircserv <port> <password> [config file]" << std::endl;
 		return (1);
 	}
 
@@ -31,6 +46,8 @@ int main(int argc, char** argv)
 	signal(SIGINT, signalHandler);
 	signal(SIGTERM, signalHandler);
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR2, upgradeSignalHandler);
+	signal(SIGUSR1, statsSignalHandler);
 
 	std::cout << PASTEL_VIOLET << "\nIRC server starting..." << DEFAULT << std::endl;
 	std::cout << "Port: " << port << std::endl;
@@ -39,8 +56,11 @@ int main(int argc, char** argv)
 
 	try
 	{
-		Server server(port, password);
+		Server server(port, password, argc == 4 ? Config(argv[3]) : Config());
 		g_server = &server;
+		char executable[PATH_MAX];
+		if (realpath(argv[0], executable))
+			server.setExecutablePath(executable);
 		
 		std::cout << PASTEL_GREEN << "Server initialized and ready!" << DEFAULT << std::endl;
 		std::cout << "Waiting for connections..." << std::endl;
@@ -0,0 +1,530 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+// connection scalability run: starts ircserv in a scratch directory, then grows the number of
+// connections step by step (10k, 50k, 100k by default). A share of them is semi-active (one
+// channel message per second), the rest stays idle after registering.
+// After each step it holds the load and reports:
+// - server RSS per connection (VmRSS growth over the empty server)
+// - connect-to-welcome latency (accept + registration, until 001)
+// - event loop iteration time (the server's [LOOP] lines, loop_stats = 1)
+// - message latency (a probe pair exchanging timestamped PRIVMSGs)
+// It stops at the first step the server or the host cannot take and says why.
+
+#define C100K_PASSWORD		"c100k"
+#define C100K_BATCH			256		// connections opened before waiting for their 001
+#define C100K_TIMEOUT_S		15		// a batch that gets no 001 for this long is a failure
+#define C100K_PER_SOURCE	25000	// connections per 127.0.0.x source address (ephemeral ports)
+#define C100K_PROBE_MS		100		// interval of the probe messages
+#define C100K_PROBE_NICK	"probe"
+
+struct Options
+{
+	std::vector<long>	steps;
+	long				active;	// percent of semi-active connections
+	long				hold;	// seconds each step is held
+	long				port;
+};
+
+struct Connection
+{
+	int			fd;
+	std::string	in;
+	std::string	out;
+	long		started;	// connect() time, until registered
+	bool		registered;
+	bool		active;
+	long		nextMessage;
+	int			channel;
+	bool		waitingOut;	// EPOLLOUT is set
+};
+
+struct Run
+{
+	Options					options;
+	pid_t					server;
+	std::string				log;
+	int						epoll;
+	std::vector<Connection>	connections;
+	std::vector<size_t>		active;		// semi-active connections (and the probe sender)
+	std::vector<long>		welcome;	// microseconds, this step
+	std::vector<long>		messages;	// probe latencies (microseconds), this step
+	size_t					probe;		// index of the probe receiver (1, the sender is 0)
+	unsigned long			dropped;
+	unsigned long			registering;
+	std::string				failure;
+};
+
+static long nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000L + ts.tv_nsec / 1000);
+}
+
+static long percentile(std::vector<long>& values, int p)
+{
+	if (values.empty())
+		return (0);
+	std::sort(values.begin(), values.end());
+	return (values[std::min(values.size() - 1, values.size() * p / 100)]);
+}
+
+static long rssKilobytes(pid_t pid)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid << "/status";
+	std::ifstream status(path.str().c_str());
+	std::string line;
+	while (std::getline(status, line))
+	{
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			return (std::atol(line.c_str() + 6));
+	}
+	return (0);
+}
+
+// the [LOOP] lines the server logged since offset: iteration-weighted average and max, in microseconds
+static void loopStats(const std::string& log, std::streampos& offset, double& average, double& max)
+{
+	std::ifstream file(log.c_str());
+	file.seekg(offset);
+	std::string line;
+	double busy = 0;
+	unsigned long total = 0;
+	max = 0;
+	while (std::getline(file, line))
+	{
+		size_t tag = line.find("[LOOP] ");
+		size_t word = (tag == std::string::npos) ? tag : line.find(" iterations, ", tag);
+		size_t digits = (word == std::string::npos) ? word : line.find_last_not_of("0123456789", word - 1) + 1;
+		unsigned long iterations;
+		double lineAverage, lineMax;
+		if (digits == std::string::npos || std::sscanf(line.c_str() + digits,
+			"%lu iterations, %lf us average, %lf us max", &iterations, &lineAverage, &lineMax) != 3)
+			continue;
+		busy += iterations * lineAverage;
+		total += iterations;
+		max = std::max(max, lineMax);
+	}
+	file.clear();
+	file.seekg(0, std::ios::end);
+	offset = file.tellg();
+	average = total ? busy / total : 0;
+}
+
+static void handleLine(Run& run, size_t index, const std::string& line)
+{
+	Connection& c = run.connections[index];
+	if (!c.registered && line.find(" 001 ") != std::string::npos)
+	{
+		c.registered = true;
+		--run.registering;
+		run.welcome.push_back(nowMicros() - c.started);
+	}
+	else if (line.compare(0, 6, "ERROR ") == 0 && run.failure.empty())
+		run.failure = "server refused a connection: " + line;
+	else if (index == run.probe)
+	{
+		static const std::string privmsg = " PRIVMSG " C100K_PROBE_NICK " :";
+		size_t text = line.find(privmsg);
+		if (text != std::string::npos)
+			run.messages.push_back(nowMicros() - std::atol(line.c_str() + text + privmsg.length()));
+	}
+}
+
+static void closeConnection(Run& run, size_t index)
+{
+	Connection& c = run.connections[index];
+	close(c.fd); // also leaves the epoll set
+	c.fd = -1;
+	++run.dropped;
+	if (!c.registered)
+		--run.registering;
+}
+
+// write what is queued; EPOLLOUT is only asked for while something is left
+static void flush(Run& run, size_t index)
+{
+	Connection& c = run.connections[index];
+	ssize_t n = send(c.fd, c.out.data(), c.out.length(), MSG_NOSIGNAL);
+	if (n > 0)
+		c.out.erase(0, n);
+	else if (n == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		closeConnection(run, index);
+		return;
+	}
+	bool waiting = !c.out.empty();
+	if (waiting != c.waitingOut)
+	{
+		struct epoll_event event;
+		event.events = waiting ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+		event.data.u64 = index;
+		epoll_ctl(run.epoll, EPOLL_CTL_MOD, c.fd, &event);
+		c.waitingOut = waiting;
+	}
+}
+
+// queue the due messages, then handle what is ready (epoll: the load generator's cost follows the
+// traffic, not the number of connections, so it does not compete with the server for the CPU)
+static void pump(Run& run, int timeout)
+{
+	long now = nowMicros();
+	for (size_t a = 0; a < run.active.size(); ++a)
+	{
+		size_t i = run.active[a];
+		Connection& c = run.connections[i];
+		if (c.fd == -1 || !c.registered || now < c.nextMessage)
+			continue;
+		std::ostringstream line;
+		if (i + 1 == run.probe)
+		{
+			line << "PRIVMSG " C100K_PROBE_NICK " :" << now << "\r\n";
+			c.nextMessage = now + C100K_PROBE_MS * 1000;
+		}
+		else
+		{
+			line << "PRIVMSG #c100k" << c.channel << " :semi-active\r\n";
+			c.nextMessage = now + 1000000;
+		}
+		c.out += line.str();
+		flush(run, i);
+	}
+	struct epoll_event events[1024];
+	int ready = epoll_wait(run.epoll, events, 1024, timeout);
+	char buffer[16384];
+	for (int e = 0; e < ready; ++e)
+	{
+		size_t i = events[e].data.u64;
+		Connection& c = run.connections[i];
+		if (c.fd == -1)
+			continue;
+		if (events[e].events & EPOLLOUT)
+			flush(run, i);
+		if (c.fd == -1 || !(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			continue;
+		ssize_t n;
+		while ((n = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+		{
+			if (c.registered && i != run.probe) // idle and semi-active replies are only drained
+				continue;
+			c.in.append(buffer, n);
+			size_t start = 0;
+			size_t end;
+			while ((end = c.in.find("\r\n", start)) != std::string::npos)
+			{
+				handleLine(run, i, c.in.substr(start, end - start));
+				start = end + 2;
+			}
+			c.in.erase(0, start);
+		}
+		if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+			closeConnection(run, i);
+	}
+}
+
+static bool serverAlive(Run& run)
+{
+	int status;
+	if (waitpid(run.server, &status, WNOHANG) != run.server)
+		return (true);
+	std::ostringstream reason;
+	if (WIFSIGNALED(status))
+		reason << "ircserv was killed by signal " << WTERMSIG(status);
+	else
+		reason << "ircserv exited with status " << WEXITSTATUS(status);
+	run.failure = reason.str();
+	run.server = -1;
+	return (false);
+}
+
+// a non-blocking connection from 127.0.0.<2 + index / C100K_PER_SOURCE>, registration queued
+static bool openConnection(Run& run)
+{
+	size_t index = run.connections.size();
+	struct sockaddr_in source;
+	struct sockaddr_in server;
+	std::memset(&source, 0, sizeof(source));
+	std::memset(&server, 0, sizeof(server));
+	source.sin_family = AF_INET;
+	source.sin_addr.s_addr = htonl(0x7f000002 + index / C100K_PER_SOURCE);
+	server.sin_family = AF_INET;
+	server.sin_port = htons(run.options.port);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd != -1)
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+	if (fd == -1 || bind(fd, (struct sockaddr*)&source, sizeof(source)) == -1
+		|| (connect(fd, (struct sockaddr*)&server, sizeof(server)) == -1 && errno != EINPROGRESS))
+	{
+		std::ostringstream reason;
+		reason << "connection " << index + 1 << ": " << strerror(errno);
+		run.failure = reason.str();
+		if (fd != -1)
+			close(fd);
+		return (false);
+	}
+	Connection c;
+	c.fd = fd;
+	c.started = nowMicros();
+	c.registered = false;
+	c.active = (index == run.probe - 1) || (index != run.probe && (long)(index % 100) < run.options.active);
+	c.nextMessage = c.started + (index % 1000) * 1000; // spread over the first second
+	c.channel = index / 1000;
+	c.waitingOut = false;
+	std::ostringstream login;
+	if (index == run.probe)
+		login << "PASS " C100K_PASSWORD "\r\nNICK " C100K_PROBE_NICK "\r\nUSER probe 0 * :probe\r\n";
+	else
+		login << "PASS " C100K_PASSWORD "\r\nNICK c" << index << "\r\nUSER c" << index << " 0 * :c100k\r\n";
+	if (c.active)
+		login << "JOIN #c100k" << c.channel << "\r\n";
+	c.out = login.str();
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u64 = index;
+	epoll_ctl(run.epoll, EPOLL_CTL_ADD, fd, &event);
+	run.connections.push_back(c);
+	if (c.active)
+		run.active.push_back(index);
+	++run.registering;
+	flush(run, index);
+	return (true);
+}
+
+static bool parseOptions(int argc, char** argv, Options& o)
+{
+	o.active = 1;
+	o.hold = 5;
+	o.port = 16668;
+	std::string steps = "10000,50000,100000";
+	for (int i = 2; i < argc; ++i)
+	{
+		std::string word = argv[i];
+		size_t eq = word.find('=');
+		std::string key = word.substr(0, eq);
+		char* end = NULL;
+		long value = (eq == std::string::npos) ? -1 : std::strtol(word.c_str() + eq + 1, &end, 10);
+		if (key == "steps" && eq != std::string::npos)
+			steps = word.substr(eq + 1);
+		else if (value < 0 || eq + 1 == word.length() || *end != '\0')
+			return (false);
+		else if (key == "active" && value <= 100)
+			o.active = value;
+		else if (key == "hold")
+			o.hold = value;
+		else if (key == "port" && value > 0 && value < 65536)
+			o.port = value;
+		else
+			return (false);
+	}
+	std::istringstream list(steps);
+	std::string step;
+	while (std::getline(list, step, ','))
+	{
+		long value = std::atol(step.c_str());
+		if (value <= 0 || (!o.steps.empty() && value <= o.steps.back()))
+			return (false);
+		o.steps.push_back(value);
+	}
+	return (!o.steps.empty());
+}
+
+static pid_t startServer(const char* binary, const Options& o, const std::string& directory, const std::string& log)
+{
+	std::ofstream config((directory + "/c100k.conf").c_str());
+	config << "password_iterations = 1\n"
+	       << "max_connections_per_host = 0\n"
+	       << "connect_rate = 0\n"
+	       << "accept_budget = 1024\n"
+	       << "loop_stats = 1\n";
+	config.close();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1 || chdir(directory.c_str()) == -1)
+			_exit(127);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		std::ostringstream port;
+		port << o.port;
+		execl(binary, binary, port.str().c_str(), C100K_PASSWORD, "c100k.conf", (char*)NULL);
+		_exit(127);
+	}
+	return (pid);
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (argc < 2 || !parseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: ./tools/c100k <ircserv> [steps=10000,50000,100000] [active=<% semi-active>]"
+		          << " [hold=<seconds per step>] [port=16668]" << std::endl;
+		return (1);
+	}
+	char binary[4096];
+	if (!realpath(argv[1], binary))
+	{
+		std::cerr << "c100k: " << argv[1] << ": " << strerror(errno) << std::endl;
+		return (1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// both processes need a descriptor per connection: ours is raised, ircserv inherits it
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	std::cout << "c100k: descriptor limit " << limit.rlim_cur << ", " << options.active << "% semi-active, "
+	          << options.hold << " s per step" << std::endl;
+	if ((long)limit.rlim_cur < options.steps.back() + 64)
+		std::cout << "c100k: the limit is below the last step, raise the hard limit (ulimit -Hn) to get there" << std::endl;
+
+	char directory[] = "/tmp/c100k.XXXXXX";
+	if (!mkdtemp(directory))
+	{
+		std::cerr << "c100k: cannot create a scratch directory: " << strerror(errno) << std::endl;
+		return (1);
+	}
+	Run run;
+	run.options = options;
+	run.log = std::string(directory) + "/ircserv.log";
+	run.dropped = 0;
+	run.registering = 0;
+	run.probe = 1;
+	run.epoll = epoll_create1(EPOLL_CLOEXEC);
+	run.server = startServer(binary, options, directory, run.log);
+	if (run.server == -1)
+	{
+		std::cerr << "c100k: fork: " << strerror(errno) << std::endl;
+		return (1);
+	}
+
+	// the probe pair first: it also tells when the server is up
+	long deadline = nowMicros() + 5000000;
+	while (run.connections.size() < 2 && nowMicros() < deadline && serverAlive(run))
+	{
+		usleep(100000);
+		run.failure.clear();
+		if (!openConnection(run) || !openConnection(run))
+		{
+			for (size_t i = 0; i < run.connections.size(); ++i)
+				close(run.connections[i].fd);
+			run.connections.clear();
+			run.active.clear();
+			run.registering = 0;
+		}
+	}
+	while (run.connections.size() == 2 && run.registering && nowMicros() < deadline && run.dropped == 0)
+		pump(run, 10);
+	if (run.connections.size() != 2 || run.registering || run.dropped)
+	{
+		std::cerr << "c100k: ircserv did not come up (" << run.failure << "), see " << run.log << std::endl;
+		if (run.server > 0)
+			kill(run.server, SIGKILL);
+		return (1);
+	}
+	long baseline = rssKilobytes(run.server);
+	std::streampos logOffset = 0;
+	double loopAverage, loopMax;
+	loopStats(run.log, logOffset, loopAverage, loopMax);
+
+	std::cout << std::endl << std::fixed << std::setprecision(1)
+	          << "connections    rss MB   bytes/conn   welcome p50/p99 ms   loop avg/max us   msg p50/p99 ms   dropped" << std::endl;
+	for (size_t s = 0; s < options.steps.size() && run.failure.empty(); ++s)
+	{
+		run.welcome.clear();
+		run.messages.clear();
+		long target = options.steps[s];
+		while ((long)run.connections.size() < target && run.failure.empty() && serverAlive(run))
+		{
+			for (int b = 0; b < C100K_BATCH && (long)run.connections.size() < target; ++b)
+			{
+				if (!openConnection(run))
+					break;
+			}
+			long lastProgress = nowMicros();
+			while (run.registering && run.failure.empty())
+			{
+				unsigned long before = run.registering;
+				pump(run, 10);
+				if (run.registering != before)
+					lastProgress = nowMicros();
+				else if (nowMicros() - lastProgress > C100K_TIMEOUT_S * 1000000L)
+				{
+					std::ostringstream reason;
+					reason << run.registering << " connections got no welcome in " << C100K_TIMEOUT_S << " s";
+					run.failure = reason.str();
+				}
+				else if (!serverAlive(run))
+					break;
+			}
+		}
+		if (!run.failure.empty())
+			break;
+
+		// hold the load: semi-active traffic and probe messages run, then the server is measured
+		loopStats(run.log, logOffset, loopAverage, loopMax); // registration is not part of the steady state
+		long end = nowMicros() + options.hold * 1000000L;
+		while (nowMicros() < end && serverAlive(run))
+			pump(run, 10);
+		long rss = rssKilobytes(run.server);
+		loopStats(run.log, logOffset, loopAverage, loopMax);
+		long open = run.connections.size() - run.dropped;
+		std::cout << std::setw(11) << open
+		          << std::setw(9) << rss / 1024.0
+		          << std::setw(13) << (open > 0 ? (rss - baseline) * 1024 / open : 0)
+		          << std::setw(13) << percentile(run.welcome, 50) / 1000.0 << " / " << std::setw(6) << percentile(run.welcome, 99) / 1000.0
+		          << std::setw(10) << loopAverage << " / " << std::setw(7) << loopMax
+		          << std::setw(9) << percentile(run.messages, 50) / 1000.0 << " / " << std::setw(6) << percentile(run.messages, 99) / 1000.0
+		          << std::setw(10) << run.dropped << std::endl;
+	}
+	if (!run.failure.empty())
+		std::cout << "fell over at " << run.connections.size() << " connections: " << run.failure << std::endl;
+
+	for (size_t i = 0; i < run.connections.size(); ++i)
+	{
+		if (run.connections[i].fd != -1)
+			close(run.connections[i].fd);
+	}
+	if (run.server > 0)
+	{
+		kill(run.server, SIGINT);
+		waitpid(run.server, NULL, 0);
+	}
+	if (run.failure.empty())
+	{
+		unlink(run.log.c_str());
+		unlink((std::string(directory) + "/c100k.conf").c_str());
+		unlink((std::string(directory) + "/ircserv.snapshot").c_str());
+		rmdir(directory);
+	}
+	else
+		std::cout << "server log: " << run.log << std::endl;
+	return (run.failure.empty() ? 0 : 1);
+}
@@ -0,0 +1,56 @@
+#include "AccountStore.hpp"
+#include "PasswordHash.hpp"
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+
+// build the account file read by ircserv (config key account_db)
+// reads "<account> <password>" lines on stdin, one account per line
+int main(int argc, char** argv)
+{
+	if (argc != 2 && argc != 3)
+	{
+		std::cerr << "Usage: ./tools/ircaccount <account file> [iterations] < accounts.txt" << std::endl;
+		return (1);
+	}
+	unsigned int iterations = (argc == 3) ? std::atoi(argv[2]) : PASSWORD_DEFAULT_ITERATIONS;
+	if (iterations == 0)
+	{
+		std::cerr << "Error: iterations must be a positive number" << std::endl;
+		return (1);
+	}
+
+	std::vector<std::pair<std::string, PasswordHash> > accounts;
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		std::istringstream iss(line);
+		std::string name, password;
+		if (!(iss >> name) || name[0] == '#')
+			continue;
+		if (!(iss >> password))
+		{
+			std::cerr << "Warning: no password for account '" << name << "'" << std::endl;
+			continue;
+		}
+		try
+		{
+			accounts.push_back(std::make_pair(name, PasswordHash::fromPassword(password, iterations)));
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Error: " << e.what() << std::endl;
+			return (1);
+		}
+	}
+	if (!AccountStore::write(argv[1], accounts))
+	{
+		std::cerr << "Error: cannot write " << argv[1] << std::endl;
+		return (1);
+	}
+	AccountStore store;
+	if (!store.open(argv[1]))
+		return (1);
+	std::cout << store.size() << " accounts written to " << argv[1] << std::endl;
+	return (0);
+}
@@ -0,0 +1,236 @@
+#include "Capture.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// replays a capture_file against a server: every captured connection is opened again and sends what
+// the original client sent, at the captured pace (1), N times faster, or as fast as possible (max)
+// what the server answers is read and dropped, so its send buffers never fill up
+
+#define REPLAY_DRAIN_MS	1000	// how long the replies are read after the last record
+
+struct Connection
+{
+	int			fd;
+	std::string	pending;	// not sent yet (the server was not reading fast enough)
+	bool		closing;	// the capture closed it: close once pending is out
+};
+
+struct Stats
+{
+	unsigned long	connections;
+	unsigned long	failed;
+	unsigned long	records;
+	unsigned long	bytesSent;
+	unsigned long	bytesReceived;
+	double			maxLag;		// seconds a record was sent after its scheduled time
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static int connectTo(const struct addrinfo* address)
+{
+	int fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+	if (connect(fd, address->ai_addr, address->ai_addrlen) == -1)
+	{
+		close(fd);
+		return (-1);
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return (fd);
+}
+
+static void sendPending(Connection& c, Stats& stats)
+{
+	while (!c.pending.empty())
+	{
+		ssize_t n = send(c.fd, c.pending.data(), c.pending.length(), MSG_NOSIGNAL);
+		if (n <= 0)
+		{
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			c.pending.clear(); // the server dropped us: the rest of this connection is lost
+			c.closing = true;
+			return;
+		}
+		stats.bytesSent += n;
+		c.pending.erase(0, n);
+	}
+}
+
+// wait for replies and writable sockets until deadline (or one pass if deadline is past)
+static void pump(std::map<uint64_t, Connection>& connections, double deadline, Stats& stats)
+{
+	std::vector<struct pollfd> fds;
+	std::vector<uint64_t> ids;
+	do
+	{
+		fds.clear();
+		ids.clear();
+		for (std::map<uint64_t, Connection>::iterator it = connections.begin(); it != connections.end(); ++it)
+		{
+			struct pollfd p;
+			p.fd = it->second.fd;
+			p.events = POLLIN | (it->second.pending.empty() ? 0 : POLLOUT);
+			p.revents = 0;
+			fds.push_back(p);
+			ids.push_back(it->first);
+		}
+		double left = deadline - now();
+		int timeout = left > 0 ? (int)(left * 1000) : 0;
+		if (fds.empty())
+		{
+			if (timeout > 0)
+				usleep(timeout * 1000);
+			return;
+		}
+		if (poll(&fds[0], fds.size(), timeout) <= 0)
+			continue;
+		for (size_t i = 0; i < fds.size(); ++i)
+		{
+			Connection& c = connections[ids[i]];
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				char buffer[65536];
+				ssize_t n;
+				while ((n = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+					stats.bytesReceived += n;
+				if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					c.pending.clear();
+					c.closing = true;
+				}
+			}
+			if (fds[i].revents & POLLOUT)
+				sendPending(c, stats);
+			if (c.closing && c.pending.empty())
+			{
+				close(c.fd);
+				connections.erase(ids[i]);
+			}
+		}
+	} while (now() < deadline);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4 || argc > 5)
+	{
+		std::cerr << "Usage: ./tools/ircreplay <capture file> <host> <port> [1|<speed factor>|max]" << std::endl;
+		return (1);
+	}
+	double speed = 1;
+	if (argc == 5)
+		speed = (std::string(argv[4]) == "max") ? 0 : std::strtod(argv[4], NULL);
+	if (argc == 5 && speed <= 0 && std::string(argv[4]) != "max")
+	{
+		std::cerr << "ircreplay: invalid speed " << argv[4] << std::endl;
+		return (1);
+	}
+
+	CaptureReader capture;
+	if (!capture.open(argv[1]))
+		return (1);
+	struct addrinfo hints;
+	struct addrinfo* address;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	int gai = getaddrinfo(argv[2], argv[3], &hints, &address);
+	if (gai != 0)
+	{
+		std::cerr << "ircreplay: " << argv[2] << ": " << gai_strerror(gai) << std::endl;
+		return (1);
+	}
+
+	std::map<uint64_t, Connection> connections;
+	Stats stats;
+	std::memset(&stats, 0, sizeof(stats));
+	CaptureRecord record;
+	uint64_t captured = 0;
+	double start = now();
+	while (capture.next(record))
+	{
+		++stats.records;
+		captured = record.time;
+		double due = (speed > 0) ? start + record.time / 1e6 / speed : 0;
+		if (due > now())
+			pump(connections, due, stats);
+		else if (stats.records % 64 == 0) // behind schedule or at max speed: still read the replies
+			pump(connections, 0, stats);
+		if (due > 0 && now() - due > stats.maxLag)
+			stats.maxLag = now() - due;
+
+		std::map<uint64_t, Connection>::iterator it = connections.find(record.connection);
+		if (it == connections.end() && record.type != CAPTURE_CLOSE)
+		{
+			// CAPTURE_CONNECT, or data of a connection opened before the capture started
+			Connection c;
+			c.fd = connectTo(address);
+			c.closing = false;
+			if (c.fd == -1)
+			{
+				++stats.failed;
+				continue;
+			}
+			++stats.connections;
+			it = connections.insert(std::make_pair(record.connection, c)).first;
+		}
+		if (it == connections.end())
+			continue;
+		if (record.type == CAPTURE_DATA)
+		{
+			it->second.pending.append(record.data, record.length);
+			sendPending(it->second, stats);
+		}
+		else if (record.type == CAPTURE_CLOSE)
+			it->second.closing = true;
+		if (it->second.closing && it->second.pending.empty())
+		{
+			close(it->second.fd);
+			connections.erase(it);
+		}
+	}
+	if (!capture.atEnd())
+		std::cerr << "ircreplay: truncated record, the rest of the file is skipped" << std::endl;
+	double sent = now();
+	pump(connections, sent + REPLAY_DRAIN_MS / 1000.0, stats);
+	for (std::map<uint64_t, Connection>::iterator it = connections.begin(); it != connections.end(); ++it)
+		close(it->second.fd);
+	freeaddrinfo(address);
+
+	double elapsed = sent - start;
+	std::cout << std::fixed << std::setprecision(3)
+	          << "records      : " << stats.records << std::endl
+	          << "connections  : " << stats.connections << " opened, " << stats.failed << " failed" << std::endl
+	          << "sent         : " << stats.bytesSent << " bytes" << std::endl
+	          << "received     : " << stats.bytesReceived << " bytes" << std::endl
+	          << "captured span: " << captured / 1e6 << " s" << std::endl
+	          << "replayed in  : " << elapsed << " s (" << (elapsed > 0 ? stats.records / elapsed : 0) << " records/s)" << std::endl;
+	if (speed > 0)
+		std::cout << "max lag      : " << stats.maxLag * 1000 << " ms" << std::endl;
+	return (stats.failed ? 1 : 0);
+}
@@ -0,0 +1,382 @@
+#include "Server.hpp"
+#include "Transport.hpp"
+#include "Snapshot.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// runs the server in-process on a SimTransport and drives simulated clients from a second thread:
+// registration, then channel messages carrying their send time, received by every other member
+// the server's own output goes to /dev/null, the results to the original stdout
+// the same seed injects the same faults, so two runs of one build are comparable
+
+#define SIMBENCH_PASSWORD	"simbench"
+#define SIMBENCH_STALL_S	10	// a phase gives up after this long without progress
+
+struct Options
+{
+	long	clients;
+	long	messages;	// per client
+	long	channels;
+	long	eagain;		// percent
+	long	maxWrite;	// bytes, 0: no cap
+	long	latency;	// microseconds
+	long	seed;
+	long	port;		// the TCP listener the server opens anyway
+};
+
+struct SimClient
+{
+	int			fd;
+	std::string	in;
+	std::string	out;
+	bool		joined;
+};
+
+struct Bench
+{
+	Options					options;
+	Server*					server;
+	SimTransport*			sim;
+	pthread_t				serverThread;
+	std::vector<SimClient>	clients;
+	std::vector<long>		latencies;	// microseconds, one per delivered message
+	unsigned long			joined;
+	unsigned long			expected;	// deliveries the message phase waits for
+	int						missCounter;	// the server thread's cache misses, -1: no counter
+	std::ostringstream		report;
+};
+
+static long nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000L + ts.tv_nsec / 1000);
+}
+
+static double serverCpu(const Bench& bench)
+{
+	clockid_t clock;
+	struct timespec ts;
+	if (pthread_getcpuclockid(bench.serverThread, &clock) != 0 || clock_gettime(clock, &ts) == -1)
+		return (0);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+// hardware cache misses of the server thread (the main thread: its tid is the pid), user space only
+// -1 where there is no counter for it (no PMU in the VM, perf_event_paranoid): the report says n/a
+static int openCacheMissCounter()
+{
+	struct perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (syscall(SYS_perf_event_open, &attr, getpid(), -1, -1, 0));
+}
+
+static long cacheMisses(const Bench& bench)
+{
+	unsigned long long count;
+	if (bench.missCounter == -1 || read(bench.missCounter, &count, sizeof(count)) != sizeof(count))
+		return (-1);
+	return ((long)count);
+}
+
+static void handleLine(Bench& bench, SimClient& client, const std::string& line)
+{
+	size_t space = line.find(' ');
+	if (space == std::string::npos)
+		return;
+	std::string rest = line.substr(space + 1);
+	if (rest.compare(0, 4, "366 ") == 0 && !client.joined)
+	{
+		client.joined = true;
+		++bench.joined;
+	}
+	else if (rest.compare(0, 8, "PRIVMSG ") == 0)
+	{
+		size_t text = line.find(" :", space);
+		if (text != std::string::npos)
+			bench.latencies.push_back(nowMicros() - std::atol(line.c_str() + text + 2));
+	}
+}
+
+// one pass: write what is pending, read what arrived, let the transport deliver delayed output
+static bool pass(Bench& bench, std::vector<struct pollfd>& fds)
+{
+	bench.sim->pump();
+	bool progress = false;
+	for (size_t i = 0; i < bench.clients.size(); ++i)
+	{
+		SimClient& c = bench.clients[i];
+		if (!c.out.empty())
+		{
+			ssize_t n = send(c.fd, c.out.data(), c.out.length(), MSG_NOSIGNAL);
+			if (n > 0)
+			{
+				c.out.erase(0, n);
+				progress = true;
+			}
+		}
+		fds[i].fd = c.fd;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	if (poll(&fds[0], fds.size(), bench.options.latency > 0 ? 1 : 10) <= 0)
+		return (progress);
+	char buffer[65536];
+	for (size_t i = 0; i < fds.size(); ++i)
+	{
+		if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		SimClient& c = bench.clients[i];
+		ssize_t n;
+		while ((n = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+		{
+			c.in.append(buffer, n);
+			progress = true;
+		}
+		size_t start = 0;
+		size_t end;
+		while ((end = c.in.find("\r\n", start)) != std::string::npos)
+		{
+			handleLine(bench, c, c.in.substr(start, end - start));
+			start = end + 2;
+		}
+		c.in.erase(0, start);
+	}
+	return (progress);
+}
+
+static bool registered(const Bench& bench)
+{
+	return (bench.joined >= bench.clients.size());
+}
+
+static bool delivered(const Bench& bench)
+{
+	return (bench.latencies.size() >= bench.expected);
+}
+
+// passes until done(), sending one message per client in each of the first rounds passes
+// (so the timestamps stay honest); false if the phase stalled
+static bool runPhase(Bench& bench, long rounds, bool (*done)(const Bench&))
+{
+	std::vector<struct pollfd> fds(bench.clients.size());
+	long lastProgress = nowMicros();
+	for (long round = 0; round < rounds || !done(bench); ++round)
+	{
+		for (size_t i = 0; round < rounds && i < bench.clients.size(); ++i)
+		{
+			std::ostringstream line;
+			line << "PRIVMSG #sim" << i % bench.options.channels << " :" << nowMicros() << "\r\n";
+			bench.clients[i].out += line.str();
+		}
+		if (pass(bench, fds))
+			lastProgress = nowMicros();
+		else if (nowMicros() - lastProgress > SIMBENCH_STALL_S * 1000000L)
+			return (false);
+	}
+	return (true);
+}
+
+static void* drive(void* arg)
+{
+	Bench& bench = *(Bench*)arg;
+	const Options& o = bench.options;
+	std::ostream& out = bench.report;
+	out << std::fixed << std::setprecision(3);
+
+	double cpu = serverCpu(bench);
+	long start = nowMicros();
+	for (long i = 0; i < o.clients; ++i)
+	{
+		SimClient c;
+		c.fd = bench.sim->connect();
+		c.joined = false;
+		if (c.fd == -1)
+		{
+			out << "connect failed after " << i << " clients: " << strerror(errno) << std::endl;
+			break;
+		}
+		std::ostringstream login;
+		login << "PASS " SIMBENCH_PASSWORD "\r\nNICK sim" << i << "\r\nUSER sim" << i << " 0 * :simbench\r\n"
+		      << "JOIN #sim" << i % o.channels << "\r\n";
+		c.out = login.str();
+		bench.clients.push_back(c);
+	}
+	bool ok = runPhase(bench, 0, registered);
+	double elapsed = (nowMicros() - start) / 1e6;
+	out << "registration : " << bench.joined << "/" << bench.clients.size() << " joined in " << elapsed << " s ("
+	    << (elapsed > 0 ? bench.joined / elapsed : 0) << " clients/s), server cpu " << serverCpu(bench) - cpu << " s"
+	    << (ok ? "" : " [stalled]") << std::endl;
+
+	std::vector<long> members(o.channels, 0);
+	for (size_t i = 0; i < bench.clients.size(); ++i)
+		++members[i % o.channels];
+	bench.expected = 0;
+	for (size_t i = 0; i < bench.clients.size(); ++i)
+		bench.expected += o.messages * (members[i % o.channels] - 1);
+	if (ok && o.messages > 0)
+	{
+		bench.latencies.reserve(bench.expected);
+		cpu = serverCpu(bench);
+		long misses = cacheMisses(bench);
+		start = nowMicros();
+		ok = runPhase(bench, o.messages, delivered);
+		elapsed = (nowMicros() - start) / 1e6;
+		if (misses != -1)
+			misses = cacheMisses(bench) - misses;
+		std::vector<long>& l = bench.latencies;
+		std::sort(l.begin(), l.end());
+		out << "messages     : " << l.size() << "/" << bench.expected << " delivered in " << elapsed << " s ("
+		    << (elapsed > 0 ? l.size() / elapsed : 0) << " deliveries/s), server cpu " << serverCpu(bench) - cpu << " s"
+		    << (ok ? "" : " [stalled]") << std::endl;
+		if (!l.empty())
+			out << "latency      : p50 " << l[l.size() / 2] / 1000.0 << " ms, p99 " << l[l.size() * 99 / 100] / 1000.0
+			    << " ms, max " << l.back() / 1000.0 << " ms" << std::endl;
+		if (misses == -1)
+			out << "cache misses : n/a (no hardware counter for this process)" << std::endl;
+		else
+			out << "cache misses : " << misses << " in the server thread ("
+			    << (l.empty() ? 0 : (double)misses / l.size()) << " per delivery)" << std::endl;
+	}
+	for (size_t i = 0; i < bench.clients.size(); ++i)
+		close(bench.clients[i].fd);
+	bench.server->shutdown();
+	return (NULL);
+}
+
+static bool parseOptions(int argc, char** argv, Options& o)
+{
+	o.clients = 1000;
+	o.messages = 10;
+	o.channels = 0;
+	o.eagain = 0;
+	o.maxWrite = 0;
+	o.latency = 0;
+	o.seed = 1;
+	o.port = 16667;
+	const char* names[] = { "clients", "messages", "channels", "eagain", "maxwrite", "latency", "seed", "port" };
+	long* values[] = { &o.clients, &o.messages, &o.channels, &o.eagain, &o.maxWrite, &o.latency, &o.seed, &o.port };
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string word = argv[i];
+		size_t eq = word.find('=');
+		size_t n = 0;
+		while (n < 8 && (eq == std::string::npos || word.substr(0, eq) != names[n]))
+			++n;
+		char* end = NULL;
+		long value = (n < 8) ? std::strtol(word.c_str() + eq + 1, &end, 10) : 0;
+		if (n == 8 || eq + 1 == word.length() || *end != '\0' || value < 0)
+		{
+			std::cerr << "simbench: invalid option '" << word << "'" << std::endl;
+			return (false);
+		}
+		*values[n] = value;
+	}
+	if (o.channels == 0)
+		o.channels = o.clients / 50 + 1;
+	return (o.clients > 0 && o.eagain < 100);
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		std::cerr << "Usage: ./tools/simbench [clients=1000] [messages=10] [channels=clients/50+1] [eagain=<%>]"
+		          << " [maxwrite=<bytes>] [latency=<us>] [seed=1] [port=16667]" << std::endl;
+		return (1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	struct rlimit limit; // two descriptors per client: the server's and the driver's
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// the server writes its snapshot to the working directory: run in a scratch one
+	char directory[] = "/tmp/simbench.XXXXXX";
+	if (!mkdtemp(directory) || chdir(directory) == -1)
+	{
+		std::cerr << "simbench: cannot create a scratch directory: " << strerror(errno) << std::endl;
+		return (1);
+	}
+	{
+		std::ofstream config("simbench.conf");
+		config << "password_iterations = 1\n";
+	}
+
+	int results = dup(STDOUT_FILENO); // the server logs every line: that goes to /dev/null
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	close(devnull);
+
+	Bench bench;
+	bench.options = options;
+	bench.joined = 0;
+	bench.expected = 0;
+	bench.missCounter = openCacheMissCounter();
+	SimTransport sim(options.seed);
+	sim.setEagainPercent(options.eagain);
+	sim.setMaxWrite(options.maxWrite);
+	sim.setLatency(options.latency);
+	bench.sim = &sim;
+	int status = 0;
+	try
+	{
+		Server server(options.port, SIMBENCH_PASSWORD, Config("simbench.conf"));
+		server.setTransport(&sim);
+		bench.server = &server;
+		bench.serverThread = pthread_self();
+		pthread_t driver;
+		if (pthread_create(&driver, NULL, drive, &bench) != 0)
+			throw std::runtime_error("pthread_create failed");
+		server.run();
+		pthread_join(driver, NULL);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "simbench: " << e.what() << std::endl;
+		status = 1;
+	}
+	std::cout.flush();
+	if (bench.missCounter != -1)
+		close(bench.missCounter);
+	unlink("simbench.conf");
+	unlink(SNAPSHOT_FILE);
+	if (chdir("/") == 0)
+		rmdir(directory);
+
+	std::ostringstream header;
+	header << "simbench     : " << options.clients << " clients, " << options.channels << " channels, "
+	       << options.messages << " messages each, eagain " << options.eagain << "%, maxwrite " << options.maxWrite
+	       << ", latency " << options.latency << " us, seed " << options.seed << std::endl;
+	std::string text = header.str() + bench.report.str();
+	if (write(results, text.data(), text.length()) == -1)
+		status = 1;
+	close(results);
+	return (status);
+}
@@ -0,0 +1,239 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// channel throughput through ircserv, plaintext port against TLS port
+// a sender thread pipelines PRIVMSGs to a channel, the main thread times how long the receiver takes to get them all
+
+#define BENCH_CHANNEL	"#tlsbench"
+
+struct Connection
+{
+	int			fd;
+	SSL*		tls;
+	std::string	pending; // received bytes not yet split into lines
+};
+
+struct SenderArgs
+{
+	Connection*	connection;
+	int			messages;
+	std::string	line;
+	bool		ok;
+};
+
+static bool writeAll(Connection& c, const std::string& data)
+{
+	size_t sent = 0;
+	while (sent < data.length())
+	{
+		int n = c.tls ? SSL_write(c.tls, data.c_str() + sent, data.length() - sent)
+			: (int)send(c.fd, data.c_str() + sent, data.length() - sent, 0);
+		if (n <= 0)
+		{
+			if (!c.tls && n == -1 && errno == EINTR)
+				continue;
+			return (false);
+		}
+		sent += n;
+	}
+	return (true);
+}
+
+// next complete line, false on EOF or error
+static bool readLine(Connection& c, std::string& line)
+{
+	while (true)
+	{
+		size_t end = c.pending.find("\r\n");
+		if (end != std::string::npos)
+		{
+			line = c.pending.substr(0, end);
+			c.pending.erase(0, end + 2);
+			return (true);
+		}
+		char buffer[65536];
+		int n = c.tls ? SSL_read(c.tls, buffer, sizeof(buffer)) : (int)recv(c.fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+		{
+			if (!c.tls && n == -1 && errno == EINTR)
+				continue;
+			return (false);
+		}
+		c.pending.append(buffer, n);
+	}
+}
+
+// read until a line contains token
+static bool waitFor(Connection& c, const std::string& token)
+{
+	std::string line;
+	while (readLine(c, line))
+	{
+		if (line.compare(0, 5, "PING ") == 0 && !writeAll(c, "PONG " + line.substr(5) + "\r\n"))
+			return (false);
+		if (line.find(token) != std::string::npos)
+			return (true);
+	}
+	return (false);
+}
+
+static bool openConnection(Connection& c, const char* host, const char* port, SSL_CTX* context)
+{
+	struct addrinfo hints;
+	struct addrinfo* result;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+		return (false);
+	c.fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	bool connected = c.fd != -1 && connect(c.fd, result->ai_addr, result->ai_addrlen) == 0;
+	freeaddrinfo(result);
+	if (!connected)
+		return (false);
+	int opt = 1;
+	setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	c.tls = NULL;
+	if (!context)
+		return (true);
+	c.tls = SSL_new(context);
+	SSL_set_fd(c.tls, c.fd);
+	return (SSL_connect(c.tls) == 1);
+}
+
+static void closeConnection(Connection& c)
+{
+	if (c.tls)
+	{
+		SSL_shutdown(c.tls);
+		SSL_free(c.tls);
+	}
+	if (c.fd != -1)
+		close(c.fd);
+}
+
+static void* senderMain(void* arg)
+{
+	SenderArgs* args = static_cast<SenderArgs*>(arg);
+	std::string batch;
+	args->ok = true;
+	for (int i = 0; i < args->messages && args->ok; ++i)
+	{
+		batch += args->line;
+		if (batch.length() >= 16384 || i + 1 == args->messages)
+		{
+			args->ok = writeAll(*args->connection, batch);
+			batch.clear();
+		}
+	}
+	return (NULL);
+}
+
+// one run: returns the elapsed seconds, or a negative value on failure
+static double runBench(const char* host, const char* port, const std::string& password, SSL_CTX* context,
+	int messages, int size, const std::string& tag)
+{
+	Connection sender;
+	Connection receiver;
+	sender.fd = receiver.fd = -1;
+	sender.tls = receiver.tls = NULL;
+	if (!openConnection(sender, host, port, context) || !openConnection(receiver, host, port, context))
+	{
+		std::cerr << tag << ": cannot connect to " << host << ":" << port << std::endl;
+		closeConnection(sender);
+		closeConnection(receiver);
+		return (-1);
+	}
+	std::string receiverNick = tag + "r";
+	std::string senderNick = tag + "s";
+	bool ready = writeAll(receiver, "PASS " + password + "\r\nNICK " + receiverNick + "\r\nUSER b 0 * :bench\r\nJOIN " BENCH_CHANNEL "\r\n")
+		&& waitFor(receiver, " 366 ")
+		&& writeAll(sender, "PASS " + password + "\r\nNICK " + senderNick + "\r\nUSER b 0 * :bench\r\nJOIN " BENCH_CHANNEL "\r\n")
+		&& waitFor(sender, " 366 ")
+		&& waitFor(receiver, " JOIN ");
+	if (!ready)
+	{
+		std::cerr << tag << ": registration failed" << std::endl;
+		closeConnection(sender);
+		closeConnection(receiver);
+		return (-1);
+	}
+
+	SenderArgs args;
+	args.connection = &sender;
+	args.messages = messages;
+	args.line = "PRIVMSG " BENCH_CHANNEL " :" + std::string(size, 'x') + "\r\n";
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	pthread_t thread;
+	pthread_create(&thread, NULL, &senderMain, &args);
+
+	int received = 0;
+	std::string line;
+	while (received < messages && readLine(receiver, line))
+	{
+		if (line.find(" PRIVMSG " BENCH_CHANNEL " ") != std::string::npos)
+			++received;
+	}
+	gettimeofday(&end, NULL);
+	pthread_join(thread, NULL);
+	closeConnection(sender);
+	closeConnection(receiver);
+	if (!args.ok || received < messages)
+	{
+		std::cerr << tag << ": connection lost after " << received << " messages" << std::endl;
+		return (-1);
+	}
+	return ((end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6);
+}
+
+static void report(const std::string& name, double seconds, int messages, int size)
+{
+	double bytes = (double)messages * (size + std::strlen("PRIVMSG " BENCH_CHANNEL " :\r\n"));
+	std::cout << name << ": " << messages << " messages in " << seconds << " s, "
+	          << (long)(messages / seconds) << " msg/s, " << bytes / seconds / (1024 * 1024) << " MiB/s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 5 || argc > 7)
+	{
+		std::cerr << "Usage: ./tools/tlsbench <host> <port> <tls port> <password> [messages] [message size]" << std::endl;
+		return (1);
+	}
+	int messages = (argc > 5) ? std::atoi(argv[5]) : 100000;
+	int size = (argc > 6) ? std::atoi(argv[6]) : 200;
+	if (messages <= 0 || size <= 0 || size > 400)
+	{
+		std::cerr << "Error: messages must be positive and size between 1 and 400" << std::endl;
+		return (1);
+	}
+
+	SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+	if (!context)
+		return (1);
+	SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL); // benchmark only: self-signed certificates are fine
+
+	double plain = runBench(argv[1], argv[2], argv[4], NULL, messages, size, "plain");
+	double tls = runBench(argv[1], argv[3], argv[4], context, messages, size, "tls");
+	SSL_CTX_free(context);
+	if (plain < 0 || tls < 0)
+		return (1);
+	report("plaintext", plain, messages, size);
+	report("tls      ", tls, messages, size);
+	std::cout << "tls / plaintext time: " << tls / plain << std::endl;
+	return (0);
+}